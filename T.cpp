@@ -3,92 +3,705 @@
 #include <vector>
 #include <string>
 #include <cstring>
+#include <cerrno>
 #include <termios.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <dirent.h>
 #include <algorithm>
+#include <map>
+#include <deque>
+#include <memory>
+#include <iterator>
+#include <cstdint>
+#include <climits>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <regex.h>
 
 using namespace std;
 
 enum Mode {
     NORMAL,
     INSERT,
-    COMMAND
+    COMMAND,
+    SEARCH
 };
 
+// Highlighter state carried from one line to the next
+enum LexState {
+    LEX_NORMAL,
+    LEX_BLOCK_COMMENT
+};
+
+// PieceTable - document text stored as pieces of the original file and of an
+// append-only add buffer. Pieces live in a treap ordered by position and every
+// node caches length and newline count of its subtree, so insert, delete and
+// finding the start of a line are O(log n) whatever the file size.
+class PieceTable {
+public:
+    static const size_t PIECE = 4096;       // Max piece length (bounds scans)
+    static const size_t BLOCK = 64 * 1024;  // Size of add buffer block
+    
+    PieceTable() : root(nullptr), original(nullptr), originalSize(0), indexed(0),
+        mapped(false), guardSlot(-1), addUsed(BLOCK), seed(0x9E3779B97F4A7C15ull) {}
+    
+    ~PieceTable() {
+        clear();
+    }
+    
+    PieceTable(const PieceTable&) = delete;
+    PieceTable& operator=(const PieceTable&) = delete;
+    
+    // Replace whole content (text becomes the original buffer)
+    void load(string text) {
+        clear();
+        originalText = std::move(text);
+        original = originalText.data();
+        originalSize = originalText.size();
+    }
+    
+    // Replace whole content by a read-only mapping of a file, pages are
+    // read only when shown or searched and never copied when edited
+    bool mapFile(const string& filename) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        void* data = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if (data == MAP_FAILED) return false;
+        clear();
+        guardSlot = guardRange((const char*)data, st.st_size);
+        if (guardSlot < 0) { // Unguarded mapping could kill us, read instead
+            munmap(data, st.st_size);
+            return false;
+        }
+        original = (const char*)data;
+        originalSize = st.st_size;
+        mapped = true;
+        return true;
+    }
+    
+    // A mapped file can shrink under us (truncated or rewritten in place by
+    // another process), reading past its new end then raises SIGBUS. For
+    // ranges registered with guardRange the guard maps a zero page over the
+    // faulting page so the read is retried and sees NULs, and marks the
+    // range as shrunk. Any other SIGBUS kills the process as before.
+    static const int MAX_GUARDED = 256;
+    
+    static void guardMappings() {
+        pageSize = sysconf(_SC_PAGESIZE);
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = onMappingFault;
+        action.sa_flags = SA_SIGINFO;
+        sigaction(SIGBUS, &action, nullptr);
+    }
+    
+    // Register mapping [start, start + size) with the guard, returns its
+    // slot or -1 if all slots are taken (then it must not stay mapped)
+    static int guardRange(const char* start, size_t size) {
+        for (int i = 0; i < MAX_GUARDED; i++) {
+            uintptr_t empty = 0;
+            if (guarded[i].start.compare_exchange_strong(empty, (uintptr_t)start)) {
+                guarded[i].shrunk = false;
+                guarded[i].end = (uintptr_t)start + size;
+                return i;
+            }
+        }
+        return -1;
+    }
+    
+    // Forget a slot (before the range is unmapped)
+    static void unguardRange(int slot) {
+        if (slot < 0) return;
+        guarded[slot].end = 0;
+        guarded[slot].start = 0;
+    }
+    
+    static bool shrunk(int slot) {
+        return slot >= 0 && guarded[slot].shrunk;
+    }
+    
+    // Whether the mapped file shrank on disk (text past its new end then
+    // reads as NUL and must not be saved over the file by mistake)
+    bool changedOnDisk() const { return mapped && shrunk(guardSlot); }
+    
+    size_t size() const { return length(root) + originalSize - indexed; }
+    
+    // Number of lines (indexes whole file)
+    size_t lineCount() {
+        indexTo(SIZE_MAX, SIZE_MAX);
+        return newlines(root) + 1;
+    }
+    
+    // Whether line exists (indexes file only up to that line)
+    bool hasLine(size_t line) {
+        indexTo(0, line);
+        return line <= newlines(root);
+    }
+    
+    // Line containing offset pos
+    size_t lineOf(size_t pos) {
+        indexTo(pos, 0);
+        const Node* t = root;
+        size_t line = 0;
+        while (t) {
+            size_t leftLength = length(t->left);
+            if (pos < leftLength) {
+                t = t->left;
+            } else if (pos <= leftLength + t->length) {
+                return line + newlines(t->left) + countNewlines(t->data, pos - leftLength);
+            } else {
+                line += newlines(t->left) + t->lines;
+                pos -= leftLength + t->length;
+                t = t->right;
+            }
+        }
+        return line;
+    }
+    
+    // Offset of first character of a line (line index is cached)
+    size_t lineStart(size_t line) {
+        if (line == 0) return 0;
+        auto cached = lineCache.find(line);
+        if (cached != lineCache.end()) return cached->second;
+        indexTo(0, line);
+        size_t start = findNewline(line) + 1;
+        if (lineCache.size() > 4096) lineCache.clear();
+        lineCache[line] = start;
+        return start;
+    }
+    
+    size_t lineLength(size_t line) {
+        size_t start = lineStart(line);
+        size_t end = hasLine(line + 1) ? lineStart(line + 1) - 1 : size();
+        return end > start ? end - start : 0;
+    }
+    
+    string line(size_t line) {
+        return substr(lineStart(line), lineLength(line));
+    }
+    
+    string substr(size_t pos, size_t len) const {
+        string result;
+        result.reserve(len);
+        forEachSpan(pos, len, [&](const char* data, size_t n) {
+            result.append(data, n);
+        });
+        return result;
+    }
+    
+    // Call f(data, n) for every contiguous span of [pos, pos + len) in order
+    template <typename F>
+    void forEachSpan(size_t pos, size_t len, F f) const {
+        spans(root, pos, len, f);
+        // Part of the file not indexed yet follows the pieces
+        size_t end = pos + len;
+        size_t tail = length(root);
+        if (end > tail) {
+            size_t from = max(pos, tail);
+            f(original + indexed + (from - tail), end - from);
+        }
+    }
+    
+    void insert(size_t pos, const string& text) {
+        if (text.empty()) return;
+        indexTo(pos, 0);
+        invalidate(pos);
+        size_t done = 0;
+        // Typing right after the last added text just grows that piece
+        if (addUsed < BLOCK) {
+            size_t n = min(text.size(), BLOCK - addUsed);
+            const char* tail = addBlocks.back().get() + addUsed;
+            if (extend(root, pos, tail, n, text.data())) {
+                addUsed += n;
+                done = n;
+            }
+        }
+        if (done == text.size()) return;
+        size_t at = pos + done;
+        Node* middle = nullptr;
+        while (done < text.size()) {
+            if (addUsed == BLOCK) {
+                addBlocks.emplace_back(new char[BLOCK]);
+                addUsed = 0;
+            }
+            size_t n = min(text.size() - done, min(PIECE, BLOCK - addUsed));
+            char* data = addBlocks.back().get() + addUsed;
+            memcpy(data, text.data() + done, n);
+            addUsed += n;
+            done += n;
+            middle = merge(middle, newNode(data, n));
+        }
+        Node *left, *right;
+        split(root, at, left, right);
+        root = merge(merge(left, middle), right);
+    }
+    
+    void erase(size_t pos, size_t len) {
+        if (len == 0) return;
+        indexTo(pos + len, 0);
+        invalidate(pos);
+        Node *left, *middle, *right;
+        split(root, pos, left, middle);
+        split(middle, len, middle, right);
+        destroy(middle);
+        root = merge(left, right);
+    }
+
+private:
+    // Guarded range, lock-free so the signal handler can read it
+    struct GuardedRange {
+        atomic<uintptr_t> start;  // 0 = free slot
+        atomic<uintptr_t> end;    // Set after start, cleared before it
+        atomic<bool> shrunk;      // A page of the range was replaced
+    };
+    
+    static size_t pageSize;
+    static GuardedRange guarded[MAX_GUARDED];
+    
+    static void onMappingFault(int, siginfo_t* info, void*) {
+        uintptr_t addr = (uintptr_t)info->si_addr;
+        for (int i = 0; i < MAX_GUARDED; i++) {
+            if (addr >= guarded[i].start && addr < guarded[i].end) {
+                uintptr_t page = addr & ~(uintptr_t)(pageSize - 1);
+                if (mmap((void*)page, pageSize, PROT_READ,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+                    break;
+                }
+                guarded[i].shrunk = true;
+                return;
+            }
+        }
+        // Not a guarded file: default action, the signal (pending until the
+        // handler returns, for a sent one) or repeated fault kills
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = SIG_DFL;
+        sigaction(SIGBUS, &action, nullptr);
+        raise(SIGBUS);
+    }
+    
+    struct Node {
+        const char* data;    // Text of the piece (original or add buffer)
+        size_t length;       // Length of the piece
+        size_t lines;        // Newlines in the piece
+        uint64_t priority;   // Treap priority (random)
+        Node* left;
+        Node* right;
+        size_t totalLength;  // Length of subtree
+        size_t totalLines;   // Newlines in subtree
+    };
+    
+    Node* root;
+    const char* original;                  // Text loaded from file
+    size_t originalSize;
+    size_t indexed;                        // Bytes of original in pieces
+    bool mapped;                           // Whether original is a mapping
+    int guardSlot;                         // Guard slot of the mapping
+    string originalText;                   // Original if not mapped
+    vector<unique_ptr<char[]>> addBlocks;  // Add buffer (blocks never move)
+    size_t addUsed;                        // Bytes used in last add block
+    uint64_t seed;                         // State of priority generator
+    mutable map<size_t, size_t> lineCache; // Line -> offset of its start
+    
+    void clear() {
+        destroy(root);
+        root = nullptr;
+        lineCache.clear();
+        if (mapped) {
+            unguardRange(guardSlot);
+            munmap((void*)original, originalSize);
+        }
+        guardSlot = -1;
+        mapped = false;
+        originalText.clear();
+        original = nullptr;
+        originalSize = 0;
+        indexed = 0;
+    }
+    
+    // Turn the file into pieces until pos lies within pieces and the line
+    // after line is started (or the whole file is indexed)
+    void indexTo(size_t pos, size_t line) {
+        while (indexed < originalSize &&
+               (length(root) < pos || newlines(root) < line)) {
+            size_t end = min(indexed + 1024 * 1024, originalSize);
+            while (indexed < end) {
+                size_t len = min(PIECE, end - indexed);
+                root = merge(root, newNode(original + indexed, len));
+                indexed += len;
+            }
+        }
+    }
+    
+    static size_t length(const Node* t) { return t ? t->totalLength : 0; }
+    static size_t newlines(const Node* t) { return t ? t->totalLines : 0; }
+    
+    static size_t countNewlines(const char* data, size_t n) {
+        size_t count = 0;
+        const char* end = data + n;
+        while ((data = (const char*)memchr(data, '\n', end - data))) {
+            count++;
+            data++;
+        }
+        return count;
+    }
+    
+    static void update(Node* t) {
+        t->totalLength = length(t->left) + t->length + length(t->right);
+        t->totalLines = newlines(t->left) + t->lines + newlines(t->right);
+    }
+    
+    Node* newNode(const char* data, size_t n) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        Node* t = new Node{data, n, countNewlines(data, n), seed,
+                           nullptr, nullptr, 0, 0};
+        update(t);
+        return t;
+    }
+    
+    static void destroy(Node* t) {
+        if (!t) return;
+        destroy(t->left);
+        destroy(t->right);
+        delete t;
+    }
+    
+    static Node* merge(Node* a, Node* b) {
+        if (!a) return b;
+        if (!b) return a;
+        if (a->priority > b->priority) {
+            a->right = merge(a->right, b);
+            update(a);
+            return a;
+        }
+        b->left = merge(a, b->left);
+        update(b);
+        return b;
+    }
+    
+    // Split t into first pos characters and the rest (a piece is cut in two
+    // if pos falls inside it)
+    void split(Node* t, size_t pos, Node*& left, Node*& right) {
+        if (!t) {
+            left = right = nullptr;
+            return;
+        }
+        size_t leftLength = length(t->left);
+        if (pos <= leftLength) {
+            split(t->left, pos, left, t->left);
+            update(t);
+            right = t;
+        } else if (pos >= leftLength + t->length) {
+            split(t->right, pos - leftLength - t->length, t->right, right);
+            update(t);
+            left = t;
+        } else {
+            size_t cut = pos - leftLength;
+            Node* tail = newNode(t->data + cut, t->length - cut);
+            t->length = cut;
+            t->lines -= tail->lines;
+            right = merge(tail, t->right);
+            t->right = nullptr;
+            update(t);
+            left = t;
+        }
+    }
+    
+    // Grow the piece ending at pos by n characters if it ends where the add
+    // buffer continues (tail), so consecutive typing adds no pieces
+    bool extend(Node* t, size_t pos, const char* tail, size_t n,
+                const char* text) {
+        if (!t) return false;
+        size_t leftLength = length(t->left);
+        bool grown;
+        if (pos <= leftLength) {
+            grown = extend(t->left, pos, tail, n, text);
+        } else if (pos == leftLength + t->length && t->data + t->length == tail &&
+                   t->length + n <= PIECE) {
+            memcpy((char*)tail, text, n);
+            size_t added = countNewlines(text, n);
+            t->length += n;
+            t->lines += added;
+            grown = true;
+        } else if (pos > leftLength + t->length) {
+            grown = extend(t->right, pos - leftLength - t->length, tail, n, text);
+        } else {
+            grown = false;
+        }
+        if (grown) update(t);
+        return grown;
+    }
+    
+    // Position of the k-th newline (k >= 1)
+    size_t findNewline(size_t k) const {
+        const Node* t = root;
+        size_t base = 0;
+        while (t) {
+            size_t leftLines = newlines(t->left);
+            if (k <= leftLines) {
+                t = t->left;
+            } else if (k <= leftLines + t->lines) {
+                k -= leftLines;
+                const char* p = t->data;
+                while (true) {
+                    p = (const char*)memchr(p, '\n', t->data + t->length - p);
+                    // Newlines can vanish when the mapped file shrinks (see
+                    // guardMappings) until the text is detached from it
+                    if (!p) p = t->data + t->length - 1;
+                    if (--k == 0) break;
+                    p++;
+                }
+                return base + length(t->left) + (p - t->data);
+            } else {
+                k -= leftLines + t->lines;
+                base += length(t->left) + t->length;
+                t = t->right;
+            }
+        }
+        return size();
+    }
+    
+    template <typename F>
+    static void spans(const Node* t, size_t pos, size_t len, F& f) {
+        if (!t || len == 0) return;
+        size_t leftLength = length(t->left);
+        if (pos < leftLength) {
+            spans(t->left, pos, min(len, leftLength - pos), f);
+        }
+        size_t end = pos + len;
+        size_t pieceEnd = leftLength + t->length;
+        if (pos < pieceEnd && end > leftLength) {
+            size_t from = max(pos, leftLength);
+            f(t->data + (from - leftLength), min(end, pieceEnd) - from);
+        }
+        if (end > pieceEnd) {
+            size_t from = max(pos, pieceEnd);
+            spans(t->right, from - pieceEnd, end - from, f);
+        }
+    }
+    
+    // Forget cached starts of lines after an edit at pos
+    void invalidate(size_t pos) {
+        while (!lineCache.empty() && prev(lineCache.end())->second > pos) {
+            lineCache.erase(prev(lineCache.end()));
+        }
+    }
+};
+
+const size_t PieceTable::PIECE;
+const size_t PieceTable::BLOCK;
+const int PieceTable::MAX_GUARDED;
+size_t PieceTable::pageSize = 4096;
+PieceTable::GuardedRange PieceTable::guarded[PieceTable::MAX_GUARDED];
+
+// Permissions of new files follow the umask, read once at startup as it can
+// only be read by setting it (saves run on other threads)
+static mode_t readUmask() {
+    mode_t mask = umask(0);
+    umask(mask);
+    return mask;
+}
+static const mode_t UMASK = readUmask();
+
 // Buffer class - represents a single file in memory
 class Buffer {
 public:
-    vector<string> lines;
+    PieceTable text;
     string filename;
     bool modified;
+    bool scratch;            // Not backed by a file (never loaded or saved)
+    bool changedOnDisk;      // File shrank on disk while mapped (see detachShrunk)
     int cursorX;
     int cursorY;
+    int scrollY;             // First line shown on screen
+    unsigned long version;   // Incremented on every change of text
     
-    // Undo/Redo state for this buffer
-    struct BufferState {
-        vector<string> lines;
-        int cursorX;
-        int cursorY;
+    // Undo/Redo state for this buffer: each group is a list of edits,
+    // consecutive keystrokes are merged into one group
+    struct Edit {
+        size_t pos;
+        string removed;
+        string inserted;
     };
     
-    vector<BufferState> undoStack;
-    vector<BufferState> redoStack;
-    const size_t MAX_UNDO_HISTORY = 100;
+    struct UndoGroup {
+        vector<Edit> edits;
+        int cursorX, cursorY;           // Cursor before the group
+        int afterX, afterY;             // Cursor after the group
+        size_t bytes;                   // Memory held by the group
+    };
+    
+    // Highlighter state at start and end of each line, kept for the lines
+    // lexed so far; lines syntaxDirtyFrom..syntaxDirtyTo were edited since
+    struct LineSyntax {
+        unsigned char start;
+        unsigned char end;
+    };
+    
+    vector<LineSyntax> syntax;
+    int syntaxDirtyFrom;
+    int syntaxDirtyTo;
+    
+    // Background save
+    enum SaveResult {
+        SAVE_RUNNING,
+        SAVE_OK,
+        SAVE_FAILED
+    };
+    
+    thread saver;
+    atomic<int> saveResult;
+    
+    deque<UndoGroup> undoStack;
+    vector<UndoGroup> redoStack;
+    size_t undoBytes;
+    bool groupOpen;
+    const size_t MAX_UNDO_BYTES = 64 * 1024 * 1024;
     
-    Buffer(string fname = "untitled.txt") : 
-        filename(fname), modified(false), cursorX(0), cursorY(0) {
-        loadFile();
+    Buffer(string fname = "untitled.txt", bool scratchBuffer = false) : 
+        filename(fname), modified(false), scratch(scratchBuffer), changedOnDisk(false), cursorX(0),
+        cursorY(0), scrollY(0), version(0), syntaxDirtyFrom(INT_MAX), syntaxDirtyTo(-1),
+        saveResult(SAVE_OK), undoBytes(0), groupOpen(false) {
+        if (!scratch) loadFile();
+    }
+    
+    ~Buffer() {
+        finishSave();
     }
     
     void loadFile() {
-        ifstream file(filename);
-        lines.clear();
-        if (file.is_open()) {
-            string line;
-            while (getline(file, line)) {
-                lines.push_back(line);
+        // Regular files are mapped and indexed as far as they are viewed,
+        // anything else (pipes, empty files) is read
+        if (!text.mapFile(filename)) {
+            ifstream file(filename, ios::binary);
+            string content;
+            if (file.is_open()) {
+                content.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+                file.close();
             }
-            file.close();
-        }
-        
-        // Always ensure at least one empty line
-        if (lines.empty()) {
-            lines.push_back("");
+            text.load(std::move(content));
         }
+        changedOnDisk = false;
+        syntax.clear();
         
         // Reset cursor to safe position
         cursorX = 0;
         cursorY = 0;
+        scrollY = 0;
     }
     
-    bool save() {
-        ofstream file(filename);
-        if (file.is_open()) {
-            for (size_t i = 0; i < lines.size(); i++) {
-                file << lines[i];
-                if (i < lines.size() - 1) file << "\n";
+    // Start writing the text to the file on a background thread, editing
+    // goes on while the spans of the text at this moment are written
+    // Spans of the whole text, they stay valid while the text is edited as
+    // piece data never moves (pieces next to each other in memory are merged)
+    vector<iovec> spans() const {
+        vector<iovec> result;
+        text.forEachSpan(0, text.size(), [&](const char* data, size_t n) {
+            if (!result.empty() && (const char*)result.back().iov_base + result.back().iov_len == data) {
+                result.back().iov_len += n;
+            } else {
+                result.push_back(iovec{(void*)data, n});
             }
-            file.close();
-            modified = false;
-            return true;
-        }
-        return false;
+        });
+        return result;
     }
     
-    void saveState() {
-        BufferState state;
-        state.lines = lines;
-        state.cursorX = cursorX;
-        state.cursorY = cursorY;
-        
-        undoStack.push_back(state);
-        
-        if (undoStack.size() > MAX_UNDO_HISTORY) {
-            undoStack.erase(undoStack.begin());
+    // Keep a text whose mapped file shrank on disk in memory instead, so
+    // newline counts of pieces match their data (lost text reads as NUL)
+    // again; saving it then needs force. Nothing may read spans meanwhile.
+    void detachShrunk() {
+        finishSave();
+        text.load(text.substr(0, text.size()));
+        changedOnDisk = true;
+        syntax.clear();
+        version++;
+    }
+    
+    bool save(bool force = false) {
+        if (scratch || (changedOnDisk && !force)) return false;
+        finishSave();
+        saveResult = SAVE_RUNNING;
+        saver = thread(&Buffer::writeSpans, this, filename, spans());
+        modified = false;
+        changedOnDisk = false;
+        return true;
+    }
+    
+    // Whether a save was started and has completed since
+    bool saveDone() const {
+        return saver.joinable() && saveResult != SAVE_RUNNING;
+    }
+    
+    // Wait for save in progress, false if it failed
+    bool finishSave() {
+        if (!saver.joinable()) return true;
+        saver.join();
+        if (saveResult == SAVE_FAILED) {
+            modified = true;
+            return false;
         }
-        
+        return true;
+    }
+    
+    int lineCount() { return text.lineCount(); }
+    
+    bool hasLine(int y) { return y >= 0 && text.hasLine(y); }
+    
+    int lineLength(int y) { return text.lineLength(y); }
+    
+    string line(int y) { return text.line(y); }
+    
+    // Offset of (x, y) in the text
+    size_t offset(int x, int y) { return text.lineStart(y) + x; }
+    
+    // Edit the text, recording the change for undo
+    void insertText(size_t pos, const string& s) {
+        record(pos, "", s);
+        replace(pos, "", s);
+    }
+    
+    void eraseText(size_t pos, size_t len) {
+        string removed = text.substr(pos, len);
+        record(pos, removed, "");
+        replace(pos, removed, "");
+    }
+    
+    // Add text at the end which is not an edit (no undo, stays unmodified)
+    void append(const string& s) {
+        replace(text.size(), "", s);
+    }
+    
+    // Drop text and history
+    void clear() {
+        replace(0, text.substr(0, text.size()), "");
+        undoStack.clear();
         redoStack.clear();
+        undoBytes = 0;
+        groupOpen = false;
+        cursorX = cursorY = scrollY = 0;
+        modified = false;
+    }
+    
+    // Next edit starts a new undo group (cursor moved, mode changed)
+    void closeUndoGroup() {
+        groupOpen = false;
     }
     
     bool undo() {
@@ -96,19 +709,21 @@ public:
             return false;
         }
         
-        BufferState currentState;
-        currentState.lines = lines;
-        currentState.cursorX = cursorX;
-        currentState.cursorY = cursorY;
-        redoStack.push_back(currentState);
-        
-        BufferState prevState = undoStack.back();
+        UndoGroup group = std::move(undoStack.back());
         undoStack.pop_back();
+        undoBytes -= group.bytes;
         
-        lines = prevState.lines;
-        cursorX = prevState.cursorX;
-        cursorY = prevState.cursorY;
+        for (auto it = group.edits.rbegin(); it != group.edits.rend(); ++it) {
+            replace(it->pos, it->inserted, it->removed);
+        }
+        group.afterX = cursorX;
+        group.afterY = cursorY;
+        cursorX = group.cursorX;
+        cursorY = group.cursorY;
         
+        redoStack.push_back(std::move(group));
+        groupOpen = false;
+        modified = true;
         return true;
     }
     
@@ -117,23 +732,666 @@ public:
             return false;
         }
         
-        BufferState currentState;
-        currentState.lines = lines;
-        currentState.cursorX = cursorX;
-        currentState.cursorY = cursorY;
-        undoStack.push_back(currentState);
-        
-        BufferState nextState = redoStack.back();
+        UndoGroup group = std::move(redoStack.back());
         redoStack.pop_back();
         
-        lines = nextState.lines;
-        cursorX = nextState.cursorX;
-        cursorY = nextState.cursorY;
+        for (const auto& edit : group.edits) {
+            replace(edit.pos, edit.removed, edit.inserted);
+        }
+        cursorX = group.afterX;
+        cursorY = group.afterY;
+        
+        undoBytes += group.bytes;
+        undoStack.push_back(std::move(group));
+        groupOpen = false;
+        modified = true;
+        return true;
+    }
+
+private:
+    // Write spans to a temporary file and rename it over target, so target
+    // holds either the old or the new text even if the editor crashes
+    void writeSpans(string target, vector<iovec> spans) {
+        // A symbolic link stays a link, the file it points to is replaced
+        char resolved[PATH_MAX];
+        if (realpath(target.c_str(), resolved)) target = resolved;
+        // Temporary gets a unique name next to the target (same filesystem
+        // for rename), so other editors or files are never overwritten
+        string name = target + ".XXXXXX";
+        vector<char> pattern(name.begin(), name.end());
+        pattern.push_back('\0');
+        int fd = mkstemp(pattern.data());
+        string temporary = pattern.data();
+        struct stat st;
+        bool existed = stat(target.c_str(), &st) == 0;
+        bool ok = fd >= 0;
+        if (ok) fchmod(fd, existed ? st.st_mode & 07777 : 0666 & ~UMASK);
+        
+        size_t i = 0;
+        while (ok && i < spans.size()) {
+            int count = min(spans.size() - i, (size_t)IOV_MAX);
+            ssize_t n = writev(fd, &spans[i], count);
+            if (n < 0) {
+                ok = errno == EINTR;
+                continue;
+            }
+            // Skip what was written, last span may be written partly
+            while (i < spans.size() && (size_t)n >= spans[i].iov_len) {
+                n -= spans[i].iov_len;
+                i++;
+            }
+            if (n > 0) {
+                spans[i].iov_base = (char*)spans[i].iov_base + n;
+                spans[i].iov_len -= n;
+            }
+        }
+        
+        if (fd >= 0) {
+            ok = fsync(fd) == 0 && ok;
+            ok = close(fd) == 0 && ok;
+        }
+        if (ok && rename(temporary.c_str(), target.c_str()) == 0) {
+            // Make the rename itself durable
+            size_t slash = target.rfind('/');
+            string dir = slash == string::npos ? "." : target.substr(0, slash + 1);
+            int dirFd = open(dir.c_str(), O_RDONLY);
+            if (dirFd >= 0) {
+                fsync(dirFd);
+                close(dirFd);
+            }
+            saveResult = SAVE_OK;
+        } else {
+            if (fd >= 0) unlink(temporary.c_str());
+            saveResult = SAVE_FAILED;
+        }
+    }
+    
+    // Replace removed text at pos by inserted, shifting highlighter states
+    // so that only the edited lines have to be lexed again
+    void replace(size_t pos, const string& removed, const string& inserted) {
+        size_t y = text.lineOf(pos);
+        version++;
+        text.erase(pos, removed.size());
+        text.insert(pos, inserted);
+        if (y >= syntax.size()) return;
+        
+        int removedLines = count(removed.begin(), removed.end(), '\n');
+        int insertedLines = count(inserted.begin(), inserted.end(), '\n');
+        if (y + removedLines + 1 >= syntax.size()) {
+            syntax.resize(y + 1);
+        } else {
+            syntax.erase(syntax.begin() + y + 1, syntax.begin() + y + 1 + removedLines);
+            syntax.insert(syntax.begin() + y + 1, insertedLines, LineSyntax{0, 0});
+        }
+        
+        if (syntaxDirtyTo > (int)y + removedLines) {
+            syntaxDirtyTo += insertedLines - removedLines;
+        } else if (syntaxDirtyTo >= (int)y) {
+            syntaxDirtyTo = y;
+        }
+        syntaxDirtyFrom = min(syntaxDirtyFrom, (int)y);
+        syntaxDirtyTo = max(syntaxDirtyTo, (int)y + insertedLines);
+    }
+    
+    void record(size_t pos, const string& removed, const string& inserted) {
+        redoStack.clear();
+        if (!groupOpen || undoStack.empty()) {
+            UndoGroup group;
+            group.cursorX = cursorX;
+            group.cursorY = cursorY;
+            group.afterX = cursorX;
+            group.afterY = cursorY;
+            group.bytes = sizeof(UndoGroup);
+            undoStack.push_back(std::move(group));
+            undoBytes += sizeof(UndoGroup);
+            groupOpen = true;
+        }
+        
+        UndoGroup& group = undoStack.back();
+        size_t added = removed.size() + inserted.size();
+        Edit* last = group.edits.empty() ? nullptr : &group.edits.back();
+        if (last && removed.empty() && last->removed.empty() &&
+            pos == last->pos + last->inserted.size()) {
+            last->inserted += inserted; // Typing
+        } else if (last && inserted.empty() && last->inserted.empty() &&
+                   pos + removed.size() == last->pos) {
+            last->removed.insert(0, removed); // Backspacing
+            last->pos = pos;
+        } else if (last && inserted.empty() && removed.size() <= last->inserted.size() &&
+                   pos + removed.size() == last->pos + last->inserted.size()) {
+            last->inserted.resize(last->inserted.size() - removed.size()); // Typo fixed
+        } else {
+            group.edits.push_back(Edit{pos, removed, inserted});
+            added += sizeof(Edit);
+        }
+        group.bytes += added;
+        undoBytes += added;
+        
+        // Oldest groups are dropped to keep history in memory budget
+        while (undoBytes > MAX_UNDO_BYTES && undoStack.size() > 1) {
+            undoBytes -= undoStack.front().bytes;
+            undoStack.pop_front();
+        }
+    }
+};
+
+// Matcher - compiled search pattern. Pattern starting with \v is a POSIX
+// extended regular expression (matched within lines), anything else is a
+// plain substring. regexec serializes callers of one regex_t, so each
+// thread compiles its own Matcher.
+class Matcher {
+public:
+    string literal;  // Pattern without \v prefix
+    bool regexMode;
+    
+    Matcher() : regexMode(false), compiled(false) {}
+    
+    ~Matcher() {
+        if (compiled) regfree(&re);
+    }
+    
+    Matcher(const Matcher&) = delete;
+    Matcher& operator=(const Matcher&) = delete;
+    
+    // False if pattern is empty or not a valid regex
+    bool compile(const string& pattern) {
+        if (compiled) regfree(&re);
+        regexMode = pattern.compare(0, 2, "\\v") == 0;
+        literal = regexMode ? pattern.substr(2) : pattern;
+        compiled = regexMode && regcomp(&re, literal.c_str(), REG_EXTENDED | REG_NEWLINE) == 0;
+        return !literal.empty() && compiled == regexMode;
+    }
+    
+    // First match in text[from, len), text being whole lines; returns its
+    // offset (npos if none) and sets end to the offset after it
+    size_t find(const char* text, size_t from, size_t len, size_t& end) const {
+        if (!regexMode) {
+            const char* p = (const char*)memmem(text + from, len - from, literal.data(), literal.size());
+            if (!p) return string::npos;
+            end = p - text + literal.size();
+            return p - text;
+        }
+        regmatch_t match;
+        match.rm_so = from;
+        match.rm_eo = len;
+        int flags = REG_STARTEND | (from > 0 && text[from - 1] != '\n' ? REG_NOTBOL : 0);
+        if (regexec(&re, text, 1, &match, flags) != 0) return string::npos;
+        end = match.rm_eo;
+        return match.rm_so;
+    }
+
+private:
+    regex_t re;
+    bool compiled;  // Whether re holds a compiled regex
+};
+
+// Searcher - finds all matches of a pattern in a buffer. Large buffers are
+// scanned on a worker thread, results stay valid until the buffer changes.
+class Searcher {
+public:
+    static const size_t BACKGROUND_SIZE = 4 * 1024 * 1024; // Scan larger texts on worker
+    static const size_t CHUNK = 1024 * 1024;               // Scanned between cancel checks
+    static const size_t MAX_MATCHES = 1 << 22;             // Matches kept at most
+    
+    vector<size_t> results; // Offsets of matches, ascending
+    bool truncated;         // Whether MAX_MATCHES was reached
+    
+    Searcher() : truncated(false), buffer(nullptr), version(0),
+        cancelled(false), finished(false) {}
+    
+    ~Searcher() {
+        cancel();
+    }
+    
+    // Start searching buf, false if pattern is not valid
+    bool start(Buffer* buf, const string& query) {
+        cancel();
+        if (!matcher.compile(query)) return false;
+        buffer = buf;
+        version = buf->version;
+        pattern = query;
+        results.clear();
+        truncated = false;
+        cancelled = false;
+        finished = false;
+        
+        vector<iovec> spans = buf->spans();
+        if (buf->text.size() < BACKGROUND_SIZE) {
+            scan(std::move(spans));
+        } else {
+            worker = thread(&Searcher::scan, this, std::move(spans));
+        }
+        return true;
+    }
+    
+    // Stop search in progress and forget results
+    void cancel() {
+        cancelled = true;
+        if (worker.joinable()) worker.join();
+        buffer = nullptr;
+    }
+    
+    // Whether results are (being) computed for query on current text of buf
+    bool covers(Buffer* buf, const string& query) const {
+        return buffer == buf && version == buf->version && pattern == query;
+    }
+    
+    bool done() {
+        if (!finished) return false;
+        if (worker.joinable()) worker.join();
+        return true;
+    }
+
+private:
+    Buffer* buffer;
+    unsigned long version;  // Version of buffer text searched
+    string pattern;
+    Matcher matcher;
+    thread worker;
+    atomic<bool> cancelled;
+    atomic<bool> finished;
+    
+    void scan(vector<iovec> spans) {
+        if (matcher.regexMode) {
+            scanRegex(spans);
+        } else {
+            scanSubstring(spans);
+        }
+        finished = true;
+    }
+    
+    bool add(size_t pos) {
+        if (results.size() == MAX_MATCHES) {
+            truncated = true;
+            return false;
+        }
+        results.push_back(pos);
+        return true;
+    }
+    
+    // Byte of pattern which is likely rarest in text (letters by frequency in
+    // English and code, anything not listed counts as rare)
+    static size_t rareByte(const string& pattern) {
+        static const char* common = " etaoinsrhld0123456789cumfpgwybvkxjqz";
+        size_t best = 0;
+        size_t bestRank = SIZE_MAX;
+        for (size_t i = 0; i < pattern.size(); i++) {
+            const char* at = pattern[i] ? strchr(common, tolower((unsigned char)pattern[i])) : nullptr;
+            size_t rank = at ? strlen(at) : 0;
+            if (rank < bestRank) {
+                best = i;
+                bestRank = rank;
+            }
+        }
+        return best;
+    }
+    
+    // memchr (vectorized by libc) finds candidates by the rarest byte of
+    // pattern, the whole pattern is compared only there; last m - 1 bytes are
+    // carried to the next span for matches crossing span boundaries
+    void scanSubstring(const vector<iovec>& spans) {
+        const char* needle = matcher.literal.data();
+        size_t m = matcher.literal.size();
+        size_t k = rareByte(matcher.literal);
+        bool useMemmem = false;
+        string carry;
+        size_t base = 0;
+        for (const auto& span : spans) {
+            for (size_t off = 0; off < span.iov_len; off += CHUNK) {
+                if (cancelled) return;
+                const char* data = (const char*)span.iov_base + off;
+                size_t n = min(CHUNK, span.iov_len - off);
+                
+                if (!carry.empty()) {
+                    string joint = carry + string(data, min(n, m - 1));
+                    for (size_t i = 0; i < carry.size() && i + m <= joint.size(); i++) {
+                        if (memcmp(joint.data() + i, needle, m) == 0 && !add(base - carry.size() + i)) return;
+                    }
+                }
+                
+                if (n >= m && useMemmem) {
+                    const char* p = data;
+                    const char* end = data + n;
+                    while ((p = (const char*)memmem(p, end - p, needle, m))) {
+                        if (!add(base + (p - data))) return;
+                        p++;
+                    }
+                } else if (n >= m) {
+                    const char* p = data + k;
+                    const char* last = data + n - m + k;
+                    size_t candidates = 0;
+                    while (p <= last && (p = (const char*)memchr(p, needle[k], last - p + 1))) {
+                        if (memcmp(p - k, needle, m) == 0 && !add(base + (p - k - data))) return;
+                        candidates++;
+                        p++;
+                    }
+                    // Filter byte is common in this text, memmem skips better
+                    useMemmem = candidates > n / 64;
+                }
+                
+                carry.append(data + n - min(n, m - 1), min(n, m - 1));
+                if (carry.size() > m - 1) carry.erase(0, carry.size() - (m - 1));
+                base += n;
+            }
+        }
+    }
+    
+    // Text is matched in blocks of whole lines, so a regex can't match
+    // across a line end and regexec is called per match rather than per line
+    void scanRegex(const vector<iovec>& spans) {
+        string block;
+        size_t blockStart = 0;
+        for (const auto& span : spans) {
+            for (size_t off = 0; off < span.iov_len; off += CHUNK) {
+                if (cancelled) return;
+                size_t n = min(CHUNK, span.iov_len - off);
+                block.append((const char*)span.iov_base + off, n);
+                size_t cut = block.rfind('\n');
+                if (block.size() < CHUNK || cut == string::npos) continue;
+                if (!matchBlock(block.data(), cut + 1, blockStart)) return;
+                block.erase(0, cut + 1);
+                blockStart += cut + 1;
+            }
+        }
+        matchBlock(block.data(), block.size(), blockStart);
+    }
+    
+    bool matchBlock(const char* text, size_t len, size_t offset) {
+        size_t pos = 0;
+        while (pos < len) {
+            size_t end;
+            size_t at = matcher.find(text, pos, len, end);
+            if (at == string::npos) break;
+            if (!add(offset + at)) return false;
+            pos = max(end, at + 1); // Empty match moves on
+        }
+        return true;
+    }
+};
+
+const size_t Searcher::BACKGROUND_SIZE;
+const size_t Searcher::CHUNK;
+const size_t Searcher::MAX_MATCHES;
+
+// Grep - searches open buffers and the files under a directory on a pool of
+// worker threads. Matching lines are collected as "path:line: text" and
+// taken by the editor as they come in.
+class Grep {
+public:
+    static const size_t BLOCK = 1024 * 1024;    // Scanned between cancel checks
+    static const size_t BINARY_PROBE = 8192;    // Files with NUL in here are skipped
+    static const size_t MAX_TEXT = 200;         // Bytes of a matching line kept
+    static const size_t MAX_RESULTS = 100000;   // Lines collected at most
+    
+    // Text of an open buffer, searched instead of its file
+    struct Source {
+        string name;
+        vector<iovec> spans;
+    };
+    
+    atomic<bool> truncated;  // Whether MAX_RESULTS was reached
+    
+    Grep() : truncated(false), busy(0), collected(0), taken(0), running(0), cancelled(false) {}
+    
+    ~Grep() {
+        cancel();
+    }
+    
+    // Start searching sources and the files under dir, false if pattern is
+    // not valid. Spans of sources must stay readable until done or cancel.
+    bool start(const string& query, vector<Source> buffers, const string& dir) {
+        cancel();
+        Matcher check;
+        if (!check.compile(query)) return false;
+        pattern = query;
+        sources = std::move(buffers);
+        skip.clear();
+        for (size_t i = 0; i < sources.size(); i++) {
+            struct stat st;
+            if (stat(sources[i].name.c_str(), &st) == 0) skip.push_back(make_pair(st.st_dev, st.st_ino));
+            jobs.push_back(Job{"", (int)i});
+        }
+        jobs.push_back(Job{dir, -1});
+        results.clear();
+        collected = 0;
+        taken = 0;
+        truncated = false;
+        cancelled = false;
         
+        int count = max(1u, thread::hardware_concurrency());
+        running = count;
+        for (int i = 0; i < count; i++) {
+            workers.push_back(thread(&Grep::work, this));
+        }
         return true;
     }
+    
+    // Stop search in progress and forget results
+    void cancel() {
+        {
+            lock_guard<mutex> lock(guard);
+            cancelled = true;
+        }
+        jobsChanged.notify_all();
+        for (auto& w : workers) {
+            w.join();
+        }
+        workers.clear();
+        jobs.clear();
+        busy = 0;
+        results.clear();
+    }
+    
+    // Move lines found since last call to the end of out, returns their count
+    size_t take(string& out) {
+        lock_guard<mutex> lock(guard);
+        out += results;
+        results.clear();
+        size_t n = collected - taken;
+        taken = collected;
+        return n;
+    }
+    
+    bool done() const {
+        return running == 0;
+    }
+
+private:
+    // Directory or file to search (source < 0), or an open buffer
+    struct Job {
+        string path;
+        int source;
+    };
+    
+    string pattern;
+    vector<Source> sources;
+    vector<pair<dev_t, ino_t>> skip;  // Files open in buffers
+    vector<thread> workers;
+    mutex guard;                      // Guards jobs, busy, results and counts
+    condition_variable jobsChanged;
+    deque<Job> jobs;
+    int busy;                         // Workers running a job
+    string results;                   // Lines not taken yet
+    size_t collected;
+    size_t taken;
+    atomic<int> running;              // Workers not finished
+    atomic<bool> cancelled;
+    
+    void work() {
+        Matcher matcher; // regexec serializes threads sharing a regex_t
+        matcher.compile(pattern);
+        unique_lock<mutex> lock(guard);
+        while (true) {
+            jobsChanged.wait(lock, [this]() { return !jobs.empty() || busy == 0 || cancelled; });
+            if (cancelled || jobs.empty()) break;
+            Job job = std::move(jobs.front());
+            jobs.pop_front();
+            busy++;
+            lock.unlock();
+            if (job.source >= 0) {
+                scanSource(matcher, sources[job.source]);
+            } else {
+                scanPath(matcher, job.path);
+            }
+            lock.lock();
+            busy--;
+            if (busy == 0 && jobs.empty()) jobsChanged.notify_all();
+        }
+        lock.unlock();
+        running--;
+    }
+    
+    // Queue entries of a directory, or search a regular file
+    void scanPath(Matcher& matcher, const string& path) {
+        int fd = open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+        if (fd < 0) return;
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+        } else if (S_ISDIR(st.st_mode)) {
+            scanDirectory(path, fd);
+        } else {
+            if (S_ISREG(st.st_mode) && st.st_size > 0 &&
+                find(skip.begin(), skip.end(), make_pair(st.st_dev, st.st_ino)) == skip.end()) {
+                scanFile(matcher, path, fd, st.st_size);
+            }
+            close(fd);
+        }
+    }
+    
+    // Hidden entries and symbolic links are not followed
+    void scanDirectory(const string& path, int fd) {
+        DIR* dir = fdopendir(fd);
+        if (!dir) {
+            close(fd);
+            return;
+        }
+        vector<Job> found;
+        while (dirent* entry = readdir(dir)) {
+            if (entry->d_name[0] == '.' || entry->d_type == DT_LNK) continue;
+            found.push_back(Job{path == "." ? string(entry->d_name) : path + "/" + entry->d_name, -1});
+        }
+        closedir(dir);
+        
+        lock_guard<mutex> lock(guard);
+        move(found.begin(), found.end(), back_inserter(jobs));
+        jobsChanged.notify_all();
+    }
+    
+    // Files are mapped while the guard has a free slot (a file shrinking
+    // meanwhile then reads as NUL), otherwise read
+    void scanFile(Matcher& matcher, const string& path, int fd, size_t size) {
+        void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) return;
+        int slot = PieceTable::guardRange((const char*)mapped, size);
+        if (slot < 0) {
+            munmap(mapped, size);
+            string copy(size, '\0');
+            size_t got = 0;
+            ssize_t n;
+            while (got < size && (n = pread(fd, &copy[got], size - got, got)) > 0) {
+                got += n;
+            }
+            scanData(matcher, path, copy.data(), got);
+            return;
+        }
+        madvise(mapped, size, MADV_SEQUENTIAL);
+        scanData(matcher, path, (const char*)mapped, size);
+        PieceTable::unguardRange(slot);
+        munmap(mapped, size);
+    }
+    
+    void scanData(Matcher& matcher, const string& path, const char* data, size_t size) {
+        size_t line = 0;
+        if (!memchr(data, 0, min(size, BINARY_PROBE))) {
+            size_t pos = 0;
+            while (pos < size && !cancelled) {
+                size_t end = min(size, pos + BLOCK);
+                const char* newline = (const char*)memchr(data + end, '\n', size - end);
+                end = newline ? newline - data + 1 : size;
+                scanLines(matcher, path, data + pos, end - pos, line);
+                pos = end;
+            }
+        }
+    }
+    
+    // Spans are copied into blocks of whole lines
+    void scanSource(Matcher& matcher, const Source& source) {
+        string block;
+        size_t line = 0;
+        for (const iovec& span : source.spans) {
+            const char* data = (const char*)span.iov_base;
+            size_t len = span.iov_len;
+            while (len > 0 && !cancelled) {
+                size_t n = min(len, BLOCK);
+                block.append(data, n);
+                data += n;
+                len -= n;
+                size_t last = block.rfind('\n');
+                if (block.size() < BLOCK || last == string::npos) continue;
+                scanLines(matcher, source.name, block.data(), last + 1, line);
+                block.erase(0, last + 1);
+            }
+        }
+        if (!block.empty() && !cancelled) scanLines(matcher, source.name, block.data(), block.size(), line);
+    }
+    
+    // Collect each matching line of text once. Text is whole lines, line is
+    // the number of lines before it and is advanced past it.
+    void scanLines(Matcher& matcher, const string& name, const char* text, size_t len, size_t& line) {
+        string found;
+        size_t count = 0;
+        size_t pos = 0;
+        size_t counted = 0;
+        while (pos < len) {
+            size_t end;
+            size_t at = matcher.find(text, pos, len, end);
+            if (at == string::npos) break;
+            size_t lineStart = at;
+            while (lineStart > pos && text[lineStart - 1] != '\n') {
+                lineStart--;
+            }
+            const char* after = (const char*)memchr(text + at, '\n', len - at);
+            size_t lineEnd = after ? after - text : len;
+            
+            line += std::count(text + counted, text + lineStart, '\n');
+            counted = lineStart;
+            found += name + ":" + to_string(line + 1) + ": ";
+            found.append(text + lineStart, min(lineEnd - lineStart, MAX_TEXT));
+            found += '\n';
+            count++;
+            pos = lineEnd + 1;
+        }
+        line += std::count(text + counted, text + len, '\n');
+        if (count > 0) add(found, count);
+    }
+    
+    void add(const string& found, size_t count) {
+        lock_guard<mutex> lock(guard);
+        if (cancelled) return;
+        size_t end = found.size();
+        if (collected + count >= MAX_RESULTS) {
+            count = MAX_RESULTS - collected;
+            end = 0;
+            for (size_t i = 0; i < count; i++) {
+                end = found.find('\n', end) + 1;
+            }
+        }
+        results.append(found, 0, end);
+        collected += count;
+        if (collected == MAX_RESULTS) {
+            truncated = true;
+            cancelled = true; // Workers stop, results are kept
+            jobsChanged.notify_all();
+        }
+    }
 };
 
+const size_t Grep::BLOCK;
+const size_t Grep::BINARY_PROBE;
+const size_t Grep::MAX_TEXT;
+const size_t Grep::MAX_RESULTS;
+
 class TextEditor {
 private:
     vector<Buffer*> buffers;
@@ -143,6 +1401,26 @@ private:
     string statusMessage;
     struct termios orig_termios;
     bool syntaxHighlightEnabled;
+    vector<string> screen;   // Rows as last drawn (back buffer)
+    string frame;            // Output of one frame, written at once
+    int screenHeight;
+    int screenWidth;
+    Searcher searcher;
+    string searchPattern;    // Last pattern searched for
+    bool pendingJump;        // Jump to match once search is done
+    bool pendingForward;
+    int searchOriginX;       // Cursor when search prompt was opened
+    int searchOriginY;
+    Grep grep;
+    Buffer* grepBuffer;      // Buffer showing grep results, if any
+    size_t grepMatches;      // Lines shown in grepBuffer
+    bool grepRunning;
+    string input;            // Bytes read but not handled yet
+    size_t inputPos;
+    static int resizePipe[2]; // Written by SIGWINCH handler
+    static const int FRAME_MS = 16;   // Screen drawn at most once per frame
+    static const int POLL_MS = 100;   // Background work checked this often
+    static const int ESCAPE_MS = 50;  // Wait for rest of an escape sequence
     
     // Syntax highlighting colors
     const string COLOR_KEYWORD = "\033[38;5;205m";
@@ -171,7 +1449,7 @@ private:
         raw.c_iflag &= ~(IXON | ICRNL);
         raw.c_oflag &= ~(OPOST);
         raw.c_cc[VMIN] = 0;
-        raw.c_cc[VTIME] = 1;
+        raw.c_cc[VTIME] = 0;
         
         tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
     }
@@ -181,106 +1459,178 @@ private:
         write(STDOUT_FILENO, "\033[H", 3);
     }
 
-    bool isKeyword(const string& word) {
-        for (const auto& kw : cppKeywords) {
-            if (word == kw) return true;
+    // Keyword hash: seed is searched at startup so that no two keywords
+    // share a slot, lookup is then one hash and one compare. Table has at
+    // least 8 slots per keyword; if no seed in MAX_KEYWORD_SEEDS works (e.g.
+    // two keywords hash alike for every seed), slots keep short chains.
+    static const unsigned MAX_KEYWORD_SEEDS = 4096;
+    unsigned keywordSeed;
+    size_t keywordMask;              // Slots - 1 (slots is a power of two)
+    vector<int> keywordStart;        // Chain of slot i is keywordChain[start[i]..start[i+1])
+    vector<int> keywordChain;        // Keyword indices grouped by slot
+    
+    static unsigned keywordHash(const char* s, size_t n, unsigned seed) {
+        unsigned h = seed;
+        h = h * 31 + (unsigned char)s[0];
+        h = h * 31 + (unsigned char)s[n / 2];
+        h = h * 31 + (unsigned char)s[n - 1];
+        h = h * 31 + n;
+        h ^= h >> 11;
+        return h;
+    }
+    
+    void buildKeywordHash() {
+        size_t slots = 1;
+        while (slots < 8 * cppKeywords.size()) slots *= 2;
+        keywordMask = slots - 1;
+        
+        vector<int> count(slots);
+        bool collision = true;
+        for (keywordSeed = 1; keywordSeed <= MAX_KEYWORD_SEEDS && collision; keywordSeed++) {
+            fill(count.begin(), count.end(), 0);
+            collision = false;
+            for (size_t i = 0; i < cppKeywords.size() && !collision; i++) {
+                const string& kw = cppKeywords[i];
+                collision = count[keywordHash(kw.data(), kw.length(), keywordSeed) & keywordMask]++ > 0;
+            }
+        }
+        keywordSeed--; // Last seed tried, collision-free unless all failed
+        
+        keywordStart.assign(slots + 1, 0);
+        for (const string& kw : cppKeywords) {
+            keywordStart[(keywordHash(kw.data(), kw.length(), keywordSeed) & keywordMask) + 1]++;
+        }
+        for (size_t i = 0; i < slots; i++) {
+            keywordStart[i + 1] += keywordStart[i];
+        }
+        keywordChain.resize(cppKeywords.size());
+        vector<int> next(keywordStart.begin(), keywordStart.end() - 1);
+        for (size_t i = 0; i < cppKeywords.size(); i++) {
+            const string& kw = cppKeywords[i];
+            keywordChain[next[keywordHash(kw.data(), kw.length(), keywordSeed) & keywordMask]++] = i;
+        }
+    }
+    
+    bool isKeyword(const char* s, size_t n) {
+        size_t slot = keywordHash(s, n, keywordSeed) & keywordMask;
+        for (int k = keywordStart[slot]; k < keywordStart[slot + 1]; k++) {
+            const string& kw = cppKeywords[keywordChain[k]];
+            if (kw.length() == n && memcmp(kw.data(), s, n) == 0) return true;
         }
         return false;
     }
     
-    string applySyntaxHighlighting(const string& line) {
+    // Lexer state at end of line, follows the same rules as
+    // applySyntaxHighlighting without producing output
+    static int lexLine(const string& line, int state) {
+        size_t i = 0;
+        size_t n = line.length();
+        while (i < n) {
+            char c = line[i];
+            if (state == LEX_BLOCK_COMMENT || (c == '/' && i + 1 < n && line[i+1] == '*')) {
+                size_t end = line.find("*/", state == LEX_BLOCK_COMMENT ? i : i + 2);
+                if (end == string::npos) return LEX_BLOCK_COMMENT;
+                state = LEX_NORMAL;
+                i = end + 2;
+            } else if (c == '/' && i + 1 < n && line[i+1] == '/') {
+                return LEX_NORMAL;
+            } else if (c == '"' || c == '\'') {
+                i++;
+                while (i < n && line[i] != c) i += line[i] == '\\' ? 2 : 1;
+                i++;
+            } else {
+                i++;
+            }
+        }
+        return state;
+    }
+    
+    // Bring lexer states of buf up to date for lines 0..upTo: edited lines
+    // are lexed again, lines below them only while their start state changes
+    void updateSyntax(Buffer* buf, int upTo) {
+        vector<Buffer::LineSyntax>& syntax = buf->syntax;
+        if (!syntax.empty() && !buf->hasLine(syntax.size() - 1)) {
+            syntax.resize(buf->lineCount());
+        }
+        int y = min(buf->syntaxDirtyFrom, (int)syntax.size());
+        while (buf->hasLine(y)) {
+            unsigned char start = y == 0 ? (unsigned char)LEX_NORMAL : syntax[y - 1].end;
+            if (y == (int)syntax.size()) {
+                if (y > upTo) break;
+                syntax.push_back({start, (unsigned char)lexLine(buf->line(y), start)});
+            } else if (y <= buf->syntaxDirtyTo || syntax[y].start != start) {
+                if (y > upTo) {
+                    syntax.resize(y); // Rest is lexed when scrolled to
+                    break;
+                }
+                syntax[y] = {start, (unsigned char)lexLine(buf->line(y), start)};
+            } else {
+                // Same start state, lines below are unchanged up to the end
+                // of what was lexed so far
+                y = syntax.size();
+                continue;
+            }
+            y++;
+        }
+        buf->syntaxDirtyFrom = INT_MAX;
+        buf->syntaxDirtyTo = -1;
+    }
+    
+    // Colour one line, state is lexer state at its start
+    string applySyntaxHighlighting(const string& line, int state) {
         if (!syntaxHighlightEnabled) return line;
         
         string result;
-        string currentWord;
-        bool inString = false;
-        bool inComment = false;
-        char stringChar = '\0';
-        
-        for (size_t i = 0; i < line.length(); i++) {
+        size_t i = 0;
+        size_t n = line.length();
+        while (i < n) {
             char c = line[i];
             
-            if (!inString && i < line.length() - 1 && line[i] == '/' && line[i+1] == '/') {
-                if (!currentWord.empty()) {
-                    if (isKeyword(currentWord)) {
-                        result += COLOR_KEYWORD + currentWord + COLOR_RESET;
-                    } else {
-                        result += currentWord;
-                    }
-                    currentWord.clear();
-                }
+            if (state == LEX_BLOCK_COMMENT || (c == '/' && i + 1 < n && line[i+1] == '*')) {
+                size_t end = line.find("*/", state == LEX_BLOCK_COMMENT ? i : i + 2);
+                state = end == string::npos ? LEX_BLOCK_COMMENT : LEX_NORMAL;
+                end = end == string::npos ? n : end + 2;
+                result += COLOR_COMMENT + line.substr(i, end - i) + COLOR_RESET;
+                i = end;
+                continue;
+            }
+            
+            if (c == '/' && i + 1 < n && line[i+1] == '/') {
                 result += COLOR_COMMENT + line.substr(i) + COLOR_RESET;
                 break;
             }
             
-            if ((c == '"' || c == '\'') && !inComment) {
-                if (!inString) {
-                    if (!currentWord.empty()) {
-                        if (isKeyword(currentWord)) {
-                            result += COLOR_KEYWORD + currentWord + COLOR_RESET;
-                        } else {
-                            result += currentWord;
-                        }
-                        currentWord.clear();
-                    }
-                    inString = true;
-                    stringChar = c;
-                    result += COLOR_STRING;
-                    result += c;
-                } else if (c == stringChar && (i == 0 || line[i-1] != '\\')) {
-                    inString = false;
-                    result += c;
-                    result += COLOR_RESET;
-                } else {
-                    result += c;
-                }
+            if (c == '"' || c == '\'') {
+                size_t end = i + 1;
+                while (end < n && line[end] != c) end += line[end] == '\\' ? 2 : 1;
+                end = min(end + 1, n);
+                result += COLOR_STRING + line.substr(i, end - i) + COLOR_RESET;
+                i = end;
                 continue;
             }
             
-            if (inString) {
-                result += c;
+            if (isdigit((unsigned char)c)) {
+                size_t end = i + 1;
+                while (end < n && (isdigit((unsigned char)line[end]) || line[end] == '.')) end++;
+                result += COLOR_NUMBER + line.substr(i, end - i) + COLOR_RESET;
+                i = end;
                 continue;
             }
             
-            if (isdigit(c)) {
-                if (!currentWord.empty()) {
-                    if (isKeyword(currentWord)) {
-                        result += COLOR_KEYWORD + currentWord + COLOR_RESET;
-                    } else {
-                        result += currentWord;
-                    }
-                    currentWord.clear();
-                }
-                string number;
-                number += c;
-                while (i + 1 < line.length() && (isdigit(line[i+1]) || line[i+1] == '.')) {
-                    number += line[++i];
+            if (isalpha((unsigned char)c) || c == '_') {
+                size_t end = i + 1;
+                while (end < n && (isalnum((unsigned char)line[end]) || line[end] == '_')) end++;
+                if (isKeyword(line.data() + i, end - i)) {
+                    result += COLOR_KEYWORD + line.substr(i, end - i) + COLOR_RESET;
+                } else {
+                    result.append(line, i, end - i);
                 }
-                result += COLOR_NUMBER + number + COLOR_RESET;
+                i = end;
                 continue;
             }
             
-            if (isalnum(c) || c == '_') {
-                currentWord += c;
-            } else {
-                if (!currentWord.empty()) {
-                    if (isKeyword(currentWord)) {
-                        result += COLOR_KEYWORD + currentWord + COLOR_RESET;
-                    } else {
-                        result += currentWord;
-                    }
-                    currentWord.clear();
-                }
-                result += c;
-            }
-        }
-        
-        if (!currentWord.empty()) {
-            if (isKeyword(currentWord)) {
-                result += COLOR_KEYWORD + currentWord + COLOR_RESET;
-            } else {
-                result += currentWord;
-            }
+            result += c;
+            i++;
         }
         
         return result;
@@ -291,6 +1641,7 @@ private:
             case NORMAL: return "NORMAL";
             case INSERT: return "INSERT";
             case COMMAND: return "COMMAND";
+            case SEARCH: return "SEARCH";
             default: return "UNKNOWN";
         }
     }
@@ -303,10 +1654,18 @@ private:
 public:
     TextEditor() : 
         currentBufferIndex(0), currentMode(NORMAL), 
-        commandBuffer(""), statusMessage(""), syntaxHighlightEnabled(true) {
+        commandBuffer(""), statusMessage(""), syntaxHighlightEnabled(true),
+        screenHeight(0), screenWidth(0), pendingJump(false), pendingForward(true),
+        searchOriginX(0), searchOriginY(0), grepBuffer(nullptr), grepMatches(0),
+        grepRunning(false), inputPos(0) {
+        frame.reserve(64 * 1024);
+        buildKeywordHash();
+        PieceTable::guardMappings(); // Before any file is mapped
     }
     
     ~TextEditor() {
+        searcher.cancel(); // Workers may be reading a buffer
+        grep.cancel();
         for (auto buf : buffers) {
             delete buf;
         }
@@ -345,6 +1704,9 @@ public:
             return;
         }
         
+        searcher.cancel();
+        stopGrep();
+        if (buf == grepBuffer) grepBuffer = nullptr;
         delete buf;
         buffers.erase(buffers.begin() + currentBufferIndex);
         
@@ -355,104 +1717,304 @@ public:
         statusMessage = "Buffer closed";
     }
 
+    // Move to a row and draw it unless the screen already shows it
+    void drawRow(int row, const string& text) {
+        if (screen[row] == text) return;
+        screen[row] = text;
+        moveTo(row + 1, 1);
+        frame += text;
+        frame += "\033[K";
+    }
+    
+    void moveTo(int row, int col) {
+        char pos[32];
+        int n = snprintf(pos, sizeof(pos), "\033[%d;%dH", row, col);
+        frame.append(pos, n);
+    }
+    
+    // Write whole frame with as few syscalls as the terminal accepts
+    void flushFrame() {
+        size_t done = 0;
+        while (done < frame.size()) {
+            ssize_t n = write(STDOUT_FILENO, frame.data() + done, frame.size() - done);
+            if (n < 0) {
+                if (errno == EINTR || errno == EAGAIN) continue;
+                break;
+            }
+            done += n;
+        }
+        frame.clear();
+    }
+    
     void display() {
         Buffer* buf = getCurrentBuffer();
         if (!buf) return;
         
         struct winsize w;
-        ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
-        int termHeight = w.ws_row;
+        int termHeight = 24;
+        int termWidth = 80;
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == 0 && w.ws_row > 0) {
+            termHeight = max((int)w.ws_row, 4);
+            termWidth = w.ws_col;
+        }
+        int textRows = termHeight - 3;
         
-        write(STDOUT_FILENO, "\033[2J", 4);
-        write(STDOUT_FILENO, "\033[H", 3);
+        // Unknown screen contents after resize - start from a blank screen
+        if (termHeight != screenHeight || termWidth != screenWidth) {
+            frame += "\033[2J";
+            screen.assign(termHeight, "");
+            screenHeight = termHeight;
+            screenWidth = termWidth;
+        }
+        
+        // Scroll so that the cursor line is visible
+        if (buf->cursorY < buf->scrollY) {
+            buf->scrollY = buf->cursorY;
+        } else if (buf->cursorY >= buf->scrollY + textRows) {
+            buf->scrollY = buf->cursorY - textRows + 1;
+        }
         
         // Tab bar - shows all open buffers
-        write(STDOUT_FILENO, "\033[44m", 5); // Blue background
+        string tabBar = "\033[44m"; // Blue background
+        int tabWidth = 0;
         for (size_t i = 0; i < buffers.size(); i++) {
             if (i == (size_t)currentBufferIndex) {
-                write(STDOUT_FILENO, "\033[1;37m", 7); // Bold white for active
+                tabBar += "\033[1;37m"; // Bold white for active
             } else {
-                write(STDOUT_FILENO, "\033[0;37m", 7); // Normal white
+                tabBar += "\033[0;37m"; // Normal white
             }
             
             string tab = " " + buffers[i]->filename;
             if (buffers[i]->modified) tab += "[+]";
             tab += " ";
-            write(STDOUT_FILENO, tab.c_str(), tab.length());
-            write(STDOUT_FILENO, "\033[44m", 5); // Reset to blue bg
+            tabBar += tab + "\033[44m"; // Reset to blue bg
+            tabWidth += tab.length();
         }
         
         // Fill rest of tab bar
-        string padding(80, ' ');
-        write(STDOUT_FILENO, padding.c_str(), padding.length());
-        write(STDOUT_FILENO, "\033[0m\r\n", 7);
+        tabBar += string(max(termWidth - tabWidth, 0), ' ') + "\033[0m";
+        drawRow(0, tabBar);
         
         // Header - line 2
         string header = " Mode: " + getModeString();
         if (currentMode == NORMAL) {
-            header += " | i=insert :=cmd Tab=next Shift+Tab=prev";
+            header += " | i=insert :=cmd /=search Tab=next Shift+Tab=prev";
         } else if (currentMode == INSERT) {
             header += " | ESC=normal";
         }
         header += " | Buffers: " + to_string(buffers.size()) + " ";
-        
-        write(STDOUT_FILENO, "\033[7m", 4);
-        write(STDOUT_FILENO, header.c_str(), header.length());
-        string pad(80 - header.length(), ' ');
-        write(STDOUT_FILENO, pad.c_str(), pad.length());
-        write(STDOUT_FILENO, "\033[0m\r\n", 7);
+        header.resize(termWidth, ' ');
+        drawRow(1, "\033[7m" + header + "\033[0m");
 
-        // Display lines
-        for (size_t i = 0; i < buf->lines.size(); i++) {
-            string displayLine = applySyntaxHighlighting(buf->lines[i]);
-            write(STDOUT_FILENO, displayLine.c_str(), displayLine.length());
-            write(STDOUT_FILENO, "\033[K\r\n", 5);
+        // Display visible lines, screen keeps their text so unchanged lines
+        // are neither highlighted nor drawn again
+        if (syntaxHighlightEnabled) {
+            updateSyntax(buf, buf->scrollY + textRows - 1);
+        }
+        for (int row = 0; row < textRows; row++) {
+            int y = buf->scrollY + row;
+            string text = buf->hasLine(y) ? buf->line(y) : "";
+            if ((int)text.length() > termWidth) text.resize(termWidth);
+            int state = y > 0 && y <= (int)buf->syntax.size() ? (int)buf->syntax[y - 1].end : (int)LEX_NORMAL;
+            // Same text starting in another state (comment opened above)
+            // is drawn differently, so state is part of what screen keeps
+            string drawn = char('0' + state) + text;
+            if (screen[row + 2] == drawn) continue;
+            screen[row + 2] = drawn;
+            moveTo(row + 3, 1);
+            frame += applySyntaxHighlighting(text, state);
+            frame += "\033[K";
         }
 
         // Status bar
-        char statusPos[20];
-        snprintf(statusPos, sizeof(statusPos), "\033[%d;1H", termHeight);
-        write(STDOUT_FILENO, statusPos, strlen(statusPos));
-        
-        write(STDOUT_FILENO, "\033[7m", 4);
-        if (currentMode == COMMAND) {
-            write(STDOUT_FILENO, ":", 1);
-            write(STDOUT_FILENO, commandBuffer.c_str(), commandBuffer.length());
-            string cmdPad(79 - commandBuffer.length(), ' ');
-            write(STDOUT_FILENO, cmdPad.c_str(), cmdPad.length());
+        string status = "\033[7m";
+        if (currentMode == COMMAND || currentMode == SEARCH) {
+            string cmd = (currentMode == COMMAND ? ":" : "/") + commandBuffer;
+            cmd.resize(termWidth, ' ');
+            status += cmd;
         } else if (!statusMessage.empty()) {
-            write(STDOUT_FILENO, statusMessage.c_str(), statusMessage.length());
-            string msgPad(80 - statusMessage.length(), ' ');
-            write(STDOUT_FILENO, msgPad.c_str(), msgPad.length());
+            string msg = statusMessage;
+            msg.resize(termWidth, ' ');
+            status += msg;
         } else {
             string pos = to_string(buf->cursorY + 1) + "," + to_string(buf->cursorX + 1);
-            string posPad(80 - pos.length(), ' ');
-            write(STDOUT_FILENO, posPad.c_str(), posPad.length());
-            write(STDOUT_FILENO, pos.c_str(), pos.length());
+            status += string(max(termWidth - (int)pos.length(), 0), ' ') + pos;
         }
-        write(STDOUT_FILENO, "\033[0m", 4);
+        drawRow(termHeight - 1, status + "\033[0m");
 
         // Position cursor
         // Line 1 = tab bar, Line 2 = header, Line 3+ = content
-        char cursorPos[20];
-        if (currentMode == COMMAND) {
-            snprintf(cursorPos, sizeof(cursorPos), "\033[%d;%dH", termHeight, (int)commandBuffer.length() + 2);
+        if (currentMode == COMMAND || currentMode == SEARCH) {
+            moveTo(termHeight, (int)commandBuffer.length() + 2);
         } else {
             // cursorY is 0-indexed, display starts at line 3 (after tab bar and header)
-            int displayLine = buf->cursorY + 3;
-            int displayCol = buf->cursorX + 1;
-            snprintf(cursorPos, sizeof(cursorPos), "\033[%d;%dH", displayLine, displayCol);
+            int displayLine = buf->cursorY - buf->scrollY + 3;
+            int displayCol = min(buf->cursorX + 1, termWidth);
+            moveTo(displayLine, displayCol);
         }
-        write(STDOUT_FILENO, cursorPos, strlen(cursorPos));
+        flushFrame();
     }
 
+    // Exit once saves in progress are on disk
+    void quit() {
+        grep.cancel();
+        for (auto b : buffers) {
+            b->finishSave();
+        }
+        disableRawMode();
+        clearScreen();
+        exit(0);
+    }
+    
+    // Report buffers whose file shrank on disk (text past its new end reads
+    // as NUL), true if any
+    bool checkChangedOnDisk() {
+        bool changed = false;
+        for (auto b : buffers) {
+            if (!b->changedOnDisk && b->text.changedOnDisk()) {
+                searcher.cancel(); // Both may read spans of the mapping
+                stopGrep();
+                b->detachShrunk();
+                statusMessage = "File changed on disk: " + b->filename + " (:w! to overwrite)";
+                changed = true;
+            }
+        }
+        return changed;
+    }
+    
+    // Report saves completed in the background, true if any
+    bool checkSaves() {
+        bool done = false;
+        for (auto b : buffers) {
+            if (b->saveDone()) {
+                statusMessage = (b->finishSave() ? "Saved: " : "Error saving: ") + b->filename;
+                done = true;
+            }
+        }
+        return done;
+    }
+    
+    // Search current buffer for pattern and move to the match after (or
+    // before) the cursor as soon as results are ready
+    void search(const string& pattern, bool forward) {
+        Buffer* buf = getCurrentBuffer();
+        if (pattern.empty()) return;
+        if (!searcher.covers(buf, pattern) && !searcher.start(buf, pattern)) {
+            statusMessage = "Invalid pattern: " + pattern;
+            return;
+        }
+        searchPattern = pattern;
+        pendingJump = true;
+        pendingForward = forward;
+        if (searcher.done()) {
+            finishSearch();
+        } else {
+            statusMessage = "Searching: " + pattern;
+        }
+    }
+    
+    void finishSearch() {
+        pendingJump = false;
+        Buffer* buf = getCurrentBuffer();
+        if (!searcher.covers(buf, searchPattern)) return; // Switched or edited since
+        
+        const vector<size_t>& matches = searcher.results;
+        if (matches.empty()) {
+            statusMessage = "Pattern not found: " + searchPattern;
+            return;
+        }
+        size_t from = buf->offset(buf->cursorX, buf->cursorY);
+        bool wrapped = false;
+        vector<size_t>::const_iterator it;
+        if (pendingForward) {
+            it = upper_bound(matches.begin(), matches.end(), from);
+            if (it == matches.end()) {
+                it = matches.begin();
+                wrapped = true;
+            }
+        } else {
+            it = lower_bound(matches.begin(), matches.end(), from);
+            if (it == matches.begin()) {
+                it = matches.end();
+                wrapped = true;
+            }
+            --it;
+        }
+        
+        buf->closeUndoGroup();
+        buf->cursorY = buf->text.lineOf(*it);
+        buf->cursorX = *it - buf->text.lineStart(buf->cursorY);
+        statusMessage = "/" + searchPattern + " [" + to_string(it - matches.begin() + 1) + "/" +
+                        to_string(matches.size()) + (searcher.truncated ? "+" : "") + "]";
+        if (wrapped) statusMessage += " (wrapped)";
+    }
+    
+    // Jump once a background search is done, true if it was
+    bool checkSearch() {
+        if (!pendingJump || !searcher.done()) return false;
+        finishSearch();
+        return true;
+    }
+    
+    // Search open buffers and the files under dir, results are shown in a
+    // [grep] buffer as they come in
+    void startGrep(const string& pattern, const string& dir) {
+        vector<Grep::Source> sources;
+        for (auto b : buffers) {
+            if (b != grepBuffer) sources.push_back(Grep::Source{b->filename, b->spans()});
+        }
+        if (!grep.start(pattern, std::move(sources), dir)) {
+            statusMessage = "Invalid pattern: " + pattern;
+            return;
+        }
+        if (grepBuffer) {
+            grepBuffer->clear();
+            currentBufferIndex = find(buffers.begin(), buffers.end(), grepBuffer) - buffers.begin();
+        } else {
+            grepBuffer = new Buffer("[grep]", true);
+            buffers.push_back(grepBuffer);
+            currentBufferIndex = buffers.size() - 1;
+        }
+        grepMatches = 0;
+        grepRunning = true;
+        statusMessage = "grep: " + pattern;
+    }
+    
+    void stopGrep() {
+        grep.cancel();
+        grepRunning = false;
+    }
+    
+    // Show lines found by grep since last call, true if any or grep is done
+    bool checkGrep() {
+        if (!grepRunning) return false;
+        string found;
+        size_t n = grep.take(found);
+        bool done = grep.done();
+        if (n == 0 && !done) return false;
+        
+        grepBuffer->append(found);
+        grepMatches += n;
+        statusMessage = "grep: " + to_string(grepMatches) + (grep.truncated ? "+" : "") + " matches";
+        if (done) {
+            grepRunning = false;
+        } else {
+            statusMessage += "...";
+        }
+        return true;
+    }
+    
     void executeCommand() {
         statusMessage = "";
         Buffer* buf = getCurrentBuffer();
         
-        if (commandBuffer == "w") {
-            if (buf->save()) {
-                statusMessage = "Saved: " + buf->filename;
+        if (commandBuffer == "w" || commandBuffer == "w!") {
+            if (buf->scratch) {
+                statusMessage = "Not a file: " + buf->filename;
+            } else if (buf->changedOnDisk && commandBuffer == "w") {
+                statusMessage = "File changed on disk! Use :w! to overwrite";
+            } else if (buf->save(true)) {
+                statusMessage = "Saving: " + buf->filename;
             } else {
                 statusMessage = "Error saving!";
             }
@@ -462,40 +2024,45 @@ public:
             } else {
                 closeBuffer();
                 if (buffers.empty()) {
-                    disableRawMode();
-                    clearScreen();
-                    exit(0);
+                    quit();
                 }
             }
         } else if (commandBuffer == "q!") {
+            searcher.cancel();
+            stopGrep();
+            if (buf == grepBuffer) grepBuffer = nullptr;
             delete buf;
             buffers.erase(buffers.begin() + currentBufferIndex);
             if (currentBufferIndex >= (int)buffers.size()) {
                 currentBufferIndex = buffers.size() - 1;
             }
             if (buffers.empty()) {
-                disableRawMode();
-                clearScreen();
-                exit(0);
+                quit();
             }
         } else if (commandBuffer == "wq") {
-            if (buf->save()) {
+            if (buf->changedOnDisk) {
+                statusMessage = "File changed on disk! Use :w! to overwrite";
+            } else if (buf->save() && buf->finishSave()) {
                 closeBuffer();
                 if (buffers.empty()) {
-                    disableRawMode();
-                    clearScreen();
-                    exit(0);
+                    quit();
                 }
+            } else {
+                statusMessage = "Error saving!";
             }
         } else if (commandBuffer == "wa") {
             // Write all buffers
             int saved = 0;
+            string refused;
             for (auto b : buffers) {
                 if (b->modified && b->save()) {
                     saved++;
+                } else if (b->modified) {
+                    refused += " " + b->filename;
                 }
             }
-            statusMessage = "Saved " + to_string(saved) + " buffers";
+            statusMessage = "Saving " + to_string(saved) + " buffers";
+            if (!refused.empty()) statusMessage += ", changed on disk:" + refused;
         } else if (commandBuffer == "qa") {
             // Quit all
             bool hasModified = false;
@@ -508,27 +2075,31 @@ public:
             if (hasModified) {
                 statusMessage = "Unsaved changes! Use :qa! or :wqa";
             } else {
-                disableRawMode();
-                clearScreen();
-                exit(0);
+                quit();
             }
         } else if (commandBuffer == "qa!") {
-            disableRawMode();
-            clearScreen();
-            exit(0);
+            quit();
         } else if (commandBuffer == "wqa") {
+            string refused;
             for (auto b : buffers) {
-                if (b->modified) {
-                    b->save();
+                if (b->modified && !b->save()) {
+                    refused += " " + b->filename;
                 }
             }
-            disableRawMode();
-            clearScreen();
-            exit(0);
+            if (refused.empty()) {
+                quit();
+            }
+            statusMessage = "Not saved, changed on disk:" + refused;
         } else if (commandBuffer.substr(0, 2) == "e ") {
             // Open new file: :e filename
             string filename = commandBuffer.substr(2);
             addBuffer(filename);
+        } else if (commandBuffer.substr(0, 5) == "grep ") {
+            // Search files: :grep pattern [directory]
+            string args = commandBuffer.substr(5);
+            size_t space = args.find(' ');
+            string dir = space == string::npos ? "." : args.substr(space + 1);
+            startGrep(args.substr(0, space), dir);
         } else if (commandBuffer == "bn") {
             nextBuffer();
         } else if (commandBuffer == "bp") {
@@ -553,38 +2124,34 @@ public:
         if (!buf) return;
         
         // Ensure cursor is in valid position
-        if (buf->cursorY >= (int)buf->lines.size()) {
-            buf->cursorY = buf->lines.size() - 1;
+        if (!buf->hasLine(buf->cursorY)) {
+            buf->cursorY = buf->lineCount() - 1;
         }
         if (buf->cursorY < 0) buf->cursorY = 0;
-        if (buf->cursorX > (int)buf->lines[buf->cursorY].length()) {
-            buf->cursorX = buf->lines[buf->cursorY].length();
+        if (buf->cursorX > buf->lineLength(buf->cursorY)) {
+            buf->cursorX = buf->lineLength(buf->cursorY);
         }
         if (buf->cursorX < 0) buf->cursorX = 0;
         
-        buf->saveState();
-        
+        size_t pos = buf->offset(buf->cursorX, buf->cursorY);
         if (c == '\n' || c == '\r') {
-            string rest = buf->lines[buf->cursorY].substr(buf->cursorX);
-            buf->lines[buf->cursorY] = buf->lines[buf->cursorY].substr(0, buf->cursorX);
-            buf->lines.insert(buf->lines.begin() + buf->cursorY + 1, rest);
+            buf->insertText(pos, "\n");
             buf->cursorY++;
             buf->cursorX = 0;
         } else if (c == 127 || c == 8) {
             if (buf->cursorX > 0) {
-                buf->lines[buf->cursorY].erase(buf->cursorX - 1, 1);
+                buf->eraseText(pos - 1, 1);
                 buf->cursorX--;
             } else if (buf->cursorY > 0) {
-                buf->cursorX = buf->lines[buf->cursorY - 1].length();
-                buf->lines[buf->cursorY - 1] += buf->lines[buf->cursorY];
-                buf->lines.erase(buf->lines.begin() + buf->cursorY);
+                buf->cursorX = buf->lineLength(buf->cursorY - 1);
+                buf->eraseText(pos - 1, 1); // Joins with previous line
                 buf->cursorY--;
             }
         } else if (c >= 32 && c < 127) {
-            buf->lines[buf->cursorY].insert(buf->cursorX, 1, c);
+            buf->insertText(pos, string(1, c));
             buf->cursorX++;
         }
-        buf->modified = true;
+        buf->modified = !buf->scratch;
         statusMessage = "";
     }
 
@@ -592,98 +2159,209 @@ public:
         Buffer* buf = getCurrentBuffer();
         if (!buf) return;
         
-        // Ensure lines vector is not empty
-        if (buf->lines.empty()) {
-            buf->lines.push_back("");
-            buf->cursorY = 0;
-            buf->cursorX = 0;
-            return;
-        }
-        
+        buf->closeUndoGroup();
         if (c == 'A' && buf->cursorY > 0) {
             buf->cursorY--;
-            if (buf->cursorX > (int)buf->lines[buf->cursorY].length())
-                buf->cursorX = buf->lines[buf->cursorY].length();
-        } else if (c == 'B' && buf->cursorY < (int)buf->lines.size() - 1) {
+            if (buf->cursorX > buf->lineLength(buf->cursorY))
+                buf->cursorX = buf->lineLength(buf->cursorY);
+        } else if (c == 'B' && buf->hasLine(buf->cursorY + 1)) {
             buf->cursorY++;
-            if (buf->cursorX > (int)buf->lines[buf->cursorY].length())
-                buf->cursorX = buf->lines[buf->cursorY].length();
-        } else if (c == 'C' && buf->cursorX < (int)buf->lines[buf->cursorY].length()) {
+            if (buf->cursorX > buf->lineLength(buf->cursorY))
+                buf->cursorX = buf->lineLength(buf->cursorY);
+        } else if (c == 'C' && buf->cursorX < buf->lineLength(buf->cursorY)) {
             buf->cursorX++;
         } else if (c == 'D' && buf->cursorX > 0) {
             buf->cursorX--;
         }
     }
 
-    void run() {
-        enableRawMode();
-        display();
-
-        char c;
-        while (true) {
-            if (read(STDIN_FILENO, &c, 1) != 1) continue;
-            
-            if (currentMode == COMMAND) {
-                if (c == '\n' || c == '\r') {
-                    executeCommand();
-                } else if (c == 27) {
-                    commandBuffer = "";
+    void handleKey(char c) {
+        if (currentMode == COMMAND) {
+            if (c == '\n' || c == '\r') {
+                executeCommand();
+            } else if (c == 27) {
+                commandBuffer = "";
+                currentMode = NORMAL;
+                statusMessage = "";
+            } else if (c == 127 || c == 8) {
+                if (!commandBuffer.empty()) {
+                    commandBuffer.pop_back();
+                } else {
                     currentMode = NORMAL;
-                    statusMessage = "";
-                } else if (c == 127 || c == 8) {
-                    if (!commandBuffer.empty()) {
-                        commandBuffer.pop_back();
-                    } else {
-                        currentMode = NORMAL;
-                    }
-                } else if (c >= 32 && c < 127) {
+                }
+            } else if (c >= 32 && c < 127) {
+                commandBuffer += c;
+            }
+        } else if (currentMode == SEARCH) {
+            // Search runs as the pattern is typed, from where it started
+            Buffer* buf = getCurrentBuffer();
+            if (c == '\n' || c == '\r') {
+                currentMode = NORMAL;
+            } else if (c == 27 || ((c == 127 || c == 8) && commandBuffer.empty())) {
+                pendingJump = false;
+                buf->cursorX = searchOriginX;
+                buf->cursorY = searchOriginY;
+                currentMode = NORMAL;
+                statusMessage = "";
+            } else if (c == 127 || c == 8 || (c >= 32 && c < 127)) {
+                if (c >= 32) {
                     commandBuffer += c;
+                } else {
+                    commandBuffer.pop_back();
                 }
-            } else if (currentMode == INSERT) {
-                if (c == 27) {
-                    currentMode = NORMAL;
-                    statusMessage = "";
+                buf->cursorX = searchOriginX;
+                buf->cursorY = searchOriginY;
+                search(commandBuffer, true);
+            }
+        } else if (currentMode == INSERT) {
+            if (c == 27) {
+                getCurrentBuffer()->closeUndoGroup();
+                currentMode = NORMAL;
+                statusMessage = "";
+            } else {
+                insertChar(c);
+            }
+        } else { // NORMAL mode
+            if (c == 9) { // Tab key
+                nextBuffer();
+            } else if (c == 'Z') { // Shift+Tab (sent as capital Z in some terminals)
+                prevBuffer();
+            } else if (c == 'i') {
+                currentMode = INSERT;
+                statusMessage = "";
+            } else if (c == 'u') {
+                if (getCurrentBuffer()->undo()) {
+                    statusMessage = "Undo";
                 } else {
-                    insertChar(c);
+                    statusMessage = "Nothing to undo";
                 }
-            } else { // NORMAL mode
-                if (c == 9) { // Tab key
-                    nextBuffer();
-                } else if (c == 'Z') { // Shift+Tab (sent as capital Z in some terminals)
-                    prevBuffer();
-                } else if (c == 'i') {
-                    currentMode = INSERT;
-                    statusMessage = "";
-                } else if (c == 'u') {
-                    if (getCurrentBuffer()->undo()) {
-                        statusMessage = "Undo";
-                    } else {
-                        statusMessage = "Nothing to undo";
-                    }
-                } else if (c == 'r') {
-                    if (getCurrentBuffer()->redo()) {
-                        statusMessage = "Redo";
-                    } else {
-                        statusMessage = "Nothing to redo";
-                    }
-                } else if (c == ':') {
-                    currentMode = COMMAND;
-                    commandBuffer = "";
-                } else if (c == 27) {
-                    char seq[3];
-                    if (read(STDIN_FILENO, &seq[0], 1) == 1 && seq[0] == '[') {
-                        if (read(STDIN_FILENO, &seq[1], 1) == 1) {
-                            handleArrowKey(seq[1]);
-                        }
+            } else if (c == 'r') {
+                if (getCurrentBuffer()->redo()) {
+                    statusMessage = "Redo";
+                } else {
+                    statusMessage = "Nothing to redo";
+                }
+            } else if (c == ':') {
+                currentMode = COMMAND;
+                commandBuffer = "";
+            } else if (c == '/') {
+                currentMode = SEARCH;
+                commandBuffer = "";
+                searchOriginX = getCurrentBuffer()->cursorX;
+                searchOriginY = getCurrentBuffer()->cursorY;
+            } else if (c == 'n' || c == 'N') {
+                if (searchPattern.empty()) {
+                    statusMessage = "No previous pattern";
+                } else {
+                    search(searchPattern, c == 'n');
+                }
+            } else if (c == 27) {
+                char seq[2];
+                if (nextInput(seq[0]) && seq[0] == '[') {
+                    if (nextInput(seq[1])) {
+                        handleArrowKey(seq[1]);
                     }
                 }
             }
+        }
+    }
+    
+    // Append bytes waiting on the terminal to input, false on hangup
+    bool readInput() {
+        char chunk[4096];
+        ssize_t n;
+        while ((n = read(STDIN_FILENO, chunk, sizeof(chunk))) > 0) {
+            input.append(chunk, n);
+        }
+        return n == 0 || errno == EAGAIN || errno == EINTR;
+    }
+    
+    // Next byte of input, waiting briefly for the rest of an escape sequence
+    bool nextInput(char& c) {
+        if (inputPos == input.size()) {
+            input.clear();
+            inputPos = 0;
+            struct pollfd fd = {STDIN_FILENO, POLLIN, 0};
+            if (poll(&fd, 1, ESCAPE_MS) <= 0) return false;
+            readInput();
+            if (input.empty()) return false;
+        }
+        c = input[inputPos++];
+        return true;
+    }
+    
+    // Whether a save, search or grep may finish without further input
+    bool backgroundWork() {
+        for (auto b : buffers) {
+            if (b->saver.joinable()) return true;
+        }
+        return pendingJump || grepRunning;
+    }
+    
+    static void onResize(int) {
+        int saved = errno;
+        write(resizePipe[1], "", 1);
+        errno = saved;
+    }
+    
+    // Event loop: all pending input is handled before the screen is drawn,
+    // and it is drawn at most once per frame
+    void run() {
+        enableRawMode();
+        if (pipe(resizePipe) == 0) {
+            fcntl(resizePipe[0], F_SETFL, O_NONBLOCK);
+            fcntl(resizePipe[1], F_SETFL, O_NONBLOCK);
+            struct sigaction action;
+            memset(&action, 0, sizeof(action));
+            action.sa_handler = onResize;
+            sigaction(SIGWINCH, &action, nullptr);
+        }
+        display();
+        
+        auto lastFrame = chrono::steady_clock::now();
+        bool dirty = false;
+        while (true) {
+            int timeout = backgroundWork() ? POLL_MS : -1;
+            if (dirty) {
+                auto since = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - lastFrame);
+                timeout = max(0, FRAME_MS - (int)since.count());
+            }
+            struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {resizePipe[0], POLLIN, 0}};
+            int ready = poll(fds, resizePipe[0] >= 0 ? 2 : 1, timeout);
             
-            display();
+            if (ready > 0 && (fds[1].revents & POLLIN)) {
+                char drain[64];
+                while (read(resizePipe[0], drain, sizeof(drain)) > 0) {}
+                dirty = true;
+            }
+            if (ready > 0 && fds[0].revents) {
+                if (!readInput() && input.empty()) quit(); // Terminal is gone
+                while (inputPos < input.size()) {
+                    handleKey(input[inputPos++]);
+                }
+                input.clear();
+                inputPos = 0;
+                dirty = true;
+            }
+            bool saved = checkSaves();
+            bool grepped = checkGrep();
+            if (checkSearch() || saved || grepped) dirty = true;
+            if (checkChangedOnDisk()) dirty = true;
+            
+            if (dirty && chrono::steady_clock::now() - lastFrame >= chrono::milliseconds(FRAME_MS)) {
+                display();
+                lastFrame = chrono::steady_clock::now();
+                dirty = false;
+            }
         }
     }
 };
 
+int TextEditor::resizePipe[2] = {-1, -1};
+const int TextEditor::FRAME_MS;
+const int TextEditor::POLL_MS;
+const int TextEditor::ESCAPE_MS;
+
 int main(int argc, char* argv[]) {
     if (argc < 2) {
         cout << "Usage: " << argv[0] << " <file1> [file2] [file3] ..." << endl;
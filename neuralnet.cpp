@@ -24,21 +24,44 @@
  * training algorithm.
  *
  * \note This implementation uses mini-batch gradient descent as optimizer and
- * MSE as loss function. Bias is also not included.
+ * MSE as loss function (cross-entropy if output layer uses softmax). Bias is
+ * also not included.
  */
 
+ #include <fcntl.h>
+ #include <poll.h>
+ #include <sys/socket.h>
+ #include <sys/un.h>
+ #include <unistd.h>
+ 
  #include <algorithm>
+ #include <array>
  #include <cassert>
+ #include <cerrno>
  #include <chrono>
  #include <cmath>
+ #include <csignal>
+ #include <cstdio>
+ #include <cstring>
+ #include <deque>
  #include <fstream>
+ #include <iomanip>
  #include <iostream>
+ #include <map>
+ #include <memory>
+ #include <mutex>
  #include <sstream>
  #include <string>
+ #include <thread>
  #include <valarray>
  #include <vector>
  
- #include "vector_ops.hpp"  // Custom header file for vector operations
+ #include "numerical_check.hpp"  // Reference kernels for self-test
+ #include "rng.hpp"          // Seedable random number generator
+ #include "snapshot_writer.hpp"  // Background writer of checkpoints
+ #include "spsc_queue.hpp"   // Lock-free queue between pipeline stages
+ #include "thread_pool.hpp"  // Work stealing thread pool
+ #include "vector_ops.hpp"   // Custom header file for vector operations
  
  /** \namespace machine_learning
   * \brief Machine learning algorithms
@@ -61,7 +84,7 @@
  
  /**
   * Derivative of sigmoid function
-  * @param X Value
+  * @param X Value of sigmoid(x) (derivatives take activated values)
   * @return Returns derivative of sigmoid(x)
   */
  double dsigmoid(const double &x) { return x * (1 - x); }
@@ -75,10 +98,10 @@
  
  /**
   * Derivative of relu function
-  * @param X Value
+  * @param X Value of relu(x) (zero whenever x <= 0)
   * @returns derivative of relu(x)
   */
- double drelu(const double &x) { return x >= 0.0 ? 1.0 : 0.0; }
+ double drelu(const double &x) { return x > 0.0 ? 1.0 : 0.0; }
  
  /**
   * Tanh function
@@ -88,11 +111,72 @@
  double tanh(const double &x) { return 2 / (1 + std::exp(-2 * x)) - 1; }
  
  /**
-  * Derivative of Sigmoid function
-  * @param X Value
+  * Derivative of tanh function
+  * @param X Value of tanh(x)
   * @return Returns derivative of tanh(x)
   */
  double dtanh(const double &x) { return 1 - x * x; }
+ 
+ /**
+  * Softmax function (numerically stable, applied in place on a whole row)
+  * @param z row of logits, replaced by probabilities
+  */
+ void softmax(std::valarray<double> &z) {
+     const double max = z.max();  // Shift logits so exp never overflows
+     double total = 0;
+     for (auto &v : z) {
+         v = std::exp(v - max);
+         total += v;
+     }
+     z /= total;
+ }
+ 
+ /**
+  * Fused softmax and cross-entropy loss. Loss is computed from shifted
+  * logits (log-sum-exp) so it stays finite even when a probability
+  * underflows. The gradient of the loss w.r.t. logits is simply (z - y)
+  * after this call.
+  * @param z row of logits, replaced by probabilities
+  * @param y target row (one-hot or distribution)
+  * @return returns cross-entropy loss of the row
+  */
+ double softmax_cross_entropy(std::valarray<double> &z,
+                              const std::valarray<double> &y) {
+     const double max = z.max();
+     double total = 0, y_sum = 0, y_dot_z = 0;
+     for (size_t k = 0; k < z.size(); k++) {
+         const double shifted = z[k] - max;
+         y_dot_z += y[k] * shifted;
+         y_sum += y[k];
+         z[k] = std::exp(shifted);
+         total += z[k];
+     }
+     z /= total;
+     // -sum(y * log(p)) where log(p) = shifted - log(total)
+     return y_sum * std::log(total) - y_dot_z;
+ }
+ 
+ /**
+  * Activation policies used by FixedNetwork. Activation is a type there, so
+  * calls are resolved (and inlined) at compile time instead of through a
+  * function pointer.
+  */
+ struct Sigmoid {
+     static const char *name() { return "sigmoid"; }
+     static double apply(const double &x) { return sigmoid(x); }
+ };
+ struct Relu {
+     static const char *name() { return "relu"; }
+     static double apply(const double &x) { return relu(x); }
+ };
+ struct Tanh {
+     static const char *name() { return "tanh"; }
+     static double apply(const double &x) { return tanh(x); }
+ };
+ struct None {
+     static const char *name() { return "none"; }
+     static double apply(const double &x) { return x; }
+ };
  }  // namespace activations
  /** \namespace util_functions
   * \brief Various utility functions used in Neural network
@@ -110,16 +194,252 @@
   * @return Returns x
   */
  double identity_function(const double &x) { return x; }
+ /**
+  * Derivative of identity function
+  * @param X Value
+  * @return Returns 1
+  */
+ double didentity_function(const double &) { return 1.0; }
+ 
+ /**
+  * Function to split range [0, n) into contiguous chunks and run them on
+  * the global thread pool (at most one chunk per worker)
+  * @tparam Func callable of form func(chunk_id, begin, end)
+  * @param n number of work items
+  * @param func function to be called for every chunk
+  * @return number of chunks used
+  */
+ template <typename Func>
+ size_t parallel_for(const size_t &n, Func func) {
+     ThreadPool &pool = ThreadPool::global();
+     const size_t chunks = std::max<size_t>(1, std::min(pool.size(), n));
+     const size_t chunk_size = (n + chunks - 1) / chunks;
+     pool.run(chunks, [&](size_t c) {
+         func(c, std::min(n, c * chunk_size), std::min(n, (c + 1) * chunk_size));
+     });
+     return chunks;
+ }
  }  // namespace util_functions
+ /**
+  * Training statistics of a single epoch (returned by NeuralNetwork::fit)
+  */
+ struct EpochMetrics {
+     int epoch;        // Epoch number (starting from 1)
+     double loss;      // Average loss over the epoch
+     double accuracy;  // Average accuracy over the epoch
+     double seconds;   // Time taken by the epoch
+ };
+ 
  /** \namespace layers
   * \brief This namespace contains layers used
   * in MLP.
   */
  namespace layers {
+ /**
+  * Kind of layer. Input only describes first layer of a network (which is
+  * held as a pass-through dense layer).
+  */
+ enum class LayerType { input, dense, conv2d, maxpool, layernorm, dropout };
+ 
+ /**
+  * Function to get name of layer type (as written in model files)
+  * @param type layer type
+  * @return name of type
+  */
+ inline std::string layer_type_name(const LayerType &type) {
+     switch (type) {
+         case LayerType::input:
+             return "input";
+         case LayerType::dense:
+             return "dense";
+         case LayerType::conv2d:
+             return "conv2d";
+         case LayerType::maxpool:
+             return "maxpool";
+         case LayerType::layernorm:
+             return "layernorm";
+         case LayerType::dropout:
+             return "dropout";
+     }
+     return "";
+ }
+ 
+ /**
+  * Function to get layer type from its name
+  * @param name name of type
+  * @param type where type is stored
+  * @return false if name is not a layer type
+  */
+ inline bool parse_layer_type(const std::string &name, LayerType *type) {
+     for (const LayerType t :
+          {LayerType::input, LayerType::dense, LayerType::conv2d,
+           LayerType::maxpool, LayerType::layernorm, LayerType::dropout}) {
+         if (name == layer_type_name(t)) {
+             *type = t;
+             return true;
+         }
+     }
+     return false;
+ }
+ 
+ /**
+  * Geometry of convolution and max pooling layers: shape of input grid
+  * (channels, height, width) and the sliding window. Rows passed between
+  * layers are grids flattened in (channel, y, x) order.
+  */
+ struct Grid {
+     size_t channels, height, width;  // Shape of input grid
+     size_t size, stride;             // Window width (and height) and step
+ 
+     /**
+      * Constructor for Grid
+      * @param channels number of channels of input
+      * @param height height of input
+      * @param width width of input
+      * @param size width (and height) of window
+      * @param stride step between windows
+      */
+     explicit Grid(const size_t &channels = 0, const size_t &height = 0,
+                   const size_t &width = 0, const size_t &size = 0,
+                   const size_t &stride = 1)
+         : channels(channels),
+           height(height),
+           width(width),
+           size(size),
+           stride(stride) {}
+ 
+     /**
+      * Function to get height of output grid
+      * @return number of window positions along y
+      */
+     size_t out_height() const { return (height - size) / stride + 1; }
+ 
+     /**
+      * Function to get width of output grid
+      * @return number of window positions along x
+      */
+     size_t out_width() const { return (width - size) / stride + 1; }
+ 
+     /**
+      * Function to get number of window positions
+      * @return out_height() * out_width()
+      */
+     size_t cells() const { return out_height() * out_width(); }
+ };
+ 
+ /**
+  * Description of one layer used to construct a NeuralNetwork with
+  * convolution and pooling layers (use the static functions below).
+  */
+ struct LayerConfig {
+     LayerType type;
+     int units;               // Channels, neurons or filters (see below)
+     std::string activation;  // Activation of the layer
+     size_t height, width;    // Grid of input layer
+     size_t size, stride;     // Window of conv2d and maxpool layers
+     double rate = 0;         // Fraction of dropped neurons (dropout only)
+ 
+     /**
+      * Constructor for LayerConfig
+      * @param type layer type
+      * @param units channels (input), neurons (dense) or filters (conv2d)
+      * @param activation activation of the layer
+      * @param height height of input grid (input only)
+      * @param width width of input grid (input only)
+      * @param size width (and height) of window (conv2d and maxpool)
+      * @param stride step between windows (conv2d and maxpool)
+      */
+     LayerConfig(const LayerType &type, const int &units,
+                 const std::string &activation, const size_t &height,
+                 const size_t &width, const size_t &size, const size_t &stride)
+         : type(type),
+           units(units),
+           activation(activation),
+           height(height),
+           width(width),
+           size(size),
+           stride(stride) {}
+ 
+     /**
+      * Function to describe input layer
+      * @param channels number of channels of input grid
+      * @param height height of input grid
+      * @param width width of input grid
+      * @return layer description
+      */
+     static LayerConfig input(const int &channels, const size_t &height = 1,
+                              const size_t &width = 1) {
+         return LayerConfig(LayerType::input, channels, "none", height, width, 0, 1);
+     }
+ 
+     /**
+      * Function to describe fully connected layer
+      * @param neurons number of neurons
+      * @param activation activation of the layer
+      * @return layer description
+      */
+     static LayerConfig dense(const int &neurons,
+                              const std::string &activation) {
+         return LayerConfig(LayerType::dense, neurons, activation, 0, 0, 0, 1);
+     }
+ 
+     /**
+      * Function to describe convolution layer (no padding)
+      * @param filters number of filters (channels of output)
+      * @param size width (and height) of filters
+      * @param activation activation of the layer
+      * @param stride step between windows
+      * @return layer description
+      */
+     static LayerConfig conv2d(const int &filters, const size_t &size,
+                               const std::string &activation,
+                               const size_t &stride = 1) {
+         return LayerConfig(LayerType::conv2d, filters, activation, 0, 0, size, stride);
+     }
+ 
+     /**
+      * Function to describe max pooling layer
+      * @param size width (and height) of window
+      * @param stride step between windows (default = size)
+      * @return layer description
+      */
+     static LayerConfig maxpool(const size_t &size, const size_t &stride = 0) {
+         return LayerConfig(LayerType::maxpool, 0, "none", 0, 0, size,
+                            stride ? stride : size);
+     }
+ 
+     /**
+      * Function to describe layer normalization (over all neurons of the
+      * previous layer, with trainable gain and bias)
+      * @param activation activation applied after normalization (default =
+      * none)
+      * @return layer description
+      */
+     static LayerConfig layernorm(const std::string &activation = "none") {
+         return LayerConfig(LayerType::layernorm, 0, activation, 0, 0, 0, 1);
+     }
+ 
+     /**
+      * Function to describe dropout layer (inverted dropout, applied only
+      * while training)
+      * @param rate fraction of neurons of the previous layer to drop
+      * @return layer description
+      */
+     static LayerConfig dropout(const double &rate) {
+         LayerConfig config(LayerType::dropout, 0, "none", 0, 0, 0, 1);
+         config.rate = rate;
+         return config;
+     }
+ };
+ 
  /**
   * neural_network::layers::DenseLayer class is used to store all necessary
   * information about the layers (i.e. neurons, activation and kernel). This
-  * class is used by NeuralNetwork class to store layers.
+  * class is used by NeuralNetwork class to store layers. Besides fully
+  * connected layers it also holds convolution layers (kernel of shape
+  * (channels * size * size, filters) applied with im2col and the same
+  * matrix product), max pooling layers (no kernel), layer normalization
+  * (kernel holds gain and bias rows) and dropout layers (no kernel).
   *
   */
  class DenseLayer {
@@ -130,6 +450,21 @@
      int neurons;             // To store number of neurons (used in summary)
      std::string activation;  // To store activation name (used in summary)
      std::vector<std::valarray<double>> kernel;  // To store kernel (aka weights)
+     bool softmax_output = false;  // Whether activation is row wise softmax
+     bool identity = false;        // Whether activation is none
+     // Whether kernel is identity (not stored, input is passed through)
+     bool passthrough = false;
+     LayerType type = LayerType::dense;  // Kind of layer (never input)
+     Grid grid;  // Input grid and window (conv2d and maxpool only)
+     // Whether kernel is pruned, pruned kernel is kept only block sparse
+     // (kernel is empty) and training updates only its stored blocks
+     bool pruned = false;
+     BlockSparseMatrix<double> sparse_kernel;
+     // Convolutions with at most this many weights per filter are computed
+     // directly, larger ones with im2col and matrix product
+     static const size_t direct_window = 9;
+     double rate = 0;  // Fraction of dropped neurons (dropout only)
+     Xoshiro256 dropout_rng;  // Generator of dropout masks (dropout only)
  
      /**
       * Constructor for neural_network::layers::DenseLayer class
@@ -137,41 +472,21 @@
       * @param activation activation function for layer
       * @param kernel_shape shape of kernel
       * @param random_kernel flag for whether to initialize kernel randomly
+      * (He for relu, Xavier otherwise) or to make the layer a pass-through
+      * (identity kernel which is never stored or multiplied)
+      * @param rng random number generator for kernel initialization
       */
      DenseLayer(const int &neurons, const std::string &activation,
                 const std::pair<size_t, size_t> &kernel_shape,
-                const bool &random_kernel) {
-         // Choosing activation (and it's derivative)
-         if (activation == "sigmoid") {
-             activation_function = neural_network::activations::sigmoid;
-             dactivation_function = neural_network::activations::sigmoid;
-         } else if (activation == "relu") {
-             activation_function = neural_network::activations::relu;
-             dactivation_function = neural_network::activations::drelu;
-         } else if (activation == "tanh") {
-             activation_function = neural_network::activations::tanh;
-             dactivation_function = neural_network::activations::dtanh;
-         } else if (activation == "none") {
-             // Set identity function in casse of none is supplied
-             activation_function =
-                 neural_network::util_functions::identity_function;
-             dactivation_function =
-                 neural_network::util_functions::identity_function;
-         } else {
-             // If supplied activation is invalid
-             std::cerr << "ERROR (" << __func__ << ") : ";
-             std::cerr << "Invalid argument. Expected {none, sigmoid, relu, "
-                          "tanh} got ";
-             std::cerr << activation << std::endl;
-             std::exit(EXIT_FAILURE);
-         }
-         this->activation = activation;  // Setting activation name
-         this->neurons = neurons;        // Setting number of neurons
+                const bool &random_kernel,
+                const Xoshiro256 &rng = Xoshiro256(Xoshiro256::clock_seed())) {
+         this->set_activation(activation);
+         this->neurons = neurons;  // Setting number of neurons
          // Initialize kernel according to flag
-         if (random_kernel) {
-             uniform_random_initialization(kernel, kernel_shape, -1.0, 1.0);
+         if (!random_kernel) {
+             this->passthrough = true;
          } else {
-             unit_matrix_initialization(kernel, kernel_shape);
+             this->initialize(kernel_shape, rng);
          }
      }
      /**
@@ -182,33 +497,80 @@
       */
      DenseLayer(const int &neurons, const std::string &activation,
                 const std::vector<std::valarray<double>> &kernel) {
-         // Choosing activation (and it's derivative)
-         if (activation == "sigmoid") {
-             activation_function = neural_network::activations::sigmoid;
-             dactivation_function = neural_network::activations::sigmoid;
-         } else if (activation == "relu") {
-             activation_function = neural_network::activations::relu;
-             dactivation_function = neural_network::activations::drelu;
-         } else if (activation == "tanh") {
-             activation_function = neural_network::activations::tanh;
-             dactivation_function = neural_network::activations::dtanh;
-         } else if (activation == "none") {
-             // Set identity function in casse of none is supplied
-             activation_function =
-                 neural_network::util_functions::identity_function;
-             dactivation_function =
-                 neural_network::util_functions::identity_function;
+         this->set_activation(activation);
+         this->neurons = neurons;  // Setting number of neurons
+         this->kernel = kernel;    // Setting supplied kernel values
+     }
+     /**
+      * Constructor for convolution and max pooling layers
+      * @param type layer type (conv2d or maxpool)
+      * @param filters number of filters (maxpool keeps channels of input)
+      * @param activation activation function for layer
+      * @param grid input grid and window
+      * @param rng random number generator for kernel initialization
+      */
+     DenseLayer(const LayerType &type, const size_t &filters,
+                const std::string &activation, const Grid &grid,
+                const Xoshiro256 &rng) {
+         this->set_grid(type, activation, grid);
+         if (type == LayerType::conv2d) {
+             this->initialize({grid.channels * grid.size * grid.size, filters},
+                              rng);
+         }
+         this->neurons = int(this->filters() * grid.cells());
+     }
+     /**
+      * Constructor for convolution and max pooling layers
+      * @param type layer type (conv2d or maxpool)
+      * @param activation activation function for layer
+      * @param grid input grid and window
+      * @param kernel values of kernel (useful in loading model, empty for
+      * maxpool)
+      */
+     DenseLayer(const LayerType &type, const std::string &activation,
+                const Grid &grid,
+                const std::vector<std::valarray<double>> &kernel) {
+         this->set_grid(type, activation, grid);
+         this->kernel = kernel;
+         this->neurons = int(this->filters() * grid.cells());
+     }
+ 
+     /**
+      * Constructor for layer normalization and dropout layers (both keep
+      * number of neurons of previous layer)
+      * @param type layer type (layernorm or dropout)
+      * @param neurons number of neurons
+      * @param activation activation function for layer (none for dropout)
+      * @param rate fraction of dropped neurons (dropout only)
+      * @param rng random number generator for dropout masks
+      */
+     DenseLayer(const LayerType &type, const int &neurons,
+                const std::string &activation, const double &rate,
+                const Xoshiro256 &rng) {
+         if (type == LayerType::layernorm && activation != "softmax") {
+             // Gain starts at 1 and bias at 0 (plain normalization)
+             this->kernel = {std::valarray<double>(1.0, neurons),
+                             std::valarray<double>(0.0, neurons)};
+         } else if (type == LayerType::dropout && activation == "none" &&
+                    rate >= 0 && rate < 1) {
+             this->rate = rate;
+             // Neuron is kept when a 16 bit lane of random number is below
+             // threshold, so scale uses the probability actually used
+             this->threshold = std::max<uint64_t>(
+                 1, uint64_t(std::llround((1 - rate) * 65536)));
+             this->scale = 65536.0 / double(this->threshold);
+             this->mask.assign((neurons + 63) / 64, 0);
+             this->dropout_rng = rng;
          } else {
-             // If supplied activation is invalid
              std::cerr << "ERROR (" << __func__ << ") : ";
-             std::cerr << "Invalid argument. Expected {none, sigmoid, relu, "
-                          "tanh} got ";
-             std::cerr << activation << std::endl;
+             std::cerr << "Invalid " << layer_type_name(type)
+                       << " layer (activation "
+                       << activation << ", rate " << rate << ")" << std::endl;
              std::exit(EXIT_FAILURE);
          }
-         this->activation = activation;  // Setting activation name
-         this->neurons = neurons;        // Setting number of neurons
-         this->kernel = kernel;          // Setting supplied kernel values
+         this->set_activation(activation);
+         this->type = type;
+         this->neurons = neurons;
      }
  
      /**
@@ -237,572 +599,3531 @@
       * Move assignment operator for class DenseLayer
       */
      DenseLayer &operator=(DenseLayer &&) = default;
- };
- }  // namespace layers
- /**
-  * NeuralNetwork class is implements MLP. This class is
-  * used by actual user to create and train networks.
-  *
-  */
- class NeuralNetwork {
-  private:
-     std::vector<neural_network::layers::DenseLayer> layers;  // To store layers
+ 
      /**
-      * Private Constructor for class NeuralNetwork. This constructor
-      * is used internally to load model.
-      * @param config vector containing pair (neurons, activation)
-      * @param kernels vector containing all pretrained kernels
+      * Function to get shape of kernel (also of a pass-through layer)
+      * @return shape as pair
       */
-     NeuralNetwork(
-         const std::vector<std::pair<int, std::string>> &config,
-         const std::vector<std::vector<std::valarray<double>>> &kernels) {
-         // First layer should not have activation
-         if (config.begin()->second != "none") {
-             std::cerr << "ERROR (" << __func__ << ") : ";
-             std::cerr
-                 << "First layer can't have activation other than none got "
-                 << config.begin()->second;
-             std::cerr << std::endl;
-             std::exit(EXIT_FAILURE);
-         }
-         // Network should have atleast two layers
-         if (config.size() <= 1) {
-             std::cerr << "ERROR (" << __func__ << ") : ";
-             std::cerr << "Invalid size of network, ";
-             std::cerr << "Atleast two layers are required";
-             std::exit(EXIT_FAILURE);
+     std::pair<size_t, size_t> kernel_shape() const {
+         if (passthrough) {
+             return std::make_pair(size_t(neurons), size_t(neurons));
          }
-         // Reconstructing all pretrained layers
-         for (size_t i = 0; i < config.size(); i++) {
-             layers.emplace_back(neural_network::layers::DenseLayer(
-                 config[i].first, config[i].second, kernels[i]));
+         if (pruned) {
+             return std::make_pair(sparse_kernel.rows, sparse_kernel.cols);
          }
-         std::cout << "INFO: Network constructed successfully" << std::endl;
+         return kernel.empty() ? std::make_pair(size_t(0), size_t(0))
+                               : get_shape(kernel);
      }
+ 
      /**
-      * Private function to get detailed predictions (i.e.
-      * activated neuron values). This function is used in
-      * backpropagation, single predict and batch predict.
-      * @param X input vector
+      * Function to get number of output channels of convolution and max
+      * pooling layers
+      * @return number of filters (channels of input for maxpool)
       */
-     std::vector<std::vector<std::valarray<double>>>
-     __detailed_single_prediction(const std::vector<std::valarray<double>> &X) {
-         std::vector<std::vector<std::valarray<double>>> details;
-         std::vector<std::valarray<double>> current_pass = X;
-         details.emplace_back(X);
-         for (const auto &l : layers) {
-             current_pass = multiply(current_pass, l.kernel);
-             current_pass = apply_function(current_pass, l.activation_function);
-             details.emplace_back(current_pass);
+     size_t filters() const {
+         return type == LayerType::conv2d ? kernel[0].size() : grid.channels;
+     }
+ 
+     /**
+      * Function to apply activation of the layer on a row (in place)
+      * @param row pre-activation values of the layer
+      */
+     void activate(std::valarray<double> &row) const {
+         if (softmax_output) {
+             neural_network::activations::softmax(row);
+         } else if (!identity && type != LayerType::layernorm) {
+             // (layer normalization applies activation in forward)
+             row = row.apply(activation_function);
          }
-         return details;
      }
  
-  public:
      /**
-      * Default Constructor for class NeuralNetwork. This constructor
-      * is used to create empty variable of type NeuralNetwork class.
+      * Function to get output of the layer before activation
+      * @param input input of the layer (one row per sample)
+      * @return pre-activation values (one row per sample)
       */
-     NeuralNetwork() = default;
+     std::vector<std::valarray<double>> forward(
+         const std::vector<std::valarray<double>> &input) const {
+         if (passthrough) {
+             return input;
+         }
+         switch (type) {
+             case LayerType::conv2d:
+                 return grid.channels * grid.size * grid.size <= direct_window
+                            ? this->convolve_direct(input)
+                            : this->convolve(input);
+             case LayerType::maxpool:
+                 return this->pool(input);
+             case LayerType::layernorm:
+                 return this->normalize(input);
+             case LayerType::dropout:  // Masks are applied by drop in training
+                 return input;
+             default:
+                 return pruned ? multiply(input, sparse_kernel)
+                               : multiply(input, kernel);
+         }
+     }
  
      /**
-      * Constructor for class NeuralNetwork. This constructor
-      * is used by user.
-      * @param config vector containing pair (neurons, activation)
+      * Function to prune kernel by magnitude. Kernel is split into blocks of
+      * block x block weights and the fraction sparsity of blocks with
+      * smallest sum of absolute values is set to zero, remaining blocks are
+      * kept block sparse so inference skips the zero blocks (block = 1
+      * prunes single weights). Training updates only the kept blocks, so
+      * pruned weights stay zero. Pruning a pruned layer prunes it further.
+      * @param sparsity fraction of blocks to be pruned
+      * @param block width (and height) of a block
       */
-     explicit NeuralNetwork(
-         const std::vector<std::pair<int, std::string>> &config) {
-         // First layer should not have activation
-         if (config.begin()->second != "none") {
+     void prune(const double &sparsity, const size_t &block) {
+         if (type != LayerType::dense || passthrough || block == 0) {
              std::cerr << "ERROR (" << __func__ << ") : ";
-             std::cerr
-                 << "First layer can't have activation other than none got "
-                 << config.begin()->second;
-             std::cerr << std::endl;
+             std::cerr << "Only kernels of dense layers can be pruned"
+                       << std::endl;
              std::exit(EXIT_FAILURE);
          }
-         // Network should have atleast two layers
-         if (config.size() <= 1) {
-             std::cerr << "ERROR (" << __func__ << ") : ";
-             std::cerr << "Invalid size of network, ";
-             std::cerr << "Atleast two layers are required";
-             std::exit(EXIT_FAILURE);
+         if (pruned) {  // Blocks are picked on the dense kernel
+             kernel = sparse_kernel.dense();
          }
-         // Separately creating first layer so it can have unit matrix
-         // as kernel.
-         layers.push_back(neural_network::layers::DenseLayer(
-             config[0].first, config[0].second,
-             {config[0].first, config[0].first}, false));
-         // Creating remaining layers
-         for (size_t i = 1; i < config.size(); i++) {
-             layers.push_back(neural_network::layers::DenseLayer(
-                 config[i].first, config[i].second,
-                 {config[i - 1].first, config[i].first}, true));
+         const auto shape = kernel_shape();
+         const size_t block_cols = (shape.second + block - 1) / block;
+         // (sum of absolute values, index) of every block
+         std::vector<std::pair<double, size_t>> norms;
+         for (size_t br = 0; br * block < shape.first; br++) {
+             for (size_t bc = 0; bc < block_cols; bc++) {
+                 double norm = 0;
+                 for (size_t r = br * block;
+                      r < std::min(shape.first, (br + 1) * block); r++) {
+                     for (size_t c = bc * block;
+                          c < std::min(shape.second, (bc + 1) * block); c++) {
+                         norm += std::abs(kernel[r][c]);
+                     }
+                 }
+                 norms.emplace_back(norm, br * block_cols + bc);
+             }
          }
-         std::cout << "INFO: Network constructed successfully" << std::endl;
+         const size_t count = std::min(
+             norms.size(), size_t(sparsity * norms.size() + 0.5));
+         std::nth_element(norms.begin(), norms.begin() + count, norms.end());
+         for (size_t k = 0; k < count; k++) {  // Zeroing smallest blocks
+             const size_t br = norms[k].second / block_cols,
+                          bc = norms[k].second % block_cols;
+             for (size_t r = br * block;
+                  r < std::min(shape.first, (br + 1) * block); r++) {
+                 for (size_t c = bc * block;
+                      c < std::min(shape.second, (bc + 1) * block); c++) {
+                     kernel[r][c] = 0;
+                 }
+             }
+         }
+         this->set_sparse(to_block_sparse(kernel, block));
      }
  
      /**
-      * Copy Constructor for class NeuralNetwork.
-      *
-      * @param model instance of class to be copied.
+      * Function to make layer use block sparse kernel (dense kernel is
+      * dropped, so blocks which are not stored stay zero)
+      * @param sparse block sparse kernel
       */
-     NeuralNetwork(const NeuralNetwork &model) = default;
+     void set_sparse(const BlockSparseMatrix<double> &sparse) {
+         sparse_kernel = sparse;
+         kernel.clear();
+         pruned = true;
+     }
  
      /**
-      * Destructor for class NeuralNetwork.
+      * Function to backpropagate error through the layer and update its
+      * kernel (error is propagated with kernel before the update)
+      * @param input input of the layer (one row per sample)
+      * @param error error w.r.t. pre-activation output of the layer
+      * @param rate step size (learning rate / batch size)
+      * @param propagate flag for whether error w.r.t. input is needed
+      * @return returns error w.r.t. input (empty if not propagated)
       */
-     ~NeuralNetwork() = default;
+     std::vector<std::valarray<double>> backward(
+         const std::vector<std::valarray<double>> &input,
+         const std::vector<std::valarray<double>> &error, const double &rate,
+         const bool &propagate) {
+         std::vector<std::valarray<double>> input_error;
+         switch (type) {
+             case LayerType::maxpool:
+                 return propagate ? this->unpool(input, error) : input_error;
+             case LayerType::layernorm:
+                 return this->denormalize(input, error, rate, propagate);
+             case LayerType::dropout:  // Error flows only through kept neurons
+                 if (propagate) {
+                     input_error = error;
+                     const size_t words = (neurons + 63) / 64;
+                     for (size_t r = 0; r < error.size(); r++) {
+                         for (size_t k = 0; k < error[r].size(); k++) {
+                             input_error[r][k] *= this->kept(r * words, k);
+                         }
+                     }
+                 }
+                 return input_error;
+             case LayerType::dense: {
+                 if (pruned) {  // Only stored blocks are trained
+                     if (propagate) {
+                         input_error = multiply_transposed(error, sparse_kernel);
+                     }
+                     add_transposed_product(sparse_kernel, input, error, -rate);
+                     return input_error;
+                 }
+                 // Calculating gradient for current layer
+                 auto grad = multiply(transpose(input), error);
+                 // Change error according to current kernel values
+                 if (propagate) {
+                     input_error = multiply(error, transpose(kernel));
+                 }
+                 // Updating kernel (aka weights)
+                 kernel = kernel - grad * rate;
+                 return input_error;
+             }
+             default:
+                 break;
+         }
+         // Convolution: rows of windows times kernel gave (window, filter)
+         // matrix, so gradient is windows^T * error in the same layout
+         const size_t cells = grid.cells(), filters = this->filters();
+         std::vector<std::valarray<double>> cell_error(
+             error.size() * cells, std::valarray<double>(filters));
+         for (size_t r = 0; r < error.size(); r++) {
+             for (size_t f = 0; f < filters; f++) {
+                 for (size_t p = 0; p < cells; p++) {
+                     cell_error[r * cells + p][f] = error[r][f * cells + p];
+                 }
+             }
+         }
+         auto grad = multiply(transpose(this->windows(input)), cell_error);
+         if (propagate) {
+             input_error = col2im(multiply(cell_error, transpose(kernel)),
+                                  input.size(), grid.channels, grid.height,
+                                  grid.width, grid.size, grid.stride);
+         }
+         kernel = kernel - grad * rate;
+         return input_error;
+     }
  
      /**
-      * Copy assignment operator for class NeuralNetwork
+      * Function to compute convolution as one matrix product of windows of
+      * all samples with kernel
+      * @param input input grids (one row per sample)
+      * @return output grids (one row per sample)
       */
-     NeuralNetwork &operator=(const NeuralNetwork &model) = default;
+     std::vector<std::valarray<double>> convolve(
+         const std::vector<std::valarray<double>> &input) const {
+         const size_t cells = grid.cells(), filters = this->filters();
+         const auto product = multiply(this->windows(input), kernel);
+         std::vector<std::valarray<double>> output(
+             input.size(), std::valarray<double>(filters * cells));
+         for (size_t r = 0; r < input.size(); r++) {  // (window, filter) to
+             for (size_t p = 0; p < cells; p++) {     // (filter, window)
+                 for (size_t f = 0; f < filters; f++) {
+                     output[r][f * cells + p] = product[r * cells + p][f];
+                 }
+             }
+         }
+         return output;
+     }
  
      /**
-      * Move constructor for class NeuralNetwork
+      * Function to compute convolution directly from input (no copy of
+      * windows, used for small filters)
+      * @param input input grids (one row per sample)
+      * @return output grids (one row per sample)
       */
-     NeuralNetwork(NeuralNetwork &&) = default;
+     std::vector<std::valarray<double>> convolve_direct(
+         const std::vector<std::valarray<double>> &input) const {
+         const size_t out_h = grid.out_height(), out_w = grid.out_width();
+         const size_t cells = out_h * out_w, filters = this->filters();
+         std::vector<std::valarray<double>> output(
+             input.size(), std::valarray<double>(filters * cells));
+         for (size_t r = 0; r < input.size(); r++) {
+             for (size_t y = 0; y < out_h; y++) {
+                 for (size_t x = 0; x < out_w; x++) {
+                     // Accumulating all filters for one window
+                     std::valarray<double> sum(0.0, filters);
+                     size_t k = 0;
+                     for (size_t c = 0; c < grid.channels; c++) {
+                         for (size_t i = 0; i < grid.size; i++) {
+                             const size_t start =
+                                 (c * grid.height + y * grid.stride + i) *
+                                     grid.width +
+                                 x * grid.stride;
+                             for (size_t j = 0; j < grid.size; j++) {
+                                 sum += input[r][start + j] * kernel[k++];
+                             }
+                         }
+                     }
+                     for (size_t f = 0; f < filters; f++) {
+                         output[r][f * cells + y * out_w + x] = sum[f];
+                     }
+                 }
+             }
+         }
+         return output;
+     }
  
      /**
-      * Move assignment operator for class NeuralNetwork
+      * Function to apply dropout while training (dropout layer only). Mask
+      * is drawn into the preallocated bitmask, and activation of previous
+      * layer is applied in the same pass, so dropout costs no extra sweep
+      * over the rows.
+      * @param rows output of previous layer, before activation if previous
+      * is given (then activated in place)
+      * @param output where output of dropout layer is written (kept neurons
+      * scaled by 1 / keep probability), its storage is reused when it
+      * already has the shape of rows
+      * @param previous layer whose activation is fused (nullptr if rows are
+      * already activated)
       */
-     NeuralNetwork &operator=(NeuralNetwork &&) = default;
+     void drop(std::vector<std::valarray<double>> &rows,
+               std::vector<std::valarray<double>> &output,
+               const DenseLayer *previous = nullptr) {
+         const size_t words = (neurons + 63) / 64;
+         if (mask.size() < rows.size() * words) {  // Only for larger batches
+             mask.resize(rows.size() * words);
+         }
+         for (size_t w = 0; w < rows.size() * words; w++) {
+             // Four 16 bit lanes of every random number give four bits
+             uint64_t bits = 0;
+             for (size_t b = 0; b < 64; b += 4) {
+                 const uint64_t x = dropout_rng();
+                 bits |= (uint64_t((x & 0xFFFF) < threshold) |
+                          uint64_t(((x >> 16) & 0xFFFF) < threshold) << 1 |
+                          uint64_t(((x >> 32) & 0xFFFF) < threshold) << 2 |
+                          uint64_t((x >> 48) < threshold) << 3)
+                         << b;
+             }
+             mask[w] = bits;
+         }
+         const bool activated = previous == nullptr ||
+                                previous->type == LayerType::layernorm ||
+                                previous->identity;
+         output.resize(rows.size());
+         for (size_t r = 0; r < rows.size(); r++) {
+             std::valarray<double> &z = rows[r];
+             if (output[r].size() != z.size()) {
+                 output[r].resize(z.size());
+             }
+             for (size_t k = 0; k < z.size(); k++) {
+                 if (!activated) {
+                     z[k] = previous->activation_function(z[k]);
+                 }
+                 output[r][k] = z[k] * this->kept(r * words, k);
+             }
+         }
+     }
+ 
+  private:
+     uint64_t threshold = 0;  // Keep neuron if 16 random bits are below this
+     double scale = 1;        // 1 / probability of keeping a neuron
+     std::vector<uint64_t> mask;  // Dropout mask of last drop, one bit each
+ 
+     /**
+      * Function to get dropout factor of a neuron from mask of last drop
+      * @param offset index of first word of the row in mask
+      * @param k index of neuron
+      * @return scale if neuron was kept, otherwise 0
+      */
+     double kept(const size_t &offset, const size_t &k) const {
+         return double((mask[offset + k / 64] >> (k % 64)) & 1) * scale;
+     }
+ 
+     /**
+      * Function to get mean and 1 / standard deviation of a row in one pass
+      * (values are shifted by the first one so the sum of squares does not
+      * cancel catastrophically)
+      * @param x row
+      * @return pair (mean, 1 / sqrt(variance + epsilon))
+      */
+     static std::pair<double, double> moments(const std::valarray<double> &x) {
+         const double shift = x[0];
+         double sum = 0, squares = 0;
+         for (size_t k = 0; k < x.size(); k++) {
+             const double d = x[k] - shift;
+             sum += d;
+             squares += d * d;
+         }
+         const double mean = sum / x.size();
+         const double variance = std::max(0.0, squares / x.size() - mean * mean);
+         return std::make_pair(shift + mean, 1.0 / std::sqrt(variance + 1e-5));
+     }
+ 
+     /**
+      * Function to normalize every row, scale it by gain, add bias and apply
+      * activation (one pass after statistics)
+      * @param input input of the layer (one row per sample)
+      * @return activated output (one row per sample)
+      */
+     std::vector<std::valarray<double>> normalize(
+         const std::vector<std::valarray<double>> &input) const {
+         const std::valarray<double> &gain = kernel[0], &bias = kernel[1];
+         std::vector<std::valarray<double>> output(
+             input.size(), std::valarray<double>(input[0].size()));
+         for (size_t r = 0; r < input.size(); r++) {
+             const auto stats = moments(input[r]);
+             for (size_t k = 0; k < input[r].size(); k++) {
+                 const double y =
+                     (input[r][k] - stats.first) * stats.second * gain[k] +
+                     bias[k];
+                 output[r][k] = identity ? y : activation_function(y);
+             }
+         }
+         return output;
+     }
+ 
+     /**
+      * Function to backpropagate error through layer normalization and
+      * update gain and bias
+      * @param input input of the layer (one row per sample)
+      * @param error error w.r.t. output before activation
+      * @param rate step size (learning rate / batch size)
+      * @param propagate flag for whether error w.r.t. input is needed
+      * @return returns error w.r.t. input (empty if not propagated)
+      */
+     std::vector<std::valarray<double>> denormalize(
+         const std::vector<std::valarray<double>> &input,
+         const std::vector<std::valarray<double>> &error, const double &rate,
+         const bool &propagate) {
+         const size_t n = input[0].size();
+         std::vector<std::valarray<double>> grad(
+             2, std::valarray<double>(0.0, n));
+         std::vector<std::valarray<double>> input_error;
+         for (size_t r = 0; r < input.size(); r++) {
+             const auto stats = moments(input[r]);
+             const std::valarray<double> normalized =
+                 (input[r] - stats.first) * stats.second;
+             grad[0] += error[r] * normalized;
+             grad[1] += error[r];
+             if (propagate) {  // Through mean and variance of the row
+                 const std::valarray<double> d = error[r] * kernel[0];
+                 input_error.push_back(
+                     stats.second * (d - d.sum() / n -
+                                     normalized * ((d * normalized).sum() / n)));
+             }
+         }
+         kernel = kernel - grad * rate;
+         return input_error;
+     }
+ 
+     /**
+      * Function to choose activation (and it's derivative)
+      * @param activation activation name
+      */
+     void set_activation(const std::string &activation) {
+         if (activation == "sigmoid") {
+             activation_function = neural_network::activations::sigmoid;
+             dactivation_function = neural_network::activations::dsigmoid;
+         } else if (activation == "relu") {
+             activation_function = neural_network::activations::relu;
+             dactivation_function = neural_network::activations::drelu;
+         } else if (activation == "tanh") {
+             activation_function = neural_network::activations::tanh;
+             dactivation_function = neural_network::activations::dtanh;
+         } else if (activation == "softmax") {
+             // Softmax is applied row wise (see activate), derivative is
+             // never used as it is fused with cross-entropy loss
+             activation_function =
+                 neural_network::util_functions::identity_function;
+             dactivation_function =
+                 neural_network::util_functions::identity_function;
+         } else if (activation == "none") {
+             // Set identity function in casse of none is supplied
+             activation_function =
+                 neural_network::util_functions::identity_function;
+             dactivation_function =
+                 neural_network::util_functions::didentity_function;
+         } else {
+             // If supplied activation is invalid
+             std::cerr << "ERROR (" << __func__ << ") : ";
+             std::cerr << "Invalid argument. Expected {none, sigmoid, relu, "
+                          "tanh, softmax} got ";
+             std::cerr << activation << std::endl;
+             std::exit(EXIT_FAILURE);
+         }
+         this->activation = activation;  // Setting activation name
+         this->softmax_output = (activation == "softmax");
+         this->identity = (activation == "none");
+     }
+ 
+     /**
+      * Function to set type and geometry of convolution and max pooling
+      * layers
+      * @param type layer type (conv2d or maxpool)
+      * @param activation activation name
+      * @param grid input grid and window
+      */
+     void set_grid(const LayerType &type, const std::string &activation,
+                   const Grid &grid) {
+         if (type != LayerType::conv2d && type != LayerType::maxpool) {
+             std::cerr << "ERROR (" << __func__ << ") : ";
+             std::cerr << "Invalid layer type. Expected {conv2d, maxpool} got "
+                       << layer_type_name(type) << std::endl;
+             std::exit(EXIT_FAILURE);
+         }
+         if (grid.size == 0 || grid.stride == 0 || grid.size > grid.height ||
+             grid.size > grid.width) {
+             std::cerr << "ERROR (" << __func__ << ") : ";
+             std::cerr << "Window " << grid.size << " (stride " << grid.stride
+                       << ") does not fit input grid "
+                       << std::make_pair(grid.height, grid.width)
+                       << std::endl;
+             std::exit(EXIT_FAILURE);
+         }
+         this->set_activation(activation);
+         this->type = type;
+         this->grid = grid;
+     }
+ 
+     /**
+      * Function to initialize kernel (He for relu, Xavier otherwise)
+      * @param shape shape of kernel
+      * @param rng random number generator
+      */
+     void initialize(const std::pair<size_t, size_t> &shape,
+                     const Xoshiro256 &rng) {
+         if (activation == "relu") {
+             he_initialization(kernel, shape, rng);
+         } else {
+             xavier_initialization(kernel, shape, rng);
+         }
+     }
+ 
+     /**
+      * Function to get windows of input as rows (im2col)
+      * @param input input grids (one row per sample)
+      * @return windows of all samples
+      */
+     std::vector<std::valarray<double>> windows(
+         const std::vector<std::valarray<double>> &input) const {
+         return im2col(input, grid.channels, grid.height, grid.width,
+                       grid.size, grid.stride);
+     }
+ 
+     /**
+      * Function to find maximum of every window of every channel
+      * @param input input grids (one row per sample)
+      * @param argmax where index (in input row) of every maximum is stored,
+      * if not nullptr
+      * @return output grids (one row per sample)
+      */
+     std::vector<std::valarray<double>> pool(
+         const std::vector<std::valarray<double>> &input,
+         std::vector<std::vector<size_t>> *argmax = nullptr) const {
+         const size_t out_h = grid.out_height(), out_w = grid.out_width();
+         const size_t cells = out_h * out_w;
+         std::vector<std::valarray<double>> output(
+             input.size(), std::valarray<double>(grid.channels * cells));
+         if (argmax != nullptr) {
+             argmax->assign(input.size(),
+                            std::vector<size_t>(grid.channels * cells));
+         }
+         for (size_t r = 0; r < input.size(); r++) {
+             for (size_t c = 0; c < grid.channels; c++) {
+                 for (size_t y = 0; y < out_h; y++) {
+                     for (size_t x = 0; x < out_w; x++) {
+                         size_t best = (c * grid.height + y * grid.stride) *
+                                           grid.width +
+                                       x * grid.stride;
+                         for (size_t i = 0; i < grid.size; i++) {
+                             const size_t start =
+                                 (c * grid.height + y * grid.stride + i) *
+                                     grid.width +
+                                 x * grid.stride;
+                             for (size_t j = 0; j < grid.size; j++) {
+                                 if (input[r][start + j] > input[r][best]) {
+                                     best = start + j;
+                                 }
+                             }
+                         }
+                         const size_t out = (c * out_h + y) * out_w + x;
+                         output[r][out] = input[r][best];
+                         if (argmax != nullptr) {
+                             (*argmax)[r][out] = best;
+                         }
+                     }
+                 }
+             }
+         }
+         return output;
+     }
+ 
+     /**
+      * Function to route error of max pooling back to the maximum of every
+      * window
+      * @param input input grids (one row per sample)
+      * @param error error w.r.t. output
+      * @return error w.r.t. input
+      */
+     std::vector<std::valarray<double>> unpool(
+         const std::vector<std::valarray<double>> &input,
+         const std::vector<std::valarray<double>> &error) const {
+         std::vector<std::vector<size_t>> argmax;
+         this->pool(input, &argmax);
+         std::vector<std::valarray<double>> input_error(
+             input.size(), std::valarray<double>(0.0, input[0].size()));
+         for (size_t r = 0; r < input.size(); r++) {
+             for (size_t k = 0; k < argmax[r].size(); k++) {
+                 input_error[r][argmax[r][k]] += error[r][k];
+             }
+         }
+         return input_error;
+     }
+ };
+ }  // namespace layers
+ /**
+  * NeuralNetwork class is implements MLP. This class is
+  * used by actual user to create and train networks.
+  *
+  */
+ class NeuralNetwork {
+  private:
+     typedef neural_network::layers::LayerType LayerType;
+     std::vector<neural_network::layers::DenseLayer> layers;  // To store layers
+     Xoshiro256 rng{Xoshiro256::clock_seed()};  // To shuffle training data
+ 
+     /**
+      * Position of training inside fit (what is needed to continue an
+      * interrupted fit besides weights and generators)
+      */
+     struct Progress {
+         int epoch = 0;              // Epoch in progress
+         size_t sample = 0;          // Samples of the epoch already trained
+         std::vector<size_t> order;  // Shuffled order of samples of epoch
+         double loss = 0, acc = 0;   // Metrics of the epoch so far
+         std::vector<EpochMetrics> history;  // Stats of finished epochs
+     };
+ 
+     /**
+      * Snapshot of training written by the background checkpoint writer
+      */
+     struct Snapshot {
+         std::vector<neural_network::layers::DenseLayer> layers;
+         Xoshiro256 rng;
+         Progress progress;
+     };
+ 
+     std::string checkpoint_file;    // Checkpoint file (empty = disabled)
+     size_t checkpoint_samples = 0;  // Samples between checkpoints
+     Progress resumed;  // Where next fit continues (set by resume)
+ 
+     /**
+      * Copies of the network made by batch_predict on NUMA nodes of the
+      * global pool, kept until weights change. A copy of the network starts
+      * without replicas.
+      */
+     struct Replicas {
+         std::vector<std::unique_ptr<NeuralNetwork>> nets;  // One per node
+         std::mutex lock;  // Guards nets while workers make them
+         Replicas() = default;
+         Replicas(const Replicas &) {}
+         Replicas &operator=(const Replicas &) {
+             nets.clear();
+             return *this;
+         }
+     };
+     Replicas replicas;
+ 
+     /**
+      * Private function to drop replicas (called before weights change)
+      */
+     void __drop_replicas() {
+         std::lock_guard<std::mutex> lock(replicas.lock);
+         replicas.nets.clear();
+     }
+ 
+     /**
+      * Private function to derive generators of dropout layers from the
+      * network generator (layer i gets stream i, as in the constructor)
+      */
+     void __seed_dropout() {
+         for (size_t i = 0; i < layers.size(); i++) {
+             if (layers[i].type == LayerType::dropout) {
+                 layers[i].dropout_rng = rng.split(i);
+             }
+         }
+     }
+ 
+     /**
+      * Private Constructor for class NeuralNetwork. This constructor
+      * is used internally to load model.
+      * @param loaded all pretrained layers
+      */
+     explicit NeuralNetwork(
+         std::vector<neural_network::layers::DenseLayer> loaded) {
+         std::vector<std::string> activations;
+         for (const auto &l : loaded) {
+             activations.push_back(l.activation);
+         }
+         __check_activations(activations);
+         // Identity kernel of first layer becomes a pass-through
+         if (__is_identity(loaded[0].kernel)) {
+             loaded[0] = neural_network::layers::DenseLayer(
+                 loaded[0].neurons, loaded[0].activation,
+                 {loaded[0].kernel.size(), loaded[0].kernel.size()}, false);
+         }
+         layers = std::move(loaded);
+         this->__seed_dropout();
+         std::cout << "INFO: Network constructed successfully" << std::endl;
+     }
+ 
+     /**
+      * Private function to check activations of layers of a network
+      * @param activations activation of every layer
+      */
+     static void __check_activations(
+         const std::vector<std::string> &activations) {
+         // Network should have atleast two layers
+         if (activations.size() <= 1) {
+             std::cerr << "ERROR (" << __func__ << ") : ";
+             std::cerr << "Invalid size of network, ";
+             std::cerr << "Atleast two layers are required";
+             std::exit(EXIT_FAILURE);
+         }
+         // First layer should not have activation
+         if (activations[0] != "none") {
+             std::cerr << "ERROR (" << __func__ << ") : ";
+             std::cerr
+                 << "First layer can't have activation other than none got "
+                 << activations[0];
+             std::cerr << std::endl;
+             std::exit(EXIT_FAILURE);
+         }
+         // Only output layer can have softmax activation
+         for (size_t i = 0; i + 1 < activations.size(); i++) {
+             if (activations[i] == "softmax") {
+                 std::cerr << "ERROR (" << __func__ << ") : ";
+                 std::cerr << "Only last layer can have softmax activation";
+                 std::cerr << std::endl;
+                 std::exit(EXIT_FAILURE);
+             }
+         }
+     }
+ 
+     /**
+      * Private function to convert config of fully connected network to
+      * layer descriptions
+      * @param config vector containing pair (neurons, activation)
+      * @return returns description of every layer
+      */
+     static std::vector<neural_network::layers::LayerConfig> __dense_config(
+         const std::vector<std::pair<int, std::string>> &config) {
+         std::vector<neural_network::layers::LayerConfig> layer_config;
+         for (size_t i = 0; i < config.size(); i++) {
+             layer_config.push_back(
+                 i == 0 ? neural_network::layers::LayerConfig(
+                              LayerType::input, config[i].first,
+                              config[i].second, 1, 1, 0, 1)
+                        : neural_network::layers::LayerConfig::dense(
+                              config[i].first, config[i].second));
+         }
+         return layer_config;
+     }
+ 
+     /**
+      * Private function to get detailed predictions (i.e.
+      * activated neuron values). This function is used in
+      * backpropagation, single predict and batch predict.
+      * @param X input vector
+      * @param Y target vector, if supplied and output layer is softmax then
+      * cross-entropy loss is computed by the fused kernel
+      * @param loss where cross-entropy loss is added (used with Y)
+      * @param training flag for whether dropout layers drop neurons
+      */
+     std::vector<std::vector<std::valarray<double>>>
+     __detailed_single_prediction(const std::vector<std::valarray<double>> &X,
+                                  const std::vector<std::valarray<double>> *Y =
+                                      nullptr,
+                                  double *loss = nullptr,
+                                  const bool &training = false) {
+         std::vector<std::vector<std::valarray<double>>> details;
+         details.emplace_back(X);
+         this->__forward_details(details, 0, Y, loss, training);
+         return details;
+     }
+ 
+     /**
+      * Private function to get detailed predictions of one row of sparse
+      * input. If first layer is a pass-through, input and output of first
+      * layer are left empty and the sparse row goes straight into second
+      * layer's kernel.
+      * @param X sparse input
+      * @param r index of row
+      * @param passthrough whether first layer is a pass-through
+      * @param Y target vector (see __detailed_single_prediction)
+      * @param loss where cross-entropy loss is added (used with Y)
+      */
+     std::vector<std::vector<std::valarray<double>>>
+     __detailed_sparse_prediction(const CSRMatrix<double> &X, const size_t &r,
+                                  const bool &passthrough,
+                                  const std::vector<std::valarray<double>> *Y,
+                                  double *loss) {
+         if (!passthrough) {
+             return this->__detailed_single_prediction(X.dense_row(r), Y, loss,
+                                                       true);
+         }
+         std::vector<std::vector<std::valarray<double>>> details(2);
+         std::vector<std::valarray<double>> current_pass =
+             multiply(X, r, r + 1, layers[1].kernel);
+         this->__activate(layers[1], current_pass, Y, loss);
+         details.emplace_back(std::move(current_pass));
+         this->__forward_details(details, 2, Y, loss, true);
+         return details;
+     }
+ 
+     /**
+      * Private function to continue detailed prediction. details.back() is
+      * input of layer first, outputs of it and all following layers are
+      * appended to details.
+      * @param details activations computed so far
+      * @param first index of first layer to apply
+      * @param Y target vector (see __detailed_single_prediction)
+      * @param loss where cross-entropy loss is added (used with Y)
+      * @param training flag for whether dropout layers drop neurons
+      */
+     void __forward_details(
+         std::vector<std::vector<std::valarray<double>>> &details,
+         const size_t &first, const std::vector<std::valarray<double>> *Y,
+         double *loss, const bool &training) {
+         for (size_t i = first; i < layers.size(); i++) {
+             const auto &l = layers[i];
+             if (l.type == LayerType::dropout) {  // Previous layer activated
+                 // Output is kept in details for backpropagation, so every
+                 // pass writes into a new one
+                 std::vector<std::valarray<double>> dropped;
+                 if (training) {
+                     layers[i].drop(details.back(), dropped);
+                 } else {
+                     dropped = details.back();
+                 }
+                 details.emplace_back(std::move(dropped));
+                 continue;
+             }
+             std::vector<std::valarray<double>> current_pass =
+                 l.forward(details.back());
+             if (training && i + 1 < layers.size() &&
+                 layers[i + 1].type == LayerType::dropout) {
+                 // Mask is applied in the activation pass of this layer
+                 std::vector<std::valarray<double>> dropped;
+                 layers[i + 1].drop(current_pass, dropped, &l);
+                 details.emplace_back(std::move(current_pass));
+                 details.emplace_back(std::move(dropped));
+                 i++;
+                 continue;
+             }
+             this->__activate(l, current_pass, Y, loss);
+             details.emplace_back(std::move(current_pass));
+         }
+     }
+ 
+     /**
+      * Private function to activate rows of a layer's output in place
+      * @param l layer
+      * @param rows pre-activation values (one row per sample)
+      * @param Y target vector, if supplied and layer is softmax then fused
+      * cross-entropy is computed
+      * @param loss where cross-entropy loss is added (used with Y)
+      */
+     static void __activate(const neural_network::layers::DenseLayer &l,
+                            std::vector<std::valarray<double>> &rows,
+                            const std::vector<std::valarray<double>> *Y,
+                            double *loss) {
+         for (size_t r = 0; r < rows.size(); r++) {
+             if (l.softmax_output && Y != nullptr) {
+                 *loss += neural_network::activations::softmax_cross_entropy(
+                     rows[r], (*Y)[r]);
+             } else {
+                 l.activate(rows[r]);
+             }
+         }
+     }
+ 
+     /**
+      * Private function to check whether first layer passes input through
+      * unchanged (identity kernel and no activation) into a dense layer
+      * which is not pruned, so sparse input can go straight into second
+      * layer's kernel
+      * @return true if first layer is a pass-through
+      */
+     bool __input_passthrough() const {
+         const auto &l = layers.front();
+         return l.passthrough && l.identity &&
+                layers[1].type == LayerType::dense && !layers[1].pruned;
+     }
+ 
+     /**
+      * Private function to check whether kernel is an identity matrix
+      * @param kernel 2D vector to be checked
+      * @return true if kernel is identity
+      */
+     static bool __is_identity(
+         const std::vector<std::valarray<double>> &kernel) {
+         for (size_t i = 0; i < kernel.size(); i++) {
+             if (kernel[i].size() != kernel.size()) {
+                 return false;
+             }
+             for (size_t j = 0; j < kernel[i].size(); j++) {
+                 if (kernel[i][j] != (i == j ? 1.0 : 0.0)) {
+                     return false;
+                 }
+             }
+         }
+         return !kernel.empty();
+     }
+ 
+     /**
+      * Private function to get predictions of a range of samples in one
+      * batched forward pass. Samples are stacked as rows of a single matrix
+      * so every layer is a single matrix product for the whole range.
+      * @param X array of feature vectors (each of shape (1, N))
+      * @param begin index of first sample
+      * @param end index after last sample
+      * @param logits flag for whether to leave softmax of output layer
+      * unapplied (used to compute fused cross-entropy)
+      * @return predictions as matrix with one row per sample
+      */
+     std::vector<std::valarray<double>> __batch_forward(
+         const std::vector<std::vector<std::valarray<double>>> &X,
+         const size_t &begin, const size_t &end,
+         const bool &logits = false) const {
+         std::vector<std::valarray<double>> current_pass;
+         current_pass.reserve(end - begin);
+         for (size_t i = begin; i < end; i++) {  // Stack samples as rows
+             current_pass.push_back(X[i][0]);
+         }
+         return this->__forward_from(std::move(current_pass), 0, logits);
+     }
+ 
+     /**
+      * Private function to get predictions of a range of rows of sparse
+      * input in one batched forward pass. First multiplication is sparse
+      * (skipping first layer if it is a pass-through).
+      * @param X sparse input
+      * @param begin index of first row
+      * @param end index after last row
+      * @param passthrough whether first layer is a pass-through
+      * @param logits flag for whether to leave softmax of output layer
+      * unapplied (used to compute fused cross-entropy)
+      * @return predictions as matrix with one row per sample
+      */
+     std::vector<std::valarray<double>> __batch_forward(
+         const CSRMatrix<double> &X, const size_t &begin, const size_t &end,
+         const bool &passthrough, const bool &logits) const {
+         const size_t first = passthrough ? 1 : 0;
+         if (layers[first].type != LayerType::dense ||
+             layers[first].passthrough || layers[first].pruned) {
+             // Convolution needs whole grid (and pruned kernel is block
+             // sparse), so rows are made dense
+             std::vector<std::valarray<double>> current_pass;
+             for (size_t i = begin; i < end; i++) {
+                 current_pass.push_back(X.dense_row(i)[0]);
+             }
+             return this->__forward_from(std::move(current_pass), 0, logits);
+         }
+         return this->__forward_from(
+             multiply(X, begin, end, layers[first].kernel), first, logits,
+             true);
+     }
+ 
+     /**
+      * Private function to apply layers to a batch
+      * @param current_pass input of layer first (one row per sample), or its
+      * output before activation if multiplied is set
+      * @param first index of first layer to apply
+      * @param logits flag for whether to leave softmax of output layer
+      * unapplied
+      * @param multiplied flag for whether kernel of layer first is already
+      * applied
+      * @param last index after last layer to apply (default = all layers)
+      * @return predictions as matrix with one row per sample
+      */
+     std::vector<std::valarray<double>> __forward_from(
+         std::vector<std::valarray<double>> current_pass, const size_t &first,
+         const bool &logits, const bool &multiplied = false,
+         const size_t &last = SIZE_MAX) const {
+         if (current_pass.empty()) {
+             return current_pass;
+         }
+         for (size_t i = first; i < std::min(last, layers.size()); i++) {
+             const auto &l = layers[i];
+             if (l.type == LayerType::dropout) {  // Identity in inference
+                 continue;
+             }
+             if ((i != first || !multiplied) && !l.passthrough) {
+                 current_pass = l.forward(current_pass);
+             }
+             if (logits && l.softmax_output) {
+                 continue;
+             }
+             for (auto &row : current_pass) {  // Activate in place
+                 l.activate(row);
+             }
+         }
+         return current_pass;
+     }
+ 
+     /**
+      * Private function to split layers into contiguous spans of about
+      * equal work (multiply-adds per sample) for pipelined inference
+      * @param stages maximum number of spans
+      * @return returns index of first layer of every span, followed by
+      * number of layers
+      */
+     std::vector<size_t> __pipeline_spans(const size_t &stages) const {
+         std::vector<double> work(layers.size(), 0);
+         double total = 0;
+         for (size_t i = 0; i < layers.size(); i++) {
+             const auto &l = layers[i];
+             const auto shape = l.kernel_shape();
+             if (l.passthrough) {
+                 work[i] = 0;
+             } else if (l.type == LayerType::conv2d) {
+                 work[i] = double(shape.first) * shape.second * l.grid.cells();
+             } else if (l.type == LayerType::maxpool) {
+                 work[i] = double(l.neurons) * l.grid.size * l.grid.size;
+             } else {
+                 work[i] = double(shape.first) * shape.second;
+             }
+             total += work[i];
+         }
+         // Cutting after the layer where running sum passes next share
+         std::vector<size_t> spans(1, 0);
+         double sum = 0;
+         for (size_t i = 0; i + 1 < layers.size(); i++) {
+             sum += work[i];
+             if (spans.size() < stages &&
+                 sum >= total * spans.size() / stages) {
+                 spans.push_back(i + 1);
+             }
+         }
+         spans.push_back(layers.size());
+         return spans;
+     }
+ 
+     /**
+      * Private function to get error of output layer of one sample and
+      * update loss (MSE, cross-entropy is added by the fused kernel during
+      * forward pass) and accuracy
+      * @param predicted activations of output layer
+      * @param Y target vector
+      * @param loss loss accumulator
+      * @param acc accuracy accumulator
+      * @return returns error of output layer (predicted - Y)
+      */
+     std::vector<std::valarray<double>> __output_error(
+         const std::vector<std::valarray<double>> &predicted,
+         const std::vector<std::valarray<double>> &Y, double &loss,
+         double &acc) const {
+         std::vector<std::valarray<double>> cur_error =
+             predicted - Y;  // Absoulute error
+         // Calculating loss with MSE
+         if (!layers.back().softmax_output) {
+             loss += sum(apply_function(cur_error,
+                                        neural_network::util_functions::square));
+         }
+         // If prediction is correct
+         if (argmax(predicted) == argmax(Y)) {
+             acc += 1;
+         }
+         return cur_error;
+     }
+ 
+     /**
+      * Private function to backpropagate error of one sample and update
+      * kernels of layers [stop, last] (kernels are updated right after the
+      * error is propagated through them).
+      * @param activations detailed prediction of the sample
+      * @param cur_error error of output layer
+      * @param stop index of last layer (from the end) to be updated
+      * @param rate step size (learning rate / batch size)
+      * @return returns error w.r.t. output of layer (stop - 1), before
+      * applying derivative of its activation
+      */
+     std::vector<std::valarray<double>> __backprop(
+         const std::vector<std::vector<std::valarray<double>>> &activations,
+         std::vector<std::valarray<double>> cur_error, const size_t &stop,
+         const double &rate) {
+         const size_t last = this->layers.size() - 1;
+         const bool cross_entropy = this->layers.back().softmax_output;
+         // For every layer (from last one to stop)
+         for (size_t j = last; j >= stop && j >= 1; j--) {
+             // Backpropogating errors (softmax with cross-entropy has fused
+             // gradient (predicted - Y) already)
+             if (!(cross_entropy && j == last)) {
+                 cur_error = hadamard_product(
+                     cur_error,
+                     apply_function(activations[j + 1],
+                                    this->layers[j].dactivation_function));
+             }
+             // Updating kernel and changing error according to its old
+             // values (first layer is never trained so error is not needed
+             // there)
+             cur_error = this->layers[j].backward(activations[j], cur_error,
+                                                  rate, j > 1);
+         }
+         return cur_error;
+     }
+ 
+     /**
+      * Private function to write layers in model file format (see
+      * save_model), doubles are written with precision of the stream
+      * @param out_file stream to write to
+      * @param layers layers to be written
+      */
+     static void __write_layers(
+         std::ostream &out_file,
+         const std::vector<neural_network::layers::DenseLayer> &layers) {
+         out_file << layers.size();
+         out_file << std::endl;
+         for (const auto &layer : layers) {
+             out_file << layer.neurons << ' ';
+             if (layer.pruned) {  // Only non-zero blocks are saved
+                 const auto &b = layer.sparse_kernel;
+                 out_file << "sparse " << layer.activation << std::endl;
+                 out_file << b.rows << ' ' << b.cols << ' ' << b.block << ' '
+                          << b.blocks() << std::endl;
+                 for (size_t br = 0; br + 1 < b.offsets.size(); br++) {
+                     for (size_t k = b.offsets[br]; k < b.offsets[br + 1];
+                          k++) {
+                         out_file << br << ' ' << b.columns[k];
+                         for (size_t v = 0; v < b.block * b.block; v++) {
+                             out_file << ' '
+                                      << b.values[k * b.block * b.block + v];
+                         }
+                         out_file << std::endl;
+                     }
+                 }
+                 continue;
+             }
+             const std::string type =
+                 neural_network::layers::layer_type_name(layer.type);
+             if (layer.type == LayerType::layernorm) {
+                 out_file << type << ' ' << layer.activation << std::endl;
+             } else if (layer.type == LayerType::dropout) {
+                 out_file << type << ' ' << layer.rate << std::endl;
+             } else if (layer.type != LayerType::dense) {
+                 const auto &g = layer.grid;
+                 out_file << type << ' ' << layer.activation << ' '
+                          << g.channels << ' ' << g.height << ' ' << g.width
+                          << ' ' << g.size << ' ' << g.stride << std::endl;
+             } else {
+                 out_file << layer.activation << std::endl;
+             }
+             const auto shape = layer.kernel_shape();
+             out_file << shape.first << ' ' << shape.second << std::endl;
+             for (size_t r = 0; r < shape.first; r++) {
+                 for (size_t c = 0; c < shape.second; c++) {
+                     // Pass-through layer is saved as unit matrix
+                     out_file << (layer.passthrough ? double(r == c)
+                                                    : layer.kernel[r][c])
+                              << ' ';
+                 }
+                 out_file << std::endl;
+             }
+         }
+     }
+ 
+     /**
+      * Private function to read layers written by __write_layers
+      * @param in_file stream to read from
+      * @param file_name name of file (used in errors)
+      * @return returns layers
+      */
+     static std::vector<neural_network::layers::DenseLayer> __read_layers(
+         std::istream &in_file, const std::string &file_name) {
+         std::vector<neural_network::layers::DenseLayer>
+             loaded;  // To store pretrained layers
+         // Loading model from saved file format
+         size_t total_layers = 0;
+         in_file >> total_layers;
+         for (size_t i = 0; i < total_layers; i++) {
+             int neurons = 0;
+             std::string name, activation;
+             LayerType type = LayerType::dense;
+             neural_network::layers::Grid grid;
+             size_t shape_a = 0, shape_b = 0;
+             double rate = 0;
+             std::vector<std::valarray<double>> kernel;
+             in_file >> neurons >> name;
+             if (name == "sparse") {
+                 BlockSparseMatrix<double> sparse;
+                 size_t blocks = 0;
+                 in_file >> activation >> sparse.rows >> sparse.cols >>
+                     sparse.block >> blocks;
+                 sparse.values.resize(blocks * sparse.block * sparse.block);
+                 for (size_t k = 0, br = 0; k < blocks && in_file; k++) {
+                     size_t row = 0, column = 0;
+                     in_file >> row >> column;
+                     for (; br < row; br++) {  // Closing earlier block rows
+                         sparse.offsets.push_back(k);
+                     }
+                     sparse.columns.push_back(column);
+                     for (size_t v = 0; v < sparse.block * sparse.block; v++) {
+                         in_file >> sparse.values[k * sparse.block *
+                                                      sparse.block +
+                                                  v];
+                     }
+                 }
+                 while (sparse.block > 0 &&
+                        sparse.offsets.size() <=
+                            (sparse.rows + sparse.block - 1) / sparse.block) {
+                     sparse.offsets.push_back(blocks);
+                 }
+                 if (!in_file || sparse.block == 0) {
+                     std::cerr << "ERROR (" << __func__ << ") : ";
+                     std::cerr << "Invalid model file: " << file_name
+                               << std::endl;
+                     std::exit(EXIT_FAILURE);
+                 }
+                 loaded.emplace_back(neurons, activation,
+                                     std::vector<std::valarray<double>>());
+                 loaded.back().set_sparse(sparse);
+                 continue;
+             }
+             // Dense layer has activation in place of type
+             if (!neural_network::layers::parse_layer_type(name, &type)) {
+                 activation = name;
+             } else if (type == LayerType::conv2d ||
+                        type == LayerType::maxpool) {
+                 in_file >> activation >> grid.channels >> grid.height >>
+                     grid.width >> grid.size >> grid.stride;
+             } else if (type == LayerType::layernorm) {
+                 in_file >> activation;
+             } else if (type == LayerType::dropout) {
+                 activation = "none";
+                 in_file >> rate;
+             } else {  // Input and dense are never written as type
+                 in_file.setstate(std::ios::failbit);
+             }
+             in_file >> shape_a >> shape_b;
+             for (size_t r = 0; r < shape_a; r++) {
+                 std::valarray<double> row(shape_b);
+                 for (size_t c = 0; c < shape_b; c++) {
+                     in_file >> row[c];
+                 }
+                 kernel.push_back(row);
+             }
+             if (!in_file || (type == LayerType::layernorm &&
+                              (shape_a != 2 || shape_b != size_t(neurons)))) {
+                 std::cerr << "ERROR (" << __func__ << ") : ";
+                 std::cerr << "Invalid model file: " << file_name << std::endl;
+                 std::exit(EXIT_FAILURE);
+             }
+             if (type == LayerType::dense) {
+                 loaded.emplace_back(neurons, activation, kernel);
+             } else if (type == LayerType::layernorm ||
+                        type == LayerType::dropout) {
+                 // Dropout generator is derived from network generator
+                 // by the constructor (see __seed_dropout)
+                 loaded.emplace_back(type, neurons, activation, rate,
+                                     Xoshiro256());
+                 if (type == LayerType::layernorm) {
+                     loaded.back().kernel = kernel;
+                 }
+             } else {
+                 loaded.emplace_back(type, activation, grid, kernel);
+             }
+         }
+         return loaded;
+     }
+ 
+     /**
+      * Private function to write snapshot in checkpoint format: model (see
+      * save_model) followed by "checkpoint epoch sample samples loss acc",
+      * state of shuffling generator, state of generator of every dropout
+      * layer, shuffled order and history ("epochs" then "epoch loss acc
+      * seconds" per line). Doubles are written exactly.
+      * @param out_file stream to write to
+      * @param snapshot snapshot to be written
+      */
+     static void __write_snapshot(std::ostream &out_file,
+                                  const Snapshot &snapshot) {
+         const Progress &p = snapshot.progress;
+         out_file << std::setprecision(17);
+         __write_layers(out_file, snapshot.layers);
+         out_file << "checkpoint " << p.epoch << ' ' << p.sample << ' '
+                  << p.order.size() << ' ' << p.loss << ' ' << p.acc
+                  << std::endl;
+         out_file << snapshot.rng << std::endl;
+         for (const auto &l : snapshot.layers) {
+             if (l.type == LayerType::dropout) {
+                 out_file << l.dropout_rng << std::endl;
+             }
+         }
+         for (const auto &i : p.order) {
+             out_file << i << ' ';
+         }
+         out_file << std::endl << p.history.size() << std::endl;
+         for (const auto &h : p.history) {
+             out_file << h.epoch << ' ' << h.loss << ' ' << h.accuracy << ' '
+                      << h.seconds << std::endl;
+         }
+     }
+ 
+     /**
+      * Private function which runs training epochs. Shuffling, timing,
+      * stats and checkpoints are handled here, step trains on a single
+      * sample. Training continues from position set by resume if it was
+      * made for n samples.
+      * @tparam Step callable of form step(sample_index, loss, acc)
+      * @param n number of samples
+      * @param step function to train on one sample
+      * @param epochs number of epochs
+      * @param shuffle flag for whether to shuffle data
+      * @param verbose flag for whether to print training stats
+      * @return returns training stats of every epoch
+      */
+     template <typename Step>
+     std::vector<EpochMetrics> __fit(const size_t &n, Step step,
+                                     const int &epochs, const bool &shuffle,
+                                     const bool &verbose) {
+         // Samples are visited through a shuffled order so X and Y are never
+         // copied (they can be shared between concurrently trained networks)
+         std::vector<size_t> order(n);
+         for (size_t i = 0; i < order.size(); i++) {
+             order[i] = i;
+         }
+         std::vector<EpochMetrics> history;  // To store stats of every epoch
+         Progress start_at;  // Position of resumed training (if any)
+         if (resumed.order.size() == n) {
+             start_at = std::move(resumed);
+             order = start_at.order;
+             history = start_at.history;
+         }
+         resumed = Progress();
+         this->__drop_replicas();  // Weights change from here on
+         // Snapshots are copied into a double buffer and written by a
+         // background thread, so training only stalls for the copy
+         std::unique_ptr<SnapshotWriter<Snapshot>> writer;
+         if (!checkpoint_file.empty() && checkpoint_samples > 0) {
+             writer.reset(new SnapshotWriter<Snapshot>(checkpoint_file,
+                                                       __write_snapshot));
+         }
+         size_t trained = 0;  // Samples trained by this call
+         if (verbose) {
+             std::cout << "INFO: Training Started" << std::endl;
+         }
+         for (int epoch = std::max(1, start_at.epoch); epoch <= epochs;
+              epoch++) {  // For every epoch
+             const bool resuming = epoch == start_at.epoch;
+             // Shuffle order of samples if flag is set (resumed epoch keeps
+             // its saved order)
+             if (shuffle && !resuming) {
+                 for (size_t i = n; i > 1; i--) {  // Fisher-Yates shuffle
+                     std::swap(order[i - 1], order[rng.below(i)]);
+                 }
+             }
+             auto start =
+                 std::chrono::high_resolution_clock::now();  // Start clock
+             // Initialize performance metrics (resumed epoch keeps sums)
+             double loss = resuming ? start_at.loss : 0;
+             double acc = resuming ? start_at.acc : 0;
+             const size_t first = resuming ? start_at.sample : 0;
+             for (size_t i = first; i < n; i++) {  // For every sample
+                 step(order[i], loss, acc);
+                 if (writer && ++trained % checkpoint_samples == 0) {
+                     Snapshot &snapshot = writer->acquire();
+                     snapshot.layers = layers;
+                     snapshot.rng = rng;
+                     Progress &p = snapshot.progress;
+                     p.epoch = epoch;
+                     p.sample = i + 1;
+                     p.order = order;
+                     p.loss = loss;
+                     p.acc = acc;
+                     p.history = history;
+                     writer->publish();
+                 }
+             }
+             auto stop =
+                 std::chrono::high_resolution_clock::now();  // Stoping the clock
+             // Calculate time taken by epoch
+             auto duration =
+                 std::chrono::duration_cast<std::chrono::microseconds>(stop -
+                                                                       start);
+             loss /= n;  // Averaging loss
+             acc /= n;   // Averaging accuracy
+             history.push_back({epoch, loss, acc, duration.count() / 1e6});
+             if (!verbose) {
+                 continue;
+             }
+             std::cout.precision(4);  // set output precision to 4
+             // Printing training stats
+             std::cout << "Training: Epoch " << epoch << '/' << epochs;
+             std::cout << ", Loss: " << loss;
+             std::cout << ", Accuracy: " << acc;
+             std::cout << ", Taken time: " << duration.count() / 1e6
+                       << " seconds";
+             std::cout << std::endl;
+         }
+         return history;
+     }
+ 
+     /**
+      * Private function to evaluate model. Inference runs batched
+      * and multithreaded, and loss (MSE, or cross-entropy for softmax output),
+      * accuracy and confusion matrix are computed in a single pass over the
+      * predictions.
+      * @tparam Forward callable of form forward(begin, end, logits)
+      * returning batched predictions of samples [begin, end)
+      * @param n number of samples
+      * @param forward function to get predictions
+      * @param Y array of target values (label)
+      */
+     template <typename Forward>
+     void __evaluate(const size_t &n, Forward forward,
+                     const std::vector<std::vector<std::valarray<double>>> &Y) {
+         // Both label and input data should have same size
+         if (n != Y.size()) {
+             std::cerr << "ERROR (" << __func__ << ") : ";
+             std::cerr << "X and Y in evaluate have different sizes"
+                       << std::endl;
+             std::exit(EXIT_FAILURE);
+         }
+         std::cout << "INFO: Evaluation Started" << std::endl;
+         const size_t classes = this->layers.back().neurons;
+         const bool cross_entropy = this->layers.back().softmax_output;
+         // Per thread partial metrics (merged after all threads finish)
+         struct Metrics {
+             double loss = 0;
+             size_t correct = 0;
+             std::vector<size_t> confusion;
+         };
+         std::vector<Metrics> partial(ThreadPool::global().size());
+         auto start = std::chrono::high_resolution_clock::now();
+         size_t chunks = util_functions::parallel_for(
+             n, [&](size_t chunk, size_t begin, size_t end) {
+                 Metrics &m = partial[chunk];
+                 m.confusion.assign(classes * classes, 0);
+                 auto pred = forward(begin, end, cross_entropy);
+                 for (size_t i = begin; i < end; i++) {
+                     std::valarray<double> &p = pred[i - begin];
+                     const std::valarray<double> &y = Y[i][0];
+                     if (cross_entropy) {  // Fused kernel on logits
+                         m.loss += neural_network::activations::
+                             softmax_cross_entropy(p, y);
+                     }
+                     // Fused reduction: squared error and both argmaxes
+                     size_t p_max = 0, y_max = 0;
+                     for (size_t k = 0; k < p.size(); k++) {
+                         if (!cross_entropy) {
+                             const double diff = y[k] - p[k];
+                             m.loss += 0.5 * diff * diff;
+                         }
+                         p_max = p[k] > p[p_max] ? k : p_max;
+                         y_max = y[k] > y[y_max] ? k : y_max;
+                     }
+                     m.correct += (p_max == y_max);
+                     m.confusion[y_max * classes + p_max]++;
+                 }
+             });
+         auto stop = std::chrono::high_resolution_clock::now();
+         double seconds = std::chrono::duration<double>(stop - start).count();
+         double acc = 0, loss = 0;  // initialize performance metrics with zero
+         std::vector<size_t> confusion(classes * classes, 0);
+         for (size_t c = 0; c < chunks; c++) {  // Merge partial metrics
+             loss += partial[c].loss;
+             acc += partial[c].correct;
+             for (size_t k = 0; k < partial[c].confusion.size(); k++) {
+                 confusion[k] += partial[c].confusion[k];
+             }
+         }
+         acc /= n;   // Averaging accuracy
+         loss /= n;  // Averaging loss
+         // Prinitng performance of the model
+         std::cout << "Evaluation: Loss: " << loss;
+         std::cout << ", Accuracy: " << acc;
+         std::cout << ", Throughput: " << n / seconds << " rows/second"
+                   << std::endl;
+         // Printing confusion matrix (rows = actual, columns = predicted)
+         std::cout << "Confusion matrix (rows: actual, columns: predicted):"
+                   << std::endl;
+         for (size_t r = 0; r < classes; r++) {
+             for (size_t c = 0; c < classes; c++) {
+                 std::cout << confusion[r * classes + c] << '\t';
+             }
+             std::cout << std::endl;
+         }
+         return;
+     }
+ 
+  public:
+     /**
+      * Default Constructor for class NeuralNetwork. This constructor
+      * is used to create empty variable of type NeuralNetwork class.
+      */
+     NeuralNetwork() = default;
+ 
+     /**
+      * Constructor for class NeuralNetwork. This constructor
+      * is used by user.
+      * @param config vector containing pair (neurons, activation)
+      * @param seed seed for kernel initialization and shuffling (default =
+      * taken from system clock, i.e. not reproducible)
+      */
+     explicit NeuralNetwork(
+         const std::vector<std::pair<int, std::string>> &config,
+         const uint64_t &seed = Xoshiro256::clock_seed())
+         : NeuralNetwork(__dense_config(config), seed) {}
+ 
+     /**
+      * Constructor for class NeuralNetwork with convolution and pooling
+      * layers. First layer describes input grid, every following layer
+      * gets grid of previous layer (a dense layer of N neurons gives grid
+      * (N, 1, 1)).
+      * @param config description of every layer (see
+      * neural_network::layers::LayerConfig)
+      * @param seed seed for kernel initialization and shuffling (default =
+      * taken from system clock, i.e. not reproducible)
+      */
+     explicit NeuralNetwork(
+         const std::vector<neural_network::layers::LayerConfig> &config,
+         const uint64_t &seed = Xoshiro256::clock_seed())
+         : rng(seed) {
+         std::vector<std::string> activations;
+         for (const auto &c : config) {
+             activations.push_back(c.activation);
+         }
+         __check_activations(activations);
+         if (config[0].type != LayerType::input) {
+             std::cerr << "ERROR (" << __func__ << ") : ";
+             std::cerr << "First layer should be input layer got "
+                       << neural_network::layers::layer_type_name(
+                              config[0].type)
+                       << std::endl;
+             std::exit(EXIT_FAILURE);
+         }
+         // Separately creating first layer as a pass-through (its kernel
+         // would be a unit matrix, so it is never stored or multiplied)
+         const size_t inputs =
+             config[0].units * config[0].height * config[0].width;
+         layers.push_back(neural_network::layers::DenseLayer(
+             inputs, "none", {inputs, inputs}, false));
+         neural_network::layers::Grid current(config[0].units,
+                                              config[0].height,
+                                              config[0].width);
+         // Creating remaining layers (every layer from its own stream)
+         for (size_t i = 1; i < config.size(); i++) {
+             const auto &c = config[i];
+             if (c.type == LayerType::dense) {
+                 layers.push_back(neural_network::layers::DenseLayer(
+                     c.units, c.activation, {layers.back().neurons, c.units},
+                     true, rng.split(i)));
+                 current = neural_network::layers::Grid(c.units, 1, 1);
+             } else if (c.type == LayerType::conv2d ||
+                        c.type == LayerType::maxpool) {
+                 const neural_network::layers::Grid grid(
+                     current.channels, current.height, current.width, c.size,
+                     c.stride);
+                 layers.push_back(neural_network::layers::DenseLayer(
+                     c.type, c.units, c.activation, grid, rng.split(i)));
+                 current = neural_network::layers::Grid(
+                     layers.back().filters(), grid.out_height(),
+                     grid.out_width());
+             } else if ((c.type == LayerType::layernorm ||
+                         c.type == LayerType::dropout) &&
+                        i + 1 < config.size()) {
+                 // Grid is kept (normalization is over the whole row)
+                 layers.push_back(neural_network::layers::DenseLayer(
+                     c.type, layers.back().neurons, c.activation, c.rate,
+                     rng.split(i)));
+             } else {
+                 std::cerr << "ERROR (" << __func__ << ") : ";
+                 std::cerr << "Invalid layer type. Expected {dense, conv2d, "
+                              "maxpool, layernorm, dropout} (output layer "
+                              "can't be layernorm or dropout) got "
+                           << neural_network::layers::layer_type_name(c.type)
+                           << std::endl;
+                 std::exit(EXIT_FAILURE);
+             }
+         }
+         std::cout << "INFO: Network constructed successfully" << std::endl;
+     }
+ 
+     /**
+      * Copy Constructor for class NeuralNetwork.
+      *
+      * @param model instance of class to be copied.
+      */
+     NeuralNetwork(const NeuralNetwork &model) = default;
+ 
+     /**
+      * Destructor for class NeuralNetwork.
+      */
+     ~NeuralNetwork() = default;
+ 
+     /**
+      * Copy assignment operator for class NeuralNetwork
+      */
+     NeuralNetwork &operator=(const NeuralNetwork &model) = default;
+ 
+     /**
+      * Move constructor for class NeuralNetwork
+      */
+     NeuralNetwork(NeuralNetwork &&) = default;
+ 
+     /**
+      * Move assignment operator for class NeuralNetwork
+      */
+     NeuralNetwork &operator=(NeuralNetwork &&) = default;
+ 
+     /**
+      * Function to get X and Y from csv file (where X = data, Y = label)
+      * @param file_name csv file name
+      * @param last_label flag for whether label is in first or last column
+      * @param normalize flag for whether to normalize data
+      * @param slip_lines number of lines to skip
+      * @return returns pair of X and Y
+      */
+     std::pair<std::vector<std::vector<std::valarray<double>>>,
+               std::vector<std::vector<std::valarray<double>>>>
+     get_XY_from_csv(const std::string &file_name, const bool &last_label,
+                     const bool &normalize, const int &slip_lines = 1) {
+         std::ifstream in_file;                          // Ifstream to read file
+         in_file.open(file_name.c_str(), std::ios::in);  // Open file
+         // If there is any problem in opening file
+         if (!in_file.is_open()) {
+             std::cerr << "ERROR (" << __func__ << ") : ";
+             std::cerr << "Unable to open file: " << file_name << std::endl;
+             std::exit(EXIT_FAILURE);
+         }
+         std::vector<std::vector<std::valarray<double>>> X,
+             Y;             // To store X and Y
+         std::string line;  // To store each line
+         // Skip lines
+         for (int i = 0; i < slip_lines; i++) {
+             std::getline(in_file, line, '\n');  // Ignore line
+         }
+         // While file has information
+         while (!in_file.eof() && std::getline(in_file, line, '\n')) {
+             std::valarray<double> x_data,
+                 y_data;                  // To store single sample and label
+             std::stringstream ss(line);  // Constructing stringstream from line
+             std::string token;  // To store each token in line (seprated by ',')
+             while (std::getline(ss, token, ',')) {  // For each token
+                 // Insert numerical value of token in x_data
+                 x_data = insert_element(x_data, std::stod(token));
+             }
+             // If label is in last column
+             if (last_label) {
+                 y_data.resize(this->layers.back().neurons);
+                 // If task is classification
+                 if (y_data.size() > 1) {
+                     y_data[x_data[x_data.size() - 1]] = 1;
+                 }
+                 // If task is regrssion (of single value)
+                 else {
+                     y_data[0] = x_data[x_data.size() - 1];
+                 }
+                 x_data = pop_back(x_data);  // Remove label from x_data
+             } else {
+                 y_data.resize(this->layers.back().neurons);
+                 // If task is classification
+                 if (y_data.size() > 1) {
+                     y_data[x_data[x_data.size() - 1]] = 1;
+                 }
+                 // If task is regrssion (of single value)
+                 else {
+                     y_data[0] = x_data[x_data.size() - 1];
+                 }
+                 x_data = pop_front(x_data);  // Remove label from x_data
+             }
+             // Push collected X_data and y_data in X and Y
+             X.push_back({x_data});
+             Y.push_back({y_data});
+         }
+         // Normalize training data if flag is set
+         if (normalize) {
+             // Scale data between 0 and 1 using min-max scaler
+             X = minmax_scaler(X, 0.01, 1.0);
+         }
+         in_file.close();         // Closing file
+         return make_pair(X, Y);  // Return pair of X and Y
+     }
+ 
+     /**
+      * Function to get prediction of model on single sample.
+      * @param X array of feature vectors
+      * @return returns predictions as vector
+      */
+     std::vector<std::valarray<double>> single_predict(
+         const std::vector<std::valarray<double>> &X) {
+         // Get activations of all layers
+         auto activations = this->__detailed_single_prediction(X);
+         // Return activations of last layer (actual predicted values)
+         return activations.back();
+     }
+ 
+     /**
+      * Function to get prediction of model on batch (weights are replicated
+      * per NUMA node when the global pool spans several nodes)
+      * @param X array of feature vectors
+      * @return returns predicted values as vector
+      */
+     std::vector<std::vector<std::valarray<double>>> batch_predict(
+         const std::vector<std::vector<std::valarray<double>>> &X) {
+         // Store predicted values
+         std::vector<std::vector<std::valarray<double>>> predicted_batch(
+             X.size());
+         // With workers pinned over several NUMA nodes, every node reads
+         // weights from its own copy, made by the first thread on that node
+         // which needs it (so it is allocated on that node) and reused by
+         // later calls until weights change. Calling thread helps with
+         // chunks too and reads copy of the node it currently runs on.
+         ThreadPool &pool = ThreadPool::global();
+         const bool replicate = pool.nodes() > 1;
+         if (replicate) {
+             std::lock_guard<std::mutex> lock(replicas.lock);
+             replicas.nets.resize(pool.nodes());
+         }
+         // Every thread runs a batched forward pass over its own chunk
+         util_functions::parallel_for(
+             X.size(), [&](size_t, size_t begin, size_t end) {
+                 const NeuralNetwork *model = this;
+                 if (replicate) {
+                     const size_t node = pool.current_node();
+                     std::lock_guard<std::mutex> lock(replicas.lock);
+                     if (!replicas.nets[node]) {
+                         replicas.nets[node].reset(new NeuralNetwork(*this));
+                     }
+                     model = replicas.nets[node].get();
+                 }
+                 // Batch buffers are allocated by thread running the chunk
+                 auto predicted = model->__batch_forward(X, begin, end);
+                 for (size_t i = begin; i < end; i++) {
+                     predicted_batch[i] = {std::move(predicted[i - begin])};
+                 }
+             });
+         return predicted_batch;  // Return predicted values
+     }
+ 
+     /**
+      * Function to get predictions of model with pipelined inference. Layers
+      * are split into contiguous spans of about equal work, every span is
+      * run by its own thread and micro-batches flow between them through
+      * lock-free queues, so every thread only touches weights of its own
+      * layers (useful when weights of all layers don't fit one core's
+      * cache). Results are the same as batch_predict.
+      * @param X array of feature vectors
+      * @param stages number of threads (default = hardware concurrency,
+      * at most one per layer)
+      * @param micro_batch number of samples flowing together (default = 16)
+      * @return returns predicted values as vector
+      */
+     std::vector<std::vector<std::valarray<double>>> pipeline_predict(
+         const std::vector<std::vector<std::valarray<double>>> &X,
+         size_t stages = 0, const size_t &micro_batch = 16) const {
+         if (stages == 0) {
+             stages = std::max(1u, std::thread::hardware_concurrency());
+         }
+         const std::vector<size_t> spans = this->__pipeline_spans(stages);
+         stages = spans.size() - 1;
+         // Micro-batch: index of first sample and rows (empty rows end the
+         // stream)
+         typedef std::pair<size_t, std::vector<std::valarray<double>>> Batch;
+         std::vector<std::unique_ptr<SPSCQueue<Batch>>> queues;
+         for (size_t s = 0; s + 1 < stages; s++) {
+             queues.emplace_back(new SPSCQueue<Batch>(4));
+         }
+         std::vector<std::vector<std::valarray<double>>> predicted_batch(
+             X.size());
+         // Applying layers of span s to micro-batch and handing it on
+         auto run_span = [&](const size_t s, Batch batch) {
+             batch.second =
+                 this->__forward_from(std::move(batch.second), spans[s], false,
+                                      false, spans[s + 1]);
+             if (s + 1 < stages) {
+                 queues[s]->push(std::move(batch));
+                 return;
+             }
+             for (size_t i = 0; i < batch.second.size(); i++) {
+                 predicted_batch[batch.first + i] = {
+                     std::move(batch.second[i])};
+             }
+         };
+         std::vector<std::thread> threads;
+         for (size_t s = 1; s < stages; s++) {
+             threads.emplace_back([&, s]() {
+                 for (Batch batch = queues[s - 1]->pop(); !batch.second.empty();
+                      batch = queues[s - 1]->pop()) {
+                     run_span(s, std::move(batch));
+                 }
+                 if (s + 1 < stages) {  // Passing end of stream on
+                     queues[s]->push(Batch());
+                 }
+             });
+         }
+         // Calling thread runs first span
+         const size_t step = std::max<size_t>(1, micro_batch);
+         for (size_t begin = 0; begin < X.size(); begin += step) {
+             Batch batch;
+             batch.first = begin;
+             for (size_t i = begin; i < std::min(X.size(), begin + step);
+                  i++) {
+                 batch.second.push_back(X[i][0]);
+             }
+             run_span(0, std::move(batch));
+         }
+         if (stages > 1) {
+             queues[0]->push(Batch());
+         }
+         for (auto &t : threads) {
+             t.join();
+         }
+         return predicted_batch;
+     }
+ 
+     /**
+      * Function to fit model on supplied data
+      * @param X array of feature vectors
+      * @param Y array of target values
+      * @param epochs number of epochs (default = 100)
+      * @param learning_rate learning rate (default = 0.01)
+      * @param batch_size batch size for gradient descent (default = 32)
+      * @param shuffle flag for whether to shuffle data (default = true)
+      * @param verbose flag for whether to print training stats (default =
+      * true)
+      * @return returns training stats of every epoch
+      */
+     std::vector<EpochMetrics> fit(
+         const std::vector<std::vector<std::valarray<double>>> &X,
+         const std::vector<std::vector<std::valarray<double>>> &Y,
+         const int &epochs = 100, const double &learning_rate = 0.01,
+         const size_t &batch_size = 32, const bool &shuffle = true,
+         const bool &verbose = true) {
+         // Both label and input data should have same size
+         if (X.size() != Y.size()) {
+             std::cerr << "ERROR (" << __func__ << ") : ";
+             std::cerr << "X and Y in fit have different sizes" << std::endl;
+             std::exit(EXIT_FAILURE);
+         }
+         const double rate = learning_rate / double(batch_size);
+         return this->__fit(
+             X.size(),
+             [&](size_t s, double &loss, double &acc) {
+                 auto activations = this->__detailed_single_prediction(
+                     X[s], &Y[s], &loss, true);
+                 this->__backprop(
+                     activations,
+                     this->__output_error(activations.back(), Y[s], loss, acc),
+                     1, rate);
+             },
+             epochs, shuffle, verbose);
+     }
+ 
+     /**
+      * Function to fit model on sparse data. If first layer is a
+      * pass-through, forward pass and gradient of second layer only touch
+      * kernel rows of non-zero features.
+      * @param X sparse feature vectors (one row per sample)
+      * @param Y array of target values
+      * @param epochs number of epochs (default = 100)
+      * @param learning_rate learning rate (default = 0.01)
+      * @param batch_size batch size for gradient descent (default = 32)
+      * @param shuffle flag for whether to shuffle data (default = true)
+      * @param verbose flag for whether to print training stats (default =
+      * true)
+      * @return returns training stats of every epoch
+      */
+     std::vector<EpochMetrics> fit(
+         const CSRMatrix<double> &X,
+         const std::vector<std::vector<std::valarray<double>>> &Y,
+         const int &epochs = 100, const double &learning_rate = 0.01,
+         const size_t &batch_size = 32, const bool &shuffle = true,
+         const bool &verbose = true) {
+         // Both label and input data should have same size
+         if (X.rows() != Y.size()) {
+             std::cerr << "ERROR (" << __func__ << ") : ";
+             std::cerr << "X and Y in fit have different sizes" << std::endl;
+             std::exit(EXIT_FAILURE);
+         }
+         const double rate = learning_rate / double(batch_size);
+         const bool passthrough = this->__input_passthrough();
+         const size_t last = this->layers.size() - 1;
+         return this->__fit(
+             X.rows(),
+             [&](size_t s, double &loss, double &acc) {
+                 auto activations = this->__detailed_sparse_prediction(
+                     X, s, passthrough, &Y[s], &loss);
+                 auto cur_error =
+                     this->__output_error(activations.back(), Y[s], loss, acc);
+                 if (!passthrough) {
+                     this->__backprop(activations, cur_error, 1, rate);
+                     return;
+                 }
+                 // Dense layers first, then second layer from sparse input
+                 cur_error = this->__backprop(activations, cur_error, 2, rate);
+                 auto &l = this->layers[1];
+                 if (!(l.softmax_output && last == 1)) {
+                     cur_error = hadamard_product(
+                         cur_error,
+                         apply_function(activations[2], l.dactivation_function));
+                 }
+                 // Gradient is outer product of input and error, so only
+                 // rows of non-zero inputs change
+                 for (size_t k = X.offsets[s]; k < X.offsets[s + 1]; k++) {
+                     l.kernel[X.columns[k]] -=
+                         (rate * X.values[k]) * cur_error[0];
+                 }
+             },
+             epochs, shuffle, verbose);
+     }
+ 
+     /**
+      * Function to fit model on data stored in csv file
+      * @param file_name csv file name
+      * @param last_label flag for whether label is in first or last column
+      * @param epochs number of epochs
+      * @param learning_rate learning rate
+      * @param normalize flag for whether to normalize data
+      * @param slip_lines number of lines to skip
+      * @param batch_size batch size for gradient descent (default = 32)
+      * @param shuffle flag for whether to shuffle data (default = true)
+      * @param sparse_threshold data is converted to sparse (CSR) format if
+      * its density is below this value (default = 0, never)
+      */
+     void fit_from_csv(const std::string &file_name, const bool &last_label,
+                       const int &epochs, const double &learning_rate,
+                       const bool &normalize, const int &slip_lines = 1,
+                       const size_t &batch_size = 32,
+                       const bool &shuffle = true,
+                       const double &sparse_threshold = 0) {
+         // Getting training data from csv file
+         auto data =
+             this->get_XY_from_csv(file_name, last_label, normalize, slip_lines);
+         // Fit the model on training data
+         if (density(data.first) < sparse_threshold) {
+             std::cout << "INFO: Using sparse input" << std::endl;
+             this->fit(to_csr(data.first), data.second, epochs, learning_rate,
+                       batch_size, shuffle);
+         } else {
+             this->fit(data.first, data.second, epochs, learning_rate,
+                       batch_size, shuffle);
+         }
+         return;
+     }
+ 
+     /**
+      * Function to evaluate model on supplied data. Inference runs batched
+      * and multithreaded, and loss (MSE, or cross-entropy for softmax output),
+      * accuracy and confusion matrix are computed in a single pass over the
+      * predictions.
+      * @param X array of feature vectors (input data)
+      * @param Y array of target values (label)
+      */
+     void evaluate(const std::vector<std::vector<std::valarray<double>>> &X,
+                   const std::vector<std::vector<std::valarray<double>>> &Y) {
+         this->__evaluate(
+             X.size(),
+             [&](size_t begin, size_t end, bool logits) {
+                 return this->__batch_forward(X, begin, end, logits);
+             },
+             Y);
+     }
+ 
+     /**
+      * Function to evaluate model on sparse data (see evaluate)
+      * @param X sparse feature vectors (one row per sample)
+      * @param Y array of target values (label)
+      */
+     void evaluate(const CSRMatrix<double> &X,
+                   const std::vector<std::vector<std::valarray<double>>> &Y) {
+         const bool passthrough = this->__input_passthrough();
+         this->__evaluate(
+             X.rows(),
+             [&](size_t begin, size_t end, bool logits) {
+                 return this->__batch_forward(X, begin, end, passthrough,
+                                              logits);
+             },
+             Y);
+     }
+ 
+     /**
+      * Function to evaluate model on data stored in csv file
+      * @param file_name csv file name
+      * @param last_label flag for whether label is in first or last column
+      * @param normalize flag for whether to normalize data
+      * @param slip_lines number of lines to skip
+      * @param sparse_threshold data is converted to sparse (CSR) format if
+      * its density is below this value (default = 0, never)
+      */
+     void evaluate_from_csv(const std::string &file_name, const bool &last_label,
+                            const bool &normalize, const int &slip_lines = 1,
+                            const double &sparse_threshold = 0) {
+         // Getting training data from csv file
+         auto data =
+             this->get_XY_from_csv(file_name, last_label, normalize, slip_lines);
+         // Evaluating model
+         if (density(data.first) < sparse_threshold) {
+             std::cout << "INFO: Using sparse input" << std::endl;
+             this->evaluate(to_csr(data.first), data.second);
+         } else {
+             this->evaluate(data.first, data.second);
+         }
+         return;
+     }
+ 
+     /**
+      * Function to save current model.
+      * @param file_name file name to save model (*.model)
+      */
+     void save_model(const std::string &_file_name) {
+         std::string file_name = _file_name;
+         // Adding ".model" extension if it is not already there in name
+         if (file_name.find(".model") == file_name.npos) {
+             file_name += ".model";
+         }
+         std::ofstream out_file;  // Ofstream to write in file
+         // Open file in out|trunc mode
+         out_file.open(file_name.c_str(),
+                       std::ofstream::out | std::ofstream::trunc);
+         // If there is any problem in opening file
+         if (!out_file.is_open()) {
+             std::cerr << "ERROR (" << __func__ << ") : ";
+             std::cerr << "Unable to open file: " << file_name << std::endl;
+             std::exit(EXIT_FAILURE);
+         }
+         /**
+             Format in which model is saved:
+ 
+             total_layers
+             neurons(1st neural_network::layers::DenseLayer) activation_name(1st
+            neural_network::layers::DenseLayer) kernel_shape(1st
+            neural_network::layers::DenseLayer) kernel_values
+             .
+             .
+             .
+             neurons(Nth neural_network::layers::DenseLayer) activation_name(Nth
+            neural_network::layers::DenseLayer) kernel_shape(Nth
+            neural_network::layers::DenseLayer) kernel_value
+ 
+             For Example, pretrained model with 3 layers:
+             <pre>
+             3
+             4 none
+             4 4
+             1 0 0 0
+             0 1 0 0
+             0 0 1 0
+             0 0 0 1
+             6 relu
+             4 6
+             -1.88963 -3.61165 1.30757 -0.443906 -2.41039 -2.69653
+             -0.684753 0.0891452 0.795294 -2.39619 2.73377 0.318202
+             -2.91451 -4.43249 -0.804187 2.51995 -6.97524 -1.07049
+             -0.571531 -1.81689 -1.24485 1.92264 -2.81322 1.01741
+             3 sigmoid
+             6 3
+             0.390267 -0.391703 -0.0989607
+             0.499234 -0.564539 -0.28097
+             0.553386 -0.153974 -1.92493
+             -2.01336 -0.0219682 1.44145
+             1.72853 -0.465264 -0.705373
+             -0.908409 -0.740547 0.376416
+             </pre>
+ 
+             Convolution and max pooling layers have type and input grid
+             after neurons, i.e. "neurons type activation channels height
+             width size stride", max pooling layer has kernel shape 0 0.
+ 
+             Layer normalization is saved as "neurons layernorm activation"
+             with kernel of shape 2 neurons (gain and bias), dropout as
+             "neurons dropout rate" with kernel shape 0 0.
+ 
+             Pruned layers are saved block sparse as "neurons sparse
+             activation", then "rows cols block_size blocks" and one line
+             "block_row block_column values" per non-zero block (block_size
+             * block_size values, row major).
+         */
+         // Saving model in the same format
+         __write_layers(out_file, this->layers);
+         std::cout << "INFO: Model saved successfully with name : ";
+         std::cout << file_name << std::endl;
+         out_file.close();  // Closing file
+         return;
+     }
+ 
+     /**
+      * Function to load earlier saved model.
+      * @param file_name file from which model will be loaded (*.model)
+      * @return instance of NeuralNetwork class with pretrained weights
+      */
+     NeuralNetwork load_model(const std::string &file_name) {
+         std::ifstream in_file;            // Ifstream to read file
+         in_file.open(file_name.c_str());  // Openinig file
+         // If there is any problem in opening file
+         if (!in_file.is_open()) {
+             std::cerr << "ERROR (" << __func__ << ") : ";
+             std::cerr << "Unable to open file: " << file_name << std::endl;
+             std::exit(EXIT_FAILURE);
+         }
+         auto loaded = __read_layers(in_file, file_name);
+         std::cout << "INFO: Model loaded successfully" << std::endl;
+         in_file.close();  // Closing file
+         return NeuralNetwork(
+             std::move(loaded));  // Return instance of NeuralNetwork class
+     }
+ 
+     /**
+      * Function to prune kernels of dense layers by magnitude (see
+      * neural_network::layers::DenseLayer::prune). Pruned layers keep only
+      * block sparse kernel, which is used in inference and training (pruned
+      * weights stay zero) and is saved block sparse.
+      * @param sparsity fraction of blocks to be pruned in every layer
+      * @param block width (and height) of a block (default = 4)
+      * @return returns fraction of zero weights in pruned layers
+      */
+     double prune(const double &sparsity, const size_t &block = 4) {
+         this->__drop_replicas();
+         size_t zeros = 0, total = 0;
+         for (auto &l : layers) {
+             if (l.type != LayerType::dense || l.passthrough) {
+                 continue;
+             }
+             l.prune(sparsity, block);
+             for (const auto &row : l.sparse_kernel.dense()) {
+                 for (const auto &w : row) {
+                     zeros += (w == 0);
+                 }
+                 total += row.size();
+             }
+         }
+         return total ? double(zeros) / total : 0.0;
+     }
+ 
+     /**
+      * Function to check gradients of backpropagation against central
+      * finite differences of the loss on a single sample. Loss is half of
+      * squared error (whose gradient is predicted - Y as in training), or
+      * cross-entropy for softmax output. Network is left unchanged.
+      * @param X input vector of shape (1, input_size)
+      * @param Y target vector of shape (1, output_size)
+      * @param epsilon step of finite differences
+      * @return returns largest relative error over all trained weights
+      * (absolute error for gradients below 1e-3)
+      */
+     double gradient_check(const std::vector<std::valarray<double>> &X,
+                           const std::vector<std::valarray<double>> &Y,
+                           const double &epsilon = 1e-6) const {
+         NeuralNetwork probe = *this;  // Copy whose weights are perturbed
+         // Every pass runs on a fresh copy so dropout draws the same masks
+         auto sample_loss = [&]() {
+             double loss = 0;
+             NeuralNetwork pass = probe;
+             auto details =
+                 pass.__detailed_single_prediction(X, &Y, &loss, true);
+             if (!layers.back().softmax_output) {
+                 loss = 0.5 * sum(apply_function(
+                                  details.back() - Y,
+                                  neural_network::util_functions::square));
+             }
+             return loss;
+         };
+         // Analytic gradient is what one step with rate 1 subtracts
+         NeuralNetwork stepped = *this;
+         double loss = 0, acc = 0;
+         auto details =
+             stepped.__detailed_single_prediction(X, &Y, &loss, true);
+         stepped.__backprop(
+             details, stepped.__output_error(details.back(), Y, loss, acc), 1,
+             1.0);
+         double worst = 0;
+         // Weight w of probe, after is the same weight of stepped
+         auto check = [&](double &w, const double &after) {
+             const double original = w;
+             w = original + epsilon;
+             const double plus = sample_loss();
+             w = original - epsilon;
+             const double minus = sample_loss();
+             w = original;
+             const double numeric = (plus - minus) / (2 * epsilon);
+             const double analytic = original - after;
+             // Small gradients are compared absolutely, finite differences
+             // can't resolve them relatively
+             const double scale =
+                 std::max(1e-3, std::abs(numeric) + std::abs(analytic));
+             worst = std::max(worst, std::abs(numeric - analytic) / scale);
+         };
+         for (size_t j = 1; j < layers.size(); j++) {
+             auto &kernel = probe.layers[j].kernel;
+             for (size_t r = 0; r < kernel.size(); r++) {
+                 for (size_t c = 0; c < kernel[r].size(); c++) {
+                     check(kernel[r][c], stepped.layers[j].kernel[r][c]);
+                 }
+             }
+             // Pruned layer: stored blocks (padding has zero gradient)
+             auto &values = probe.layers[j].sparse_kernel.values;
+             for (size_t v = 0; v < values.size(); v++) {
+                 check(values[v], stepped.layers[j].sparse_kernel.values[v]);
+             }
+         }
+         return worst;
+     }
+ 
+     /**
+      * Function to reseed generators used for shuffling training data and
+      * for dropout masks (e.g. for reproducible training of a loaded model;
+      * streams are the same as of a network constructed with this seed)
+      * @param seed new seed
+      */
+     void seed(const uint64_t &seed) {
+         rng = Xoshiro256(seed);
+         this->__seed_dropout();
+     }
+ 
+     /**
+      * Function to make fit write checkpoints (weights, generators and
+      * position in training) every given number of samples. Checkpoint is
+      * copied into a double buffer and written by a background thread, so
+      * training only stalls for the copy.
+      * @param file_name checkpoint file (replaced atomically by every
+      * checkpoint)
+      * @param samples number of trained samples between checkpoints (0
+      * disables checkpoints)
+      */
+     void checkpoint(const std::string &file_name, const size_t &samples) {
+         checkpoint_file = file_name;
+         checkpoint_samples = samples;
+     }
+ 
+     /**
+      * Function to restore network from checkpoint written during fit.
+      * Next call of fit on the same data (with the same epochs and flags)
+      * continues exactly where the checkpoint was taken and returns stats
+      * of all epochs.
+      * @param file_name checkpoint file
+      */
+     void resume(const std::string &file_name) {
+         std::ifstream in_file(file_name.c_str());
+         if (!in_file.is_open()) {
+             std::cerr << "ERROR (" << __func__ << ") : ";
+             std::cerr << "Unable to open file: " << file_name << std::endl;
+             std::exit(EXIT_FAILURE);
+         }
+         NeuralNetwork restored(__read_layers(in_file, file_name));
+         Progress p;
+         std::string tag;
+         size_t samples = 0, epochs = 0;
+         in_file >> tag >> p.epoch >> p.sample >> samples >> p.loss >> p.acc;
+         in_file >> restored.rng;
+         for (auto &l : restored.layers) {
+             if (l.type == LayerType::dropout) {
+                 in_file >> l.dropout_rng;
+             }
+         }
+         p.order.resize(samples);
+         for (auto &i : p.order) {
+             in_file >> i;
+         }
+         in_file >> epochs;
+         p.history.resize(epochs);
+         for (auto &h : p.history) {
+             in_file >> h.epoch >> h.loss >> h.accuracy >> h.seconds;
+         }
+         if (!in_file || tag != "checkpoint") {
+             std::cerr << "ERROR (" << __func__ << ") : ";
+             std::cerr << "Invalid checkpoint file: " << file_name
+                       << std::endl;
+             std::exit(EXIT_FAILURE);
+         }
+         this->__drop_replicas();
+         layers = std::move(restored.layers);
+         rng = restored.rng;
+         resumed = std::move(p);
+         std::cout << "INFO: Resuming from epoch " << resumed.epoch
+                   << ", sample " << resumed.sample << std::endl;
+     }
+ 
+     /**
+      * Function to get number of input features of the network
+      * @return number of neurons of first layer
+      */
+     size_t input_size() const { return layers.front().neurons; }
+ 
+     /**
+      * Function to get number of outputs of the network
+      * @return number of neurons of last layer
+      */
+     size_t output_size() const { return layers.back().neurons; }
+ 
+     /**
+      * Function to print summary of the network.
+      */
+     void summary() {
+         // Printing Summary
+         std::cout
+             << "==============================================================="
+             << std::endl;
+         std::cout << "\t\t+ MODEL SUMMARY +\t\t\n";
+         std::cout
+             << "==============================================================="
+             << std::endl;
+         for (size_t i = 1; i <= layers.size(); i++) {  // For every layer
+             std::cout << i << ")";
+             std::cout << " Neurons : "
+                       << layers[i - 1].neurons;  // number of neurons
+             std::cout << ", Activation : "
+                       << layers[i - 1].activation;  // activation
+             std::cout << ", kernel Shape : "
+                       << layers[i - 1].kernel_shape();  // kernel shape
+             if (layers[i - 1].pruned) {  // Stored blocks of pruned layer
+                 const auto &b = layers[i - 1].sparse_kernel;
+                 const size_t total = ((b.rows + b.block - 1) / b.block) *
+                                      ((b.cols + b.block - 1) / b.block);
+                 std::cout << ", Sparse : " << b.blocks() << "/" << total
+                           << " blocks of " << b.block << "x" << b.block;
+             }
+             if (layers[i - 1].type == LayerType::dropout) {
+                 std::cout << ", Type : dropout, Rate : "
+                           << layers[i - 1].rate;
+             } else if (layers[i - 1].type == LayerType::layernorm) {
+                 std::cout << ", Type : layernorm";
+             } else if (layers[i - 1].type != LayerType::dense) {  // Window
+                 const auto &g = layers[i - 1].grid;
+                 std::cout << ", Type : "
+                           << neural_network::layers::layer_type_name(
+                                  layers[i - 1].type)
+                           << ", Window : " << g.size << "x" << g.size
+                           << " (stride " << g.stride << ")";
+             }
+             std::cout << std::endl;
+         }
+         size_t parameters = 0;  // Weights of all trained layers
+         for (size_t i = 1; i < layers.size(); i++) {
+             const auto shape = layers[i].kernel_shape();
+             parameters += shape.first * shape.second;
+         }
+         std::cout << "Trainable parameters : " << parameters << std::endl;
+         std::cout
+             << "==============================================================="
+             << std::endl;
+         return;
+     }
+ };
+ 
+ /**
+  * FixedLayers holds kernels of consecutive fully connected layers whose
+  * sizes are known at compile time (In -> Rest...). Every instantiation
+  * holds one kernel and the following layers, the one without further
+  * sizes holds nothing and ends the recursion.
+  * @tparam Act activation policy of hidden layers
+  * @tparam In number of inputs of the first layer
+  * @tparam Rest number of neurons of every following layer
+  */
+ template <typename Act, size_t In, size_t... Rest>
+ struct FixedLayers {
+     static constexpr size_t outputs = In;  // Neurons of output layer
  
      /**
-      * Function to get X and Y from csv file (where X = data, Y = label)
-      * @param file_name csv file name
-      * @param last_label flag for whether label is in first or last column
-      * @param normalize flag for whether to normalize data
-      * @param slip_lines number of lines to skip
-      * @return returns pair of X and Y
+      * Function to read layers from model file (nothing left to read)
       */
-     std::pair<std::vector<std::vector<std::valarray<double>>>,
-               std::vector<std::vector<std::valarray<double>>>>
-     get_XY_from_csv(const std::string &file_name, const bool &last_label,
-                     const bool &normalize, const int &slip_lines = 1) {
-         std::ifstream in_file;                          // Ifstream to read file
-         in_file.open(file_name.c_str(), std::ios::in);  // Open file
-         // If there is any problem in opening file
+     void load(std::istream &, const std::string &, std::string &) {}
+ 
+     /**
+      * Function to get output of layers (nothing left to apply)
+      * @param x output of last layer
+      * @return returns x
+      */
+     std::array<double, In> forward(const std::array<double, In> &x) const {
+         return x;
+     }
+ };
+ 
+ template <typename Act, size_t In, size_t Out, size_t... Rest>
+ struct FixedLayers<Act, In, Out, Rest...> {
+     static constexpr size_t outputs = FixedLayers<Act, Out, Rest...>::outputs;
+     std::array<std::array<double, Out>, In> kernel;  // Kernel of the layer
+     FixedLayers<Act, Out, Rest...> next;             // Following layers
+ 
+     /**
+      * Function to read this and following layers from model file (in
+      * format of NeuralNetwork::save_model)
+      * @param in stream positioned at this layer
+      * @param file_name name of model file (used in errors)
+      * @param output where activation of output layer is stored
+      */
+     void load(std::istream &in, const std::string &file_name,
+               std::string &output) {
+         size_t neurons = 0, rows = 0, cols = 0;
+         std::string type, activation;
+         in >> neurons >> type;
+         for (auto &row : kernel) {
+             row.fill(0);
+         }
+         if (type == "sparse") {  // Pruned kernel is made dense again
+             size_t block = 0, blocks = 0;
+             in >> activation >> rows >> cols >> block >> blocks;
+             for (size_t k = 0; k < blocks && in; k++) {
+                 size_t br = 0, bc = 0;
+                 in >> br >> bc;
+                 for (size_t v = 0; v < block * block; v++) {
+                     const size_t r = br * block + v / block;
+                     const size_t c = bc * block + v % block;
+                     double value = 0;
+                     in >> value;
+                     if (r < In && c < Out) {  // Padding of edge blocks
+                         kernel[r][c] = value;
+                     }
+                 }
+             }
+         } else if (type != "conv2d" && type != "maxpool") {
+             activation = type;
+             in >> rows >> cols;
+             for (size_t r = 0; r < rows && rows == In && cols == Out; r++) {
+                 for (size_t c = 0; c < cols; c++) {
+                     in >> kernel[r][c];
+                 }
+             }
+         }
+         // Hidden layers must use activation of the template
+         if (!in || neurons != Out || rows != In || cols != Out ||
+             (sizeof...(Rest) > 0 && activation != Act::name())) {
+             std::cerr << "ERROR (" << __func__ << ") : ";
+             std::cerr << "Model in " << file_name
+                       << " doesn't match fixed network at layer of " << Out
+                       << " neurons (expected dense " << In << "x" << Out
+                       << " kernel";
+             if (sizeof...(Rest) > 0) {
+                 std::cerr << " with " << Act::name() << " activation";
+             }
+             std::cerr << ")" << std::endl;
+             std::exit(EXIT_FAILURE);
+         }
+         output = activation;
+         next.load(in, file_name, output);
+     }
+ 
+     /**
+      * Function to get output of this and following layers (activation
+      * of output layer is left to FixedNetwork)
+      * @param x input of the layer
+      * @return returns pre-activation values of output layer
+      */
+     std::array<double, outputs> forward(const std::array<double, In> &x) const {
+         std::array<double, Out> z{};
+         // Trip counts are constants so loops are unrolled and vectorized
+         for (size_t i = 0; i < In; i++) {
+             for (size_t j = 0; j < Out; j++) {
+                 z[j] += x[i] * kernel[i][j];
+             }
+         }
+         if (sizeof...(Rest) > 0) {  // Hidden layer
+             for (auto &v : z) {
+                 v = Act::apply(v);
+             }
+         }
+         return next.forward(z);
+     }
+ };
+ 
+ /**
+  * FixedNetwork class is an inference only fully connected network whose
+  * layer sizes are template parameters, e.g. FixedNetwork<activations::Relu,
+  * 4, 6, 3> for iris. Kernels live in std::array, every loop has a compile
+  * time trip count and activation of hidden layers is a type, so for tiny
+  * models a prediction takes nanoseconds instead of microseconds of dynamic
+  * NeuralNetwork. Weights are loaded from file saved by
+  * NeuralNetwork::save_model.
+  * @tparam Act activation policy of hidden layers
+  * @tparam Inputs number of input features (neurons of first layer)
+  * @tparam Sizes number of neurons of every following layer
+  */
+ template <typename Act, size_t Inputs, size_t... Sizes>
+ class FixedNetwork {
+     static_assert(sizeof...(Sizes) > 0, "Atleast two layers are required");
+ 
+  public:
+     static constexpr size_t outputs =
+         FixedLayers<Act, Inputs, Sizes...>::outputs;  // Output neurons
+ 
+     /**
+      * Function to load model saved by NeuralNetwork::save_model. First
+      * layer must be the (identity) input layer, hidden layers must use
+      * activation Act and sizes must match template parameters.
+      * @param file_name file from which model will be loaded (*.model)
+      * @return instance of FixedNetwork class with pretrained weights
+      */
+     FixedNetwork load_model(const std::string &file_name) const {
+         std::ifstream in_file(file_name.c_str());
          if (!in_file.is_open()) {
              std::cerr << "ERROR (" << __func__ << ") : ";
              std::cerr << "Unable to open file: " << file_name << std::endl;
              std::exit(EXIT_FAILURE);
          }
-         std::vector<std::vector<std::valarray<double>>> X,
-             Y;             // To store X and Y
-         std::string line;  // To store each line
-         // Skip lines
-         for (int i = 0; i < slip_lines; i++) {
-             std::getline(in_file, line, '\n');  // Ignore line
-         }
-         // While file has information
-         while (!in_file.eof() && std::getline(in_file, line, '\n')) {
-             std::valarray<double> x_data,
-                 y_data;                  // To store single sample and label
-             std::stringstream ss(line);  // Constructing stringstream from line
-             std::string token;  // To store each token in line (seprated by ',')
-             while (std::getline(ss, token, ',')) {  // For each token
-                 // Insert numerical value of token in x_data
-                 x_data = insert_element(x_data, std::stod(token));
+         size_t total_layers = 0, neurons = 0, rows = 0, cols = 0;
+         std::string activation;
+         in_file >> total_layers >> neurons >> activation >> rows >> cols;
+         bool valid = in_file && total_layers == sizeof...(Sizes) + 1 &&
+                      neurons == Inputs && activation == "none" &&
+                      rows == Inputs && cols == Inputs;
+         for (size_t r = 0; r < Inputs && valid; r++) {
+             for (size_t c = 0; c < Inputs && valid; c++) {
+                 double value = 0;
+                 in_file >> value;
+                 valid = in_file && value == (r == c ? 1.0 : 0.0);
              }
-             // If label is in last column
-             if (last_label) {
-                 y_data.resize(this->layers.back().neurons);
-                 // If task is classification
-                 if (y_data.size() > 1) {
-                     y_data[x_data[x_data.size() - 1]] = 1;
+         }
+         if (!valid) {
+             std::cerr << "ERROR (" << __func__ << ") : ";
+             std::cerr << "Model in " << file_name << " should have "
+                       << sizeof...(Sizes) + 1
+                       << " layers and identity input layer of " << Inputs
+                       << " neurons" << std::endl;
+             std::exit(EXIT_FAILURE);
+         }
+         FixedNetwork loaded;
+         std::string output;
+         loaded.dense.load(in_file, file_name, output);
+         loaded.output = output_of(output);
+         std::cout << "INFO: Model loaded successfully" << std::endl;
+         return loaded;
+     }
+ 
+     /**
+      * Function to get prediction of model on single sample (same values
+      * as NeuralNetwork::single_predict up to rounding)
+      * @param x feature vector
+      * @return returns predicted values
+      */
+     std::array<double, outputs> predict(
+         const std::array<double, Inputs> &x) const {
+         std::array<double, outputs> y = dense.forward(x);
+         switch (output) {
+             case Output::sigmoid:
+                 for (auto &v : y) {
+                     v = activations::sigmoid(v);
                  }
-                 // If task is regrssion (of single value)
-                 else {
-                     y_data[0] = x_data[x_data.size() - 1];
+                 break;
+             case Output::relu:
+                 for (auto &v : y) {
+                     v = activations::relu(v);
                  }
-                 x_data = pop_back(x_data);  // Remove label from x_data
-             } else {
-                 y_data.resize(this->layers.back().neurons);
-                 // If task is classification
-                 if (y_data.size() > 1) {
-                     y_data[x_data[x_data.size() - 1]] = 1;
+                 break;
+             case Output::tanh:
+                 for (auto &v : y) {
+                     v = activations::tanh(v);
                  }
-                 // If task is regrssion (of single value)
-                 else {
-                     y_data[0] = x_data[x_data.size() - 1];
+                 break;
+             case Output::softmax: {  // Same steps as activations::softmax
+                 double max = y[0], total = 0;
+                 for (const auto &v : y) {
+                     max = std::max(max, v);
                  }
-                 x_data = pop_front(x_data);  // Remove label from x_data
+                 for (auto &v : y) {
+                     v = std::exp(v - max);
+                     total += v;
+                 }
+                 for (auto &v : y) {
+                     v /= total;
+                 }
+                 break;
              }
-             // Push collected X_data and y_data in X and Y
-             X.push_back({x_data});
-             Y.push_back({y_data});
-         }
-         // Normalize training data if flag is set
-         if (normalize) {
-             // Scale data between 0 and 1 using min-max scaler
-             X = minmax_scaler(X, 0.01, 1.0);
+             case Output::none:
+                 break;
          }
-         in_file.close();         // Closing file
-         return make_pair(X, Y);  // Return pair of X and Y
+         return y;
      }
  
+  private:
+     // Activation of output layer (read from model file, applied once per
+     // prediction so it does not need to be a type)
+     enum class Output { none, sigmoid, relu, tanh, softmax };
+ 
+     FixedLayers<Act, Inputs, Sizes...> dense{};  // Kernels of all layers
+     Output output = Output::none;                // Activation of output
+ 
      /**
-      * Function to get prediction of model on single sample.
-      * @param X array of feature vectors
-      * @return returns predictions as vector
+      * Function to get activation of output layer from its name
+      * @param name name of activation
+      * @return returns activation
       */
-     std::vector<std::valarray<double>> single_predict(
-         const std::vector<std::valarray<double>> &X) {
-         // Get activations of all layers
-         auto activations = this->__detailed_single_prediction(X);
-         // Return activations of last layer (actual predicted values)
-         return activations.back();
+     static Output output_of(const std::string &name) {
+         const std::map<std::string, Output> known = {
+             {"none", Output::none},   {"sigmoid", Output::sigmoid},
+             {"relu", Output::relu},   {"tanh", Output::tanh},
+             {"softmax", Output::softmax}};
+         const auto found = known.find(name);
+         if (found == known.end()) {
+             std::cerr << "ERROR (" << __func__ << ") : ";
+             std::cerr << "Invalid argument. Expected {none, sigmoid, relu, "
+                          "tanh, softmax}, got "
+                       << name << std::endl;
+             std::exit(EXIT_FAILURE);
+         }
+         return found->second;
      }
+ };
  
+ /**
+  * Sweep class trains many configurations of NeuralNetwork concurrently on
+  * the same dataset. Dataset is loaded once and shared read-only by all runs,
+  * every run is one task on the work stealing thread pool so many small
+  * networks keep all cores busy.
+  */
+ class Sweep {
+  public:
      /**
-      * Function to get prediction of model on batch
-      * @param X array of feature vectors
-      * @return returns predicted values as vector
+      * Constructor for Sweep class
+      * @param seed seed of the sweep, every run gets its own seed derived
+      * from it (default = taken from system clock)
       */
-     std::vector<std::vector<std::valarray<double>>> batch_predict(
-         const std::vector<std::vector<std::valarray<double>>> &X) {
-         // Store predicted values
-         std::vector<std::vector<std::valarray<double>>> predicted_batch(
-             X.size());
-         for (size_t i = 0; i < X.size(); i++) {  // For every sample
-             // Push predicted values
-             predicted_batch[i] = this->single_predict(X[i]);
+     explicit Sweep(const uint64_t &seed = Xoshiro256::clock_seed())
+         : seed(seed) {}
+ 
+     /**
+      * Hyperparameters of a single run
+      */
+     struct Config {
+         std::vector<std::pair<int, std::string>> layers;  // (neurons, act)
+         int epochs;            // Number of epochs
+         double learning_rate;  // Learning rate
+         size_t batch_size;     // Batch size for gradient descent
+     };
+ 
+     /**
+      * Single row of results table (stats of one epoch of one run)
+      */
+     struct Result {
+         size_t run;             // Index of run (order in which it was added)
+         EpochMetrics metrics;  // Stats of the epoch
+     };
+ 
+     /**
+      * Function to add a configuration to the sweep
+      * @param config hyperparameters of the run
+      */
+     void add(const Config &config) {
+         // All runs share data so input and output sizes must agree
+         if (!configs.empty() &&
+             (configs[0].layers.front().first != config.layers.front().first ||
+              configs[0].layers.back().first != config.layers.back().first)) {
+             std::cerr << "ERROR (" << __func__ << ") : ";
+             std::cerr << "All configurations of sweep should have same input "
+                          "and output neurons"
+                       << std::endl;
+             std::exit(EXIT_FAILURE);
          }
-         return predicted_batch;  // Return predicted values
+         configs.push_back(config);
      }
  
      /**
-      * Function to fit model on supplied data
-      * @param X array of feature vectors
-      * @param Y array of target values
-      * @param epochs number of epochs (default = 100)
-      * @param learning_rate learning rate (default = 0.01)
-      * @param batch_size batch size for gradient descent (default = 32)
+      * Function to train all added configurations concurrently
+      * @param X array of feature vectors (shared by all runs)
+      * @param Y array of target values (shared by all runs)
       * @param shuffle flag for whether to shuffle data (default = true)
+      * @return returns results table (one row per epoch per run)
       */
-     void fit(const std::vector<std::vector<std::valarray<double>>> &X_,
-              const std::vector<std::vector<std::valarray<double>>> &Y_,
-              const int &epochs = 100, const double &learning_rate = 0.01,
-              const size_t &batch_size = 32, const bool &shuffle = true) {
-         std::vector<std::vector<std::valarray<double>>> X = X_, Y = Y_;
-         // Both label and input data should have same size
-         if (X.size() != Y.size()) {
-             std::cerr << "ERROR (" << __func__ << ") : ";
-             std::cerr << "X and Y in fit have different sizes" << std::endl;
-             std::exit(EXIT_FAILURE);
+     std::vector<Result> run(
+         const std::vector<std::vector<std::valarray<double>>> &X,
+         const std::vector<std::vector<std::valarray<double>>> &Y,
+         const bool &shuffle = true) {
+         // Networks are constructed up front so their logs don't interleave
+         if (networks.size() != configs.size()) {
+             this->build_networks();
          }
-         std::cout << "INFO: Training Started" << std::endl;
-         for (int epoch = 1; epoch <= epochs; epoch++) {  // For every epoch
-             // Shuffle X and Y if flag is set
-             if (shuffle) {
-                 equal_shuffle(X, Y);
-             }
-             auto start =
-                 std::chrono::high_resolution_clock::now();  // Start clock
-             double loss = 0,
-                    acc = 0;  // Initialize performance metrics with zero
-             // For each starting index of batch
-             for (size_t batch_start = 0; batch_start < X.size();
-                  batch_start += batch_size) {
-                 for (size_t i = batch_start;
-                      i < std::min(X.size(), batch_start + batch_size); i++) {
-                     std::vector<std::valarray<double>> grad, cur_error,
-                         predicted;
-                     auto activations = this->__detailed_single_prediction(X[i]);
-                     // Gradients vector to store gradients for all layers
-                     // They will be averaged and applied to kernel
-                     std::vector<std::vector<std::valarray<double>>> gradients;
-                     gradients.resize(this->layers.size());
-                     // First initialize gradients to zero
-                     for (size_t i = 0; i < gradients.size(); i++) {
-                         zeroes_initialization(
-                             gradients[i], get_shape(this->layers[i].kernel));
-                     }
-                     predicted = activations.back();  // Predicted vector
-                     cur_error = predicted - Y[i];    // Absoulute error
-                     // Calculating loss with MSE
-                     loss += sum(apply_function(
-                         cur_error, neural_network::util_functions::square));
-                     // If prediction is correct
-                     if (argmax(predicted) == argmax(Y[i])) {
-                         acc += 1;
-                     }
-                     // For every layer (except first) starting from last one
-                     for (size_t j = this->layers.size() - 1; j >= 1; j--) {
-                         // Backpropogating errors
-                         cur_error = hadamard_product(
-                             cur_error,
-                             apply_function(
-                                 activations[j + 1],
-                                 this->layers[j].dactivation_function));
-                         // Calculating gradient for current layer
-                         grad = multiply(transpose(activations[j]), cur_error);
-                         // Change error according to current kernel values
-                         cur_error = multiply(cur_error,
-                                              transpose(this->layers[j].kernel));
-                         // Adding gradient values to collection of gradients
-                         gradients[j] = gradients[j] + grad / double(batch_size);
-                     }
-                     // Applying gradients
-                     for (size_t j = this->layers.size() - 1; j >= 1; j--) {
-                         // Updating kernel (aka weights)
-                         this->layers[j].kernel = this->layers[j].kernel -
-                                                  gradients[j] * learning_rate;
-                     }
-                 }
+         std::cout << "INFO: Sweep Started (" << configs.size() << " runs on "
+                   << ThreadPool::global().size() << " threads)" << std::endl;
+         std::vector<std::vector<EpochMetrics>> histories(configs.size());
+         ThreadPool::global().run(configs.size(), [&](size_t r) {
+             histories[r] = networks[r].fit(
+                 X, Y, configs[r].epochs, configs[r].learning_rate,
+                 configs[r].batch_size, shuffle, false);
+         });
+         std::vector<Result> results;  // Collecting all histories in a table
+         for (size_t r = 0; r < histories.size(); r++) {
+             for (const auto &metrics : histories[r]) {
+                 results.push_back({r, metrics});
              }
-             auto stop =
-                 std::chrono::high_resolution_clock::now();  // Stoping the clock
-             // Calculate time taken by epoch
-             auto duration =
-                 std::chrono::duration_cast<std::chrono::microseconds>(stop -
-                                                                       start);
-             loss /= X.size();        // Averaging loss
-             acc /= X.size();         // Averaging accuracy
-             std::cout.precision(4);  // set output precision to 4
-             // Printing training stats
-             std::cout << "Training: Epoch " << epoch << '/' << epochs;
-             std::cout << ", Loss: " << loss;
-             std::cout << ", Accuracy: " << acc;
-             std::cout << ", Taken time: " << duration.count() / 1e6
-                       << " seconds";
-             std::cout << std::endl;
          }
-         return;
+         return results;
      }
  
      /**
-      * Function to fit model on data stored in csv file
+      * Function to train all added configurations concurrently on data
+      * stored in csv file (file is parsed only once)
       * @param file_name csv file name
       * @param last_label flag for whether label is in first or last column
-      * @param epochs number of epochs
-      * @param learning_rate learning rate
       * @param normalize flag for whether to normalize data
       * @param slip_lines number of lines to skip
-      * @param batch_size batch size for gradient descent (default = 32)
-      * @param shuffle flag for whether to shuffle data (default = true)
+      * @return returns results table (one row per epoch per run)
       */
-     void fit_from_csv(const std::string &file_name, const bool &last_label,
-                       const int &epochs, const double &learning_rate,
-                       const bool &normalize, const int &slip_lines = 1,
-                       const size_t &batch_size = 32,
-                       const bool &shuffle = true) {
-         // Getting training data from csv file
-         auto data =
-             this->get_XY_from_csv(file_name, last_label, normalize, slip_lines);
-         // Fit the model on training data
-         this->fit(data.first, data.second, epochs, learning_rate, batch_size,
-                   shuffle);
-         return;
+     std::vector<Result> run_from_csv(const std::string &file_name,
+                                      const bool &last_label,
+                                      const bool &normalize,
+                                      const int &slip_lines = 1) {
+         if (configs.empty()) {
+             return {};
+         }
+         this->build_networks();
+         // Getting data once (all networks have same output size)
+         auto data = networks[0].get_XY_from_csv(file_name, last_label,
+                                                 normalize, slip_lines);
+         return this->run(data.first, data.second);
+     }
+ 
+     /**
+      * Function to get trained network of a run
+      * @param run index of run
+      * @return reference to trained network
+      */
+     NeuralNetwork &network(const size_t &run) { return networks[run]; }
+ 
+     /**
+      * Function to print results table
+      * @param results results returned by run
+      * @param all_epochs flag for whether to print every epoch or only the
+      * last epoch of every run (default = false)
+      */
+     void print_results(const std::vector<Result> &results,
+                        const bool &all_epochs = false) const {
+         std::cout << std::left << std::setw(5) << "Run" << std::setw(24)
+                   << "Layers" << std::setw(8) << "LR" << std::setw(7)
+                   << "Batch" << std::setw(7) << "Epoch" << std::setw(10)
+                   << "Loss" << std::setw(10) << "Accuracy"
+                   << "Time(s)" << std::endl;
+         for (size_t i = 0; i < results.size(); i++) {
+             const Result &res = results[i];
+             // Last epoch of a run is followed by a different run
+             const bool last =
+                 i + 1 == results.size() || results[i + 1].run != res.run;
+             if (!all_epochs && !last) {
+                 continue;
+             }
+             const Config &config = configs[res.run];
+             std::string shape;
+             for (const auto &l : config.layers) {
+                 shape += (shape.empty() ? "" : "-") + std::to_string(l.first);
+             }
+             shape += " " + config.layers.back().second;
+             std::cout << std::setprecision(4) << std::setw(5) << res.run
+                       << std::setw(24) << shape << std::setw(8)
+                       << config.learning_rate << std::setw(7)
+                       << config.batch_size << std::setw(7)
+                       << res.metrics.epoch << std::setw(10)
+                       << res.metrics.loss << std::setw(10)
+                       << res.metrics.accuracy << res.metrics.seconds
+                       << std::endl;
+         }
+         std::cout << std::right;
+     }
+ 
+  private:
+     uint64_t seed;                        // Seed of the sweep
+     std::vector<Config> configs;          // Configurations of all runs
+     std::vector<NeuralNetwork> networks;  // Networks of all runs
+ 
+     /**
+      * Function to construct (untrained) networks of all runs
+      */
+     void build_networks() {
+         networks.clear();
+         for (size_t r = 0; r < configs.size(); r++) {
+             // Seed of a run depends only on seed of sweep and index of run
+             networks.emplace_back(configs[r].layers, Xoshiro256(seed, r)());
+         }
+     }
+ };
+ 
+ /**
+  * ModelServer class serves predictions of a trained NeuralNetwork over a
+  * Unix domain socket. Requests of all connected clients are collected and
+  * dynamically batched: a batch is run as soon as max_batch requests are
+  * pending or the oldest pending request has waited max_delay_us, so every
+  * batch costs one batched forward pass instead of one pass per request.
+  *
+  * Protocol (one request per line, one response line per request):
+  * <pre>
+  * x1 x2 ... xN      ->  y1 y2 ... yM
+  * stats             ->  counters and latency histogram (ends with "END")
+  * </pre>
+  */
+ class ModelServer {
+  public:
+     /**
+      * Constructor for ModelServer class
+      * @param model trained network to be served
+      * @param socket_path path of Unix domain socket
+      * @param max_batch maximum number of requests in one batch (default = 64)
+      * @param max_delay_us maximum time in microseconds a request waits for
+      * its batch to fill (default = 1000)
+      */
+     ModelServer(const NeuralNetwork &model, const std::string &socket_path,
+                 const size_t &max_batch = 64, const long &max_delay_us = 1000)
+         : model(model),
+           socket_path(socket_path),
+           max_batch(std::max<size_t>(1, max_batch)),
+           max_delay(max_delay_us) {}
+ 
+     /**
+      * Function to request shutdown of all running servers (async signal
+      * safe, can be used as signal handler)
+      */
+     static void stop(int = 0) { stopping() = 1; }
+ 
+     /**
+      * Function to serve requests until stop is called
+      */
+     void serve() {
+         std::signal(SIGPIPE, SIG_IGN);  // Broken clients are handled by write
+         std::signal(SIGINT, ModelServer::stop);
+         std::signal(SIGTERM, ModelServer::stop);
+         const int listen_fd = open_socket();
+         std::cout << "INFO: Serving on " << socket_path
+                   << " (max batch: " << max_batch
+                   << ", max delay: " << max_delay.count() << " us)"
+                   << std::endl;
+         started = Clock::now();
+         while (!stopping()) {
+             // Wait for input, but never beyond deadline of oldest request
+             std::chrono::microseconds timeout(100000);
+             if (!pending.empty()) {
+                 // (rounded up so the wait doesn't end just before it)
+                 const auto left = std::chrono::duration_cast<
+                     std::chrono::microseconds>(
+                     pending.front().arrival + max_delay - Clock::now() +
+                     std::chrono::nanoseconds(999));
+                 timeout = std::max(std::chrono::microseconds(0), left);
+             }
+             std::vector<pollfd> fds(1, pollfd{listen_fd, POLLIN, 0});
+             std::vector<uint64_t> ids;  // Connection id of every fds[i > 0]
+             for (const auto &c : connections) {
+                 // Client which doesn't read its replies is not read either
+                 const size_t queued = c.second.output.size();
+                 fds.push_back(pollfd{
+                     c.second.fd,
+                     short((queued < max_output ? POLLIN : 0) |
+                           (queued > 0 ? POLLOUT : 0)),
+                     0});
+                 ids.push_back(c.first);
+             }
+             if (wait_events(fds, timeout) < 0 && errno != EINTR) {
+                 break;
+             }
+             if (fds[0].revents & POLLIN) {
+                 accept_connection(listen_fd);
+             }
+             for (size_t i = 1; i < fds.size(); i++) {
+                 if ((fds[i].revents & POLLOUT) && !flush(ids[i - 1])) {
+                     continue;  // Client was dropped
+                 }
+                 if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                     read_requests(ids[i - 1]);
+                 }
+             }
+             // Run batches while full or oldest request reached its deadline
+             while (!pending.empty() &&
+                    (pending.size() >= max_batch ||
+                     Clock::now() - pending.front().arrival >= max_delay)) {
+                 run_batch();
+             }
+         }
+         while (!pending.empty()) {  // Answer whatever is still queued
+             run_batch();
+         }
+         for (const auto &c : connections) {  // Replies which fit the socket
+             flush(c.first);                   // buffer are still delivered
+         }
+         for (const auto &c : connections) {
+             close(c.second.fd);
+         }
+         connections.clear();
+         close(listen_fd);
+         unlink(socket_path.c_str());
+         std::cout << stats();
      }
  
      /**
-      * Function to evaluate model on supplied data
-      * @param X array of feature vectors (input data)
-      * @param Y array of target values (label)
+      * Function to get throughput counters and latency histogram
+      * @return returns stats as printable text
       */
-     void evaluate(const std::vector<std::vector<std::valarray<double>>> &X,
-                   const std::vector<std::vector<std::valarray<double>>> &Y) {
-         std::cout << "INFO: Evaluation Started" << std::endl;
-         double acc = 0, loss = 0;  // initialize performance metrics with zero
-         for (size_t i = 0; i < X.size(); i++) {  // For every sample in input
-             // Get predictions
-             std::vector<std::valarray<double>> pred =
-                 this->single_predict(X[i]);
-             // If predicted class is correct
-             if (argmax(pred) == argmax(Y[i])) {
-                 acc += 1;  // Increment accuracy
-             }
-             // Calculating loss - Mean Squared Error
-             loss += sum(apply_function((Y[i] - pred),
-                                        neural_network::util_functions::square) *
-                         0.5);
-         }
-         acc /= X.size();   // Averaging accuracy
-         loss /= X.size();  // Averaging loss
-         // Prinitng performance of the model
-         std::cout << "Evaluation: Loss: " << loss;
-         std::cout << ", Accuracy: " << acc << std::endl;
-         return;
+     std::string stats() const {
+         std::ostringstream out;
+         const double seconds =
+             std::chrono::duration<double>(Clock::now() - started).count();
+         out.precision(4);
+         out << "requests " << total_requests << '\n';
+         out << "batches " << total_batches << '\n';
+         out << "avg_batch_size "
+             << (total_batches ? double(total_requests) / total_batches : 0.0)
+             << '\n';
+         out << "requests_per_second "
+             << (seconds > 0 ? total_requests / seconds : 0.0) << '\n';
+         // Bucket i counts latencies in [2^(i-1), 2^i) microseconds
+         out << "latency_us_histogram";
+         for (size_t i = 0; i < latency_histogram.size(); i++) {
+             if (latency_histogram[i] != 0) {
+                 out << ' ' << '<' << (1ul << i) << ':' << latency_histogram[i];
+             }
+         }
+         out << '\n';
+         return out.str();
      }
  
+  private:
+     typedef std::chrono::steady_clock Clock;
      /**
-      * Function to evaluate model on data stored in csv file
-      * @param file_name csv file name
-      * @param last_label flag for whether label is in first or last column
-      * @param normalize flag for whether to normalize data
-      * @param slip_lines number of lines to skip
+      * Connected client (non-blocking socket) with bytes received but not
+      * yet parsed and reply bytes not yet written
       */
-     void evaluate_from_csv(const std::string &file_name, const bool &last_label,
-                            const bool &normalize, const int &slip_lines = 1) {
-         // Getting training data from csv file
-         auto data =
-             this->get_XY_from_csv(file_name, last_label, normalize, slip_lines);
-         // Evaluating model
-         this->evaluate(data.first, data.second);
-         return;
+     struct Connection {
+         int fd;
+         std::string input;
+         std::string output;
+     };
+     /**
+      * Single prediction request waiting for its batch
+      */
+     struct Request {
+         uint64_t connection;           // Id of connection to reply to
+         std::valarray<double> x;       // Feature vector
+         Clock::time_point arrival;     // When request was read
+     };
+ 
+     NeuralNetwork model;                         // Served network
+     std::string socket_path;                     // Path of socket
+     size_t max_batch;                            // Batch size limit
+     std::chrono::microseconds max_delay;         // Batch delay limit
+     std::map<uint64_t, Connection> connections;  // Open connections by id
+     uint64_t next_connection = 0;                // Id of next connection
+     std::deque<Request> pending;                 // Requests waiting for batch
+     Clock::time_point started;                   // When serving started
+     size_t total_requests = 0, total_batches = 0;
+     std::vector<size_t> latency_histogram = std::vector<size_t>(32, 0);
+     // Unsent reply bytes of a client above which its requests aren't read
+     static const size_t max_output = 1 << 20;
+     // Bytes per number allowed in a request line (longer line is an error)
+     static const size_t max_number_bytes = 4 * 32;
+ 
+     /**
+      * Function to get flag set by stop
+      * @return reference to the flag
+      */
+     static volatile std::sig_atomic_t &stopping() {
+         static volatile std::sig_atomic_t flag = 0;
+         return flag;
      }
  
      /**
-      * Function to save current model.
-      * @param file_name file name to save model (*.model)
+      * Function to create, bind and listen on the Unix domain socket
+      * @return returns listening file descriptor
       */
-     void save_model(const std::string &_file_name) {
-         std::string file_name = _file_name;
-         // Adding ".model" extension if it is not already there in name
-         if (file_name.find(".model") == file_name.npos) {
-             file_name += ".model";
+     int open_socket() {
+         sockaddr_un addr;
+         std::memset(&addr, 0, sizeof(addr));
+         addr.sun_family = AF_UNIX;
+         if (socket_path.size() >= sizeof(addr.sun_path)) {
+             std::cerr << "ERROR (" << __func__ << ") : ";
+             std::cerr << "Socket path too long: " << socket_path << std::endl;
+             std::exit(EXIT_FAILURE);
          }
-         std::ofstream out_file;  // Ofstream to write in file
-         // Open file in out|trunc mode
-         out_file.open(file_name.c_str(),
-                       std::ofstream::out | std::ofstream::trunc);
-         // If there is any problem in opening file
-         if (!out_file.is_open()) {
+         std::strcpy(addr.sun_path, socket_path.c_str());
+         unlink(socket_path.c_str());  // Remove stale socket
+         const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+         if (fd < 0 || bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+             listen(fd, 128) < 0) {
              std::cerr << "ERROR (" << __func__ << ") : ";
-             std::cerr << "Unable to open file: " << file_name << std::endl;
+             std::cerr << "Unable to listen on " << socket_path << ": "
+                       << std::strerror(errno) << std::endl;
              std::exit(EXIT_FAILURE);
          }
-         /**
-             Format in which model is saved:
+         return fd;
+     }
  
-             total_layers
-             neurons(1st neural_network::layers::DenseLayer) activation_name(1st
-            neural_network::layers::DenseLayer) kernel_shape(1st
-            neural_network::layers::DenseLayer) kernel_values
-             .
-             .
-             .
-             neurons(Nth neural_network::layers::DenseLayer) activation_name(Nth
-            neural_network::layers::DenseLayer) kernel_shape(Nth
-            neural_network::layers::DenseLayer) kernel_value
+     /**
+      * Function to accept a new client
+      * @param listen_fd listening file descriptor
+      */
+     void accept_connection(const int &listen_fd) {
+         const int fd = accept(listen_fd, nullptr, nullptr);
+         if (fd >= 0) {
+             // Slow client must never block the loop serving all others
+             fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+             connections[next_connection++] = Connection{fd, "", ""};
+         }
+     }
  
-             For Example, pretrained model with 3 layers:
-             <pre>
-             3
-             4 none
-             4 4
-             1 0 0 0
-             0 1 0 0
-             0 0 1 0
-             0 0 0 1
-             6 relu
-             4 6
-             -1.88963 -3.61165 1.30757 -0.443906 -2.41039 -2.69653
-             -0.684753 0.0891452 0.795294 -2.39619 2.73377 0.318202
-             -2.91451 -4.43249 -0.804187 2.51995 -6.97524 -1.07049
-             -0.571531 -1.81689 -1.24485 1.92264 -2.81322 1.01741
-             3 sigmoid
-             6 3
-             0.390267 -0.391703 -0.0989607
-             0.499234 -0.564539 -0.28097
-             0.553386 -0.153974 -1.92493
-             -2.01336 -0.0219682 1.44145
-             1.72853 -0.465264 -0.705373
-             -0.908409 -0.740547 0.376416
-             </pre>
-         */
-         // Saving model in the same format
-         out_file << layers.size();
-         out_file << std::endl;
-         for (const auto &layer : this->layers) {
-             out_file << layer.neurons << ' ' << layer.activation << std::endl;
-             const auto shape = get_shape(layer.kernel);
-             out_file << shape.first << ' ' << shape.second << std::endl;
-             for (const auto &row : layer.kernel) {
-                 for (const auto &val : row) {
-                     out_file << val << ' ';
-                 }
-                 out_file << std::endl;
+     /**
+      * Function to queue a line to a client and write as much as the socket
+      * takes (rest is written when poll reports it writable)
+      * @param id connection id
+      * @param line text to be written
+      */
+     void reply(const uint64_t &id, const std::string &line) {
+         auto it = connections.find(id);
+         if (it == connections.end()) {
+             return;  // Client went away while request was queued
+         }
+         it->second.output += line;
+         flush(id);
+     }
+ 
+     /**
+      * Function to write queued reply bytes of a client without blocking
+      * (client is dropped on error)
+      * @param id connection id
+      * @return false if client was dropped
+      */
+     bool flush(const uint64_t &id) {
+         auto it = connections.find(id);
+         if (it == connections.end()) {
+             return false;
+         }
+         Connection &c = it->second;
+         size_t done = 0;
+         while (done < c.output.size()) {
+             const ssize_t n =
+                 write(c.fd, c.output.data() + done, c.output.size() - done);
+             if (n < 0 && errno == EINTR) {
+                 continue;
+             }
+             if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                 break;  // Socket buffer is full
              }
+             if (n <= 0) {
+                 close(c.fd);
+                 connections.erase(it);
+                 return false;
+             }
+             done += n;
          }
-         std::cout << "INFO: Model saved successfully with name : ";
-         std::cout << file_name << std::endl;
-         out_file.close();  // Closing file
-         return;
+         c.output.erase(0, done);
+         return true;
      }
  
      /**
-      * Function to load earlier saved model.
-      * @param file_name file from which model will be loaded (*.model)
-      * @return instance of NeuralNetwork class with pretrained weights
+      * Function to wait for events of descriptors with microsecond
+      * resolution (poll takes milliseconds, which would stretch a delay
+      * below 1 ms to a whole millisecond)
+      * @param fds descriptors to be polled
+      * @param timeout longest wait
+      * @return returns result of poll (number of ready descriptors or -1)
       */
-     NeuralNetwork load_model(const std::string &file_name) {
-         std::ifstream in_file;            // Ifstream to read file
-         in_file.open(file_name.c_str());  // Openinig file
-         // If there is any problem in opening file
-         if (!in_file.is_open()) {
-             std::cerr << "ERROR (" << __func__ << ") : ";
-             std::cerr << "Unable to open file: " << file_name << std::endl;
-             std::exit(EXIT_FAILURE);
+     static int wait_events(std::vector<pollfd> &fds,
+                            const std::chrono::microseconds &timeout) {
+ #ifdef __linux__
+         const timespec wait{time_t(timeout.count() / 1000000),
+                             long(timeout.count() % 1000000 * 1000)};
+         return ppoll(fds.data(), fds.size(), &wait, nullptr);
+ #else
+         // Whole milliseconds are waited by poll, the rest by polling
+         // without timeout until the deadline
+         const auto deadline = Clock::now() + timeout;
+         int ready = poll(fds.data(), fds.size(), int(timeout.count() / 1000));
+         while (ready == 0 && Clock::now() < deadline) {
+             std::this_thread::yield();
+             ready = poll(fds.data(), fds.size(), 0);
          }
-         std::vector<std::pair<int, std::string>> config;  // To store config
-         std::vector<std::vector<std::valarray<double>>>
-             kernels;  // To store pretrained kernels
-         // Loading model from saved file format
-         size_t total_layers = 0;
-         in_file >> total_layers;
-         for (size_t i = 0; i < total_layers; i++) {
-             int neurons = 0;
-             std::string activation;
-             size_t shape_a = 0, shape_b = 0;
-             std::vector<std::valarray<double>> kernel;
-             in_file >> neurons >> activation >> shape_a >> shape_b;
-             for (size_t r = 0; r < shape_a; r++) {
-                 std::valarray<double> row(shape_b);
-                 for (size_t c = 0; c < shape_b; c++) {
-                     in_file >> row[c];
-                 }
-                 kernel.push_back(row);
+         return ready;
+ #endif
+     }
+ 
+     /**
+      * Function to read available bytes of a client and queue every
+      * complete request line. Client sending a line longer than any valid
+      * request (max_number_bytes per input) gets an error and is dropped,
+      * so it can't grow its input without limit.
+      * @param id connection id
+      */
+     void read_requests(const uint64_t &id) {
+         Connection &c = connections[id];
+         char chunk[4096];
+         const ssize_t n = read(c.fd, chunk, sizeof(chunk));
+         if (n < 0 && (errno == EINTR || errno == EAGAIN ||
+                       errno == EWOULDBLOCK)) {
+             return;  // Nothing to read yet
+         }
+         if (n <= 0) {  // Client closed connection
+             close(c.fd);
+             connections.erase(id);
+             return;
+         }
+         c.input.append(chunk, n);
+         // Splitting complete lines off (replies may drop the connection)
+         std::vector<std::string> lines;
+         size_t start = 0, end;
+         while ((end = c.input.find('\n', start)) != std::string::npos) {
+             lines.push_back(c.input.substr(start, end - start));
+             start = end + 1;
+         }
+         c.input.erase(0, start);
+         const size_t max_line = max_number_bytes * model.input_size();
+         if (c.input.size() > max_line) {
+             c.output += "ERROR line longer than " + std::to_string(max_line) +
+                         " bytes\n";
+             if (flush(id)) {
+                 close(c.fd);
+                 connections.erase(id);
              }
-             config.emplace_back(make_pair(neurons, activation));
-             ;
-             kernels.emplace_back(kernel);
+             return;
+         }
+         for (const auto &line : lines) {
+             if (line == "stats") {
+                 reply(id, stats() + "END\n");
+                 continue;
+             }
+             std::istringstream ss(line);
+             std::vector<double> values;
+             double v = 0;
+             while (ss >> v) {
+                 values.push_back(v);
+             }
+             if (!ss.eof() || values.size() != model.input_size()) {
+                 reply(id, "ERROR expected " +
+                               std::to_string(model.input_size()) +
+                               " numbers\n");
+                 continue;
+             }
+             pending.push_back(
+                 Request{id,
+                         std::valarray<double>(values.data(), values.size()),
+                         Clock::now()});
          }
-         std::cout << "INFO: Model loaded successfully" << std::endl;
-         in_file.close();  // Closing file
-         return NeuralNetwork(
-             config, kernels);  // Return instance of NeuralNetwork class
      }
  
      /**
-      * Function to print summary of the network.
+      * Function to run one batched forward pass over (at most max_batch)
+      * oldest pending requests and reply to all of them
       */
-     void summary() {
-         // Printing Summary
-         std::cout
-             << "==============================================================="
-             << std::endl;
-         std::cout << "\t\t+ MODEL SUMMARY +\t\t\n";
-         std::cout
-             << "==============================================================="
-             << std::endl;
-         for (size_t i = 1; i <= layers.size(); i++) {  // For every layer
-             std::cout << i << ")";
-             std::cout << " Neurons : "
-                       << layers[i - 1].neurons;  // number of neurons
-             std::cout << ", Activation : "
-                       << layers[i - 1].activation;  // activation
-             std::cout << ", kernel Shape : "
-                       << get_shape(layers[i - 1].kernel);  // kernel shape
-             std::cout << std::endl;
+     void run_batch() {
+         const size_t n = std::min(max_batch, pending.size());
+         std::vector<std::vector<std::valarray<double>>> X(n);
+         for (size_t i = 0; i < n; i++) {
+             X[i] = {std::move(pending[i].x)};
          }
-         std::cout
-             << "==============================================================="
-             << std::endl;
-         return;
+         const auto Y = model.batch_predict(X);
+         for (size_t i = 0; i < n; i++) {
+             std::ostringstream out;
+             out.precision(6);
+             for (size_t k = 0; k < Y[i][0].size(); k++) {
+                 out << (k ? " " : "") << Y[i][0][k];
+             }
+             out << '\n';
+             reply(pending[i].connection, out.str());
+             // Recording latency (from read to reply) in log2 buckets
+             const auto us = std::chrono::duration_cast<
+                                 std::chrono::microseconds>(
+                                 Clock::now() - pending[i].arrival)
+                                 .count();
+             size_t bucket = 0;
+             while (bucket + 1 < latency_histogram.size() &&
+                    (1l << bucket) <= us) {
+                 bucket++;
+             }
+             latency_histogram[bucket]++;
+         }
+         pending.erase(pending.begin(), pending.begin() + n);
+         total_requests += n;
+         total_batches++;
      }
  };
+ 
+ /**
+  * Function to generate load on a ModelServer from concurrent clients and
+  * print client side latency and throughput followed by server stats.
+  * @param socket_path path of Unix domain socket of the server
+  * @param clients number of concurrent connections
+  * @param requests number of requests sent by every connection
+  * @param x feature vector sent with every request
+  */
+ void run_load_generator(const std::string &socket_path, const size_t &clients,
+                         const size_t &requests,
+                         const std::vector<double> &x) {
+     sockaddr_un addr;
+     std::memset(&addr, 0, sizeof(addr));
+     addr.sun_family = AF_UNIX;
+     std::strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+     // Opening a connection to the server
+     auto connect_client = [&addr]() {
+         const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+         if (fd < 0 || connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0) {
+             std::cerr << "ERROR (run_load_generator) : ";
+             std::cerr << "Unable to connect: " << std::strerror(errno)
+                       << std::endl;
+             std::exit(EXIT_FAILURE);
+         }
+         return fd;
+     };
+     // Sending a request and reading response up to terminator
+     auto round_trip = [](const int &fd, const std::string &line,
+                          const std::string &terminator) {
+         std::string response;
+         if (write(fd, line.data(), line.size()) != (ssize_t)line.size()) {
+             return response;
+         }
+         char chunk[4096];
+         while (response.size() < terminator.size() ||
+                response.compare(response.size() - terminator.size(),
+                                 terminator.size(), terminator) != 0) {
+             const ssize_t n = read(fd, chunk, sizeof(chunk));
+             if (n <= 0) {
+                 break;
+             }
+             response.append(chunk, n);
+         }
+         return response;
+     };
+     std::ostringstream request;
+     for (size_t k = 0; k < x.size(); k++) {
+         request << (k ? " " : "") << x[k];
+     }
+     request << '\n';
+     std::vector<std::vector<double>> latencies(clients);
+     std::vector<std::thread> threads;
+     const auto start = std::chrono::steady_clock::now();
+     for (size_t c = 0; c < clients; c++) {
+         threads.emplace_back([&, c]() {
+             const int fd = connect_client();
+             for (size_t r = 0; r < requests; r++) {
+                 const auto sent = std::chrono::steady_clock::now();
+                 round_trip(fd, request.str(), "\n");
+                 latencies[c].push_back(
+                     std::chrono::duration<double, std::micro>(
+                         std::chrono::steady_clock::now() - sent)
+                         .count());
+             }
+             close(fd);
+         });
+     }
+     for (auto &t : threads) {
+         t.join();
+     }
+     const double seconds = std::chrono::duration<double>(
+                                std::chrono::steady_clock::now() - start)
+                                .count();
+     std::vector<double> all;  // Latencies of all clients
+     for (const auto &l : latencies) {
+         all.insert(all.end(), l.begin(), l.end());
+     }
+     std::sort(all.begin(), all.end());
+     std::cout.precision(4);
+     std::cout << "Load: " << clients << " clients x " << requests
+               << " requests, Throughput: " << all.size() / seconds
+               << " requests/second" << std::endl;
+     if (!all.empty()) {
+         std::cout << "Latency (us): p50 " << all[all.size() / 2] << ", p99 "
+                   << all[all.size() * 99 / 100] << ", max " << all.back()
+                   << std::endl;
+     }
+     const int fd = connect_client();
+     std::cout << "Server stats:" << std::endl
+               << round_trip(fd, "stats\n", "END\n");
+     close(fd);
+ }
  }  // namespace neural_network
  }  // namespace machine_learning
  
+ /**
+  * Function to get random 2D vector, a fraction of elements is set to zero
+  * (used to test kernels on random shapes)
+  * @param rng random number generator
+  * @param shape shape of vector
+  * @param zeros fraction of elements which are zero
+  * @returns new random vector
+  */
+ static std::vector<std::valarray<double>> random_matrix(
+     machine_learning::Xoshiro256 &rng, const std::pair<size_t, size_t> &shape,
+     const double &zeros = 0) {
+     std::vector<std::valarray<double>> A(shape.first,
+                                          std::valarray<double>(shape.second));
+     for (auto &row : A) {
+         for (auto &x : row) {
+             x = rng.uniform(0, 1) < zeros ? 0 : rng.uniform(-2, 2);
+         }
+     }
+     return A;
+ }
+ 
+ /**
+  * Function to test derivatives of activations against central finite
+  * differences (derivatives take activated values)
+  * @returns none
+  */
+ static void test_activation_derivatives() {
+     namespace act = machine_learning::neural_network::activations;
+     const std::vector<std::pair<double (*)(const double &),
+                                 double (*)(const double &)>>
+         functions = {{act::sigmoid, act::dsigmoid},
+                      {act::relu, act::drelu},
+                      {act::tanh, act::dtanh}};
+     const double h = 1e-6;
+     for (const auto &f : functions) {
+         for (double x = -4.05; x < 4; x += 0.1) {  // Skips kink of relu
+             const double numeric = (f.first(x + h) - f.first(x - h)) / (2 * h);
+             assert(std::abs(f.second(f.first(x)) - numeric) < 1e-6);
+         }
+     }
+     std::cout << "Activation derivatives: passed" << std::endl;
+ }
+ 
+ /**
+  * Function to test kernels of vector_ops.hpp and batched inference against
+  * naive reference kernels on random shapes
+  * @returns none
+  */
+ static void test_kernels() {
+     machine_learning::Xoshiro256 rng(42);
+     for (int trial = 0; trial < 50; trial++) {
+         const size_t n = 1 + rng.below(40), k = 1 + rng.below(40),
+                      m = 1 + rng.below(40);
+         const auto A = random_matrix(rng, {n, k}, trial % 2 ? 0.8 : 0.0);
+         const auto B = random_matrix(rng, {k, m});
+         const auto C = machine_learning::reference::multiply(A, B);
+         assert(machine_learning::compare(machine_learning::multiply(A, B), C)
+                    .within(4));
+         assert(machine_learning::compare(machine_learning::transpose(A),
+                                          machine_learning::reference::transpose(
+                                              A))
+                    .within(0));
+         // Sparse kernel on CSR copy of A
+         std::vector<std::vector<std::valarray<double>>> rows;
+         for (const auto &row : A) {
+             rows.push_back({row});
+         }
+         assert(machine_learning::compare(
+                    machine_learning::multiply(machine_learning::to_csr(rows),
+                                               0, n, B),
+                    C)
+                    .within(4));
+     }
+     // Convolution (im2col and direct) against naive loops
+     for (int trial = 0; trial < 20; trial++) {
+         const size_t c = 1 + rng.below(3), size = 1 + rng.below(4),
+                      stride = 1 + rng.below(2), f = 1 + rng.below(5);
+         const machine_learning::neural_network::layers::Grid grid(
+             c, size + rng.below(8), size + rng.below(8), size, stride);
+         const machine_learning::neural_network::layers::DenseLayer conv(
+             machine_learning::neural_network::layers::LayerType::conv2d, f,
+             "none", grid, rng.split(trial));
+         const auto X =
+             random_matrix(rng, {3, c * grid.height * grid.width});
+         const size_t cells = grid.cells();
+         std::vector<std::valarray<double>> expected(
+             X.size(), std::valarray<double>(0.0, f * cells));
+         for (size_t r = 0; r < X.size(); r++) {
+             for (size_t o = 0; o < f; o++) {
+                 for (size_t p = 0; p < cells; p++) {
+                     const size_t y = p / grid.out_width() * stride,
+                                  x = p % grid.out_width() * stride;
+                     for (size_t ch = 0; ch < c; ch++) {
+                         for (size_t i = 0; i < size; i++) {
+                             for (size_t j = 0; j < size; j++) {
+                                 expected[r][o * cells + p] +=
+                                     X[r][(ch * grid.height + y + i) *
+                                              grid.width +
+                                          x + j] *
+                                     conv.kernel[(ch * size + i) * size + j][o];
+                             }
+                         }
+                     }
+                 }
+             }
+         }
+         assert(machine_learning::compare(conv.convolve(X), expected)
+                    .within(4));
+         assert(machine_learning::compare(conv.convolve_direct(X), expected)
+                    .within(4));
+     }
+     // Pruned (block sparse) kernels against dense product of pruned kernel
+     for (int trial = 0; trial < 20; trial++) {
+         const size_t n = 1 + rng.below(20), k = 1 + rng.below(40),
+                      m = 1 + rng.below(40), block = 1 + rng.below(5);
+         machine_learning::neural_network::layers::DenseLayer dense(
+             m, "none", {k, m}, true, rng.split(trial));
+         const auto W = dense.kernel;
+         dense.prune(0.1 * (trial % 10), block);
+         assert(dense.kernel.empty());  // Only block sparse copy is kept
+         auto pruned = dense.sparse_kernel.dense();
+         for (size_t r = 0; r < k; r++) {
+             for (size_t c = 0; c < m; c++) {
+                 assert(pruned[r][c] == 0 || pruned[r][c] == W[r][c]);
+             }
+         }
+         const auto A = random_matrix(rng, {n, k});
+         assert(machine_learning::compare(
+                    dense.forward(A),
+                    machine_learning::reference::multiply(A, pruned))
+                    .within(4));
+         // Training updates kept weights and leaves pruned ones at zero
+         const auto E = random_matrix(rng, {n, m});
+         const auto input_error = dense.backward(A, E, 0.1, true);
+         assert(machine_learning::compare(
+                    input_error,
+                    machine_learning::reference::multiply(
+                        E, machine_learning::reference::transpose(pruned)))
+                    .within(4));
+         const auto grad = machine_learning::reference::multiply(
+             machine_learning::reference::transpose(A), E);
+         const auto trained = dense.sparse_kernel.dense();
+         const auto &b = dense.sparse_kernel;
+         std::vector<std::valarray<bool>> kept(k, std::valarray<bool>(m));
+         for (size_t br = 0; br + 1 < b.offsets.size(); br++) {
+             for (size_t i = b.offsets[br]; i < b.offsets[br + 1]; i++) {
+                 for (size_t r = br * block; r < std::min(k, (br + 1) * block);
+                      r++) {
+                     for (size_t c = b.columns[i] * block;
+                          c < std::min(m, (b.columns[i] + 1) * block); c++) {
+                         kept[r][c] = true;
+                     }
+                 }
+             }
+         }
+         for (size_t r = 0; r < k; r++) {
+             for (size_t c = 0; c < m; c++) {
+                 const double expected =
+                     kept[r][c] ? pruned[r][c] - 0.1 * grad[r][c] : 0.0;
+                 assert(std::abs(trained[r][c] - expected) < 1e-12);
+             }
+         }
+     }
+     // Layer normalization gives rows of zero mean and unit variance, and
+     // dropout keeps about 1 - rate of neurons scaled by 1 / (1 - rate)
+     {
+         namespace layers = machine_learning::neural_network::layers;
+         layers::DenseLayer norm(layers::LayerType::layernorm, 64, "none", 0,
+                                 rng);
+         for (const auto &row : norm.forward(random_matrix(rng, {3, 64}))) {
+             assert(std::abs(row.sum() / 64) < 1e-12);
+             assert(std::abs((row * row).sum() / 64 - 1) < 1e-3);
+         }
+         layers::DenseLayer dropout(layers::LayerType::dropout, 4096, "none",
+                                    0.25, rng);
+         std::vector<std::valarray<double>> ones(
+             2, std::valarray<double>(1.0, 4096));
+         // Second pass writes into storage of first (with a new mask)
+         std::vector<std::valarray<double>> dropped;
+         dropout.drop(ones, dropped);
+         const double *storage = &dropped[1][0];
+         const std::valarray<double> first = dropped[1];
+         dropout.drop(ones, dropped);
+         assert(&dropped[1][0] == storage);
+         assert((dropped[1] != first).max());
+         size_t kept = 0;
+         for (const auto &row : dropped) {
+             for (const auto &v : row) {
+                 assert(v == 0 || std::abs(v - 4.0 / 3) < 1e-12);
+                 kept += v != 0;
+             }
+         }
+         assert(std::abs(kept / 8192.0 - 0.75) < 0.02);
+     }
+     // Batched (and multithreaded) inference against one sample at a time
+     machine_learning::neural_network::NeuralNetwork net(
+         {{8, "none"}, {16, "relu"}, {12, "tanh"}, {5, "softmax"}}, 42);
+     std::vector<std::vector<std::valarray<double>>> X;
+     for (int i = 0; i < 300; i++) {
+         X.push_back(random_matrix(rng, {1, 8}));
+     }
+     const auto batch = net.batch_predict(X);
+     for (size_t i = 0; i < X.size(); i++) {
+         assert(machine_learning::compare(batch[i], net.single_predict(X[i]))
+                    .within(4));
+     }
+     // Pipelined inference gives exactly the same rows
+     for (const size_t stages : {1, 2, 3}) {
+         const auto piped = net.pipeline_predict(X, stages, 7);
+         for (size_t i = 0; i < X.size(); i++) {
+             assert(machine_learning::compare(piped[i], batch[i]).within(0));
+         }
+     }
+     std::cout << "Kernels against reference: passed" << std::endl;
+ }
+ 
+ /**
+  * Function to test backpropagation of every activation against finite
+  * differences of the loss
+  * @returns none
+  */
+ static void test_gradients() {
+     machine_learning::Xoshiro256 rng(42);
+     for (const std::string hidden : {"sigmoid", "relu", "tanh"}) {
+         for (const std::string output : {"sigmoid", "tanh", "softmax"}) {
+             machine_learning::neural_network::NeuralNetwork net(
+                 {{5, "none"}, {7, hidden}, {6, hidden}, {3, output}}, 42);
+             for (int sample = 0; sample < 5; sample++) {
+                 std::vector<std::valarray<double>> Y = {{0, 0, 0}};
+                 Y[0][rng.below(3)] = 1;
+                 const double error =
+                     net.gradient_check(random_matrix(rng, {1, 5}), Y);
+                 if (error > 1e-5) {
+                     std::cerr << "Gradient check failed for " << hidden
+                               << "/" << output << ": " << error << std::endl;
+                 }
+                 assert(error <= 1e-5);
+             }
+         }
+     }
+     // Convolution and max pooling (window sizes take both kernels)
+     namespace layers = machine_learning::neural_network::layers;
+     for (const size_t size : {2, 3}) {
+         machine_learning::neural_network::NeuralNetwork net(
+             {layers::LayerConfig::input(2, 7, 7),
+              layers::LayerConfig::conv2d(3, size, "tanh"),
+              layers::LayerConfig::maxpool(2),
+              layers::LayerConfig::dense(3, "softmax")},
+             42);
+         for (int sample = 0; sample < 5; sample++) {
+             std::vector<std::valarray<double>> Y = {{0, 0, 0}};
+             Y[0][rng.below(3)] = 1;
+             const double error =
+                 net.gradient_check(random_matrix(rng, {1, 2 * 7 * 7}), Y);
+             if (error > 1e-5) {
+                 std::cerr << "Gradient check failed for conv2d " << size
+                           << ": " << error << std::endl;
+             }
+             assert(error <= 1e-5);
+         }
+     }
+     // Layer normalization and dropout (masks are the same in every pass)
+     for (const std::string act : {"relu", "tanh"}) {
+         machine_learning::neural_network::NeuralNetwork net(
+             {layers::LayerConfig::input(5),
+              layers::LayerConfig::dense(8, "none"),
+              layers::LayerConfig::layernorm(act),
+              layers::LayerConfig::dropout(0.3),
+              layers::LayerConfig::dense(6, act),
+              layers::LayerConfig::dropout(0.5),
+              layers::LayerConfig::dense(3, "softmax")},
+             42);
+         for (int sample = 0; sample < 5; sample++) {
+             std::vector<std::valarray<double>> Y = {{0, 0, 0}};
+             Y[0][rng.below(3)] = 1;
+             const double error =
+                 net.gradient_check(random_matrix(rng, {1, 5}), Y);
+             if (error > 1e-5) {
+                 std::cerr << "Gradient check failed for layernorm " << act
+                           << ": " << error << std::endl;
+             }
+             assert(error <= 1e-5);
+         }
+     }
+     // Pruned layers (only stored blocks are trained)
+     {
+         machine_learning::neural_network::NeuralNetwork net(
+             {{5, "none"}, {8, "tanh"}, {3, "softmax"}}, 42);
+         net.prune(0.5, 2);
+         for (int sample = 0; sample < 5; sample++) {
+             std::vector<std::valarray<double>> Y = {{0, 0, 0}};
+             Y[0][rng.below(3)] = 1;
+             const double error =
+                 net.gradient_check(random_matrix(rng, {1, 5}), Y);
+             if (error > 1e-5) {
+                 std::cerr << "Gradient check failed for pruned network: "
+                           << error << std::endl;
+             }
+             assert(error <= 1e-5);
+         }
+     }
+     std::cout << "Gradient check: passed" << std::endl;
+ }
+ 
  /**
   * Function to test neural network
   * @returns none
   */
  static void test() {
+     // Checking kernels and gradients before training anything
+     test_activation_derivatives();
+     test_kernels();
+     test_gradients();
      // Creating network with 3 layers for "iris.csv"
      machine_learning::neural_network::NeuralNetwork myNN =
          machine_learning::neural_network::NeuralNetwork({
@@ -811,11 +4132,23 @@
               "relu"},  // Second layer with 6 neurons and "relu" as activation
              {3, "sigmoid"}  // Third layer with 3 neurons and "sigmoid" as
                              // activation
-         });
+         },
+         42);  // Fixed seed so the test is reproducible
      // Printing summary of model
      myNN.summary();
      // Training Model
      myNN.fit_from_csv("iris.csv", true, 100, 0.3, false, 2, 32, true);
+     // Evaluating model (batched) on the same data
+     myNN.evaluate_from_csv("iris.csv", true, false, 2);
+     // Training a few configurations concurrently on the same data
+     machine_learning::neural_network::Sweep sweep(42);
+     for (const double lr : {0.1, 0.3}) {
+         sweep.add({{{4, "none"}, {6, "relu"}, {3, "sigmoid"}}, 20, lr, 32});
+         sweep.add({{{4, "none"}, {8, "tanh"}, {3, "softmax"}}, 20, lr, 32});
+     }
+     auto results = sweep.run_from_csv("iris.csv", true, false, 2);
+     assert(results.size() == 4 * 20);
+     sweep.print_results(results);
      // Testing predictions of model
      assert(machine_learning::argmax(
                 myNN.single_predict({{5, 3.4, 1.6, 0.4}})) == 0);
@@ -823,14 +4156,126 @@
                 myNN.single_predict({{6.4, 2.9, 4.3, 1.3}})) == 1);
      assert(machine_learning::argmax(
                 myNN.single_predict({{6.2, 3.4, 5.4, 2.3}})) == 2);
+     // Training resumed from a checkpoint taken mid-epoch ends with exactly
+     // the same weights as uninterrupted training (dropout masks included)
+     namespace layers = machine_learning::neural_network::layers;
+     const std::vector<layers::LayerConfig> config = {
+         layers::LayerConfig::input(4), layers::LayerConfig::dense(8, "relu"),
+         layers::LayerConfig::dropout(0.25),
+         layers::LayerConfig::dense(3, "softmax")};
+     auto data = myNN.get_XY_from_csv("iris.csv", true, false, 2);
+     machine_learning::neural_network::NeuralNetwork interrupted(config, 42);
+     interrupted.checkpoint("checkpoint_test.ckpt", 130);
+     interrupted.fit(data.first, data.second, 2, 0.3, 32, true, false);
+     machine_learning::neural_network::NeuralNetwork resumed(config, 7);
+     resumed.resume("checkpoint_test.ckpt");  // Epoch 2, sample 110
+     std::remove("checkpoint_test.ckpt");
+     const auto resumed_history =
+         resumed.fit(data.first, data.second, 3, 0.3, 32, true, false);
+     machine_learning::neural_network::NeuralNetwork straight(config, 42);
+     const auto straight_history =
+         straight.fit(data.first, data.second, 3, 0.3, 32, true, false);
+     assert(resumed_history.size() == 3);
+     assert(resumed_history.back().loss == straight_history.back().loss);
+     for (const auto &x : data.first) {
+         assert(machine_learning::compare(resumed.single_predict(x),
+                                          straight.single_predict(x))
+                    .within(0));
+     }
+     // Pruned weights stay zero when training goes on (dense and sparse
+     // input)
+     auto pruned = myNN;
+     const double zeros = pruned.prune(0.5, 2);
+     pruned.fit(data.first, data.second, 1, 0.3, 32, true, false);
+     pruned.fit(machine_learning::to_csr(data.first), data.second, 1, 0.3, 32,
+                true, false);
+     assert(zeros > 0 && pruned.prune(0, 2) >= zeros);
+     // Loaded model trains reproducibly once reseeded (shuffling and dropout
+     // masks both come from the seed)
+     machine_learning::neural_network::NeuralNetwork(config, 42).save_model(
+         "seed_test.model");
+     auto first = machine_learning::neural_network::NeuralNetwork().load_model(
+         "seed_test.model");
+     auto second = machine_learning::neural_network::NeuralNetwork()
+                       .load_model("seed_test.model");
+     std::remove("seed_test.model");
+     first.seed(5);
+     second.seed(5);
+     first.fit(data.first, data.second, 1, 0.3, 32, true, false);
+     second.fit(data.first, data.second, 1, 0.3, 32, true, false);
+     for (const auto &x : data.first) {
+         assert(machine_learning::compare(first.single_predict(x),
+                                          second.single_predict(x))
+                    .within(0));
+     }
+     // Fixed-shape network loaded from saved model predicts the same values
+     myNN.save_model("fixed_network_test.model");
+     auto saved = machine_learning::neural_network::NeuralNetwork().load_model(
+         "fixed_network_test.model");
+     const auto fixed = machine_learning::neural_network::FixedNetwork<
+         machine_learning::neural_network::activations::Relu, 4, 6,
+         3>().load_model("fixed_network_test.model");
+     std::remove("fixed_network_test.model");
+     machine_learning::Xoshiro256 rng(42);
+     for (int i = 0; i < 100; i++) {
+         const auto x = random_matrix(rng, {1, 4});
+         const auto y = fixed.predict({{x[0][0], x[0][1], x[0][2], x[0][3]}});
+         assert(machine_learning::compare(
+                    {std::valarray<double>(y.data(), y.size())},
+                    saved.single_predict(x))
+                    .within(4));
+     }
      return;
  }
  
  /**
   * @brief Main function
+  * @details
+  * Without arguments runs the tests. Other modes:
+  * <pre>
+  * serve  model_file socket_path [max_batch] [max_delay_us]
+  * client socket_path clients requests x1 x2 ... xN
+  * </pre>
+  * @param argc number of arguments
+  * @param argv arguments
   * @returns 0 on exit
   */
- int main() {
+ int main(int argc, char *argv[]) {
+     const std::string mode = argc > 1 ? argv[1] : "";
+     if (mode != "client") {  // Reporting where the thread pool will run
+         machine_learning::Topology::system().report(std::cout);
+     }
+     if (mode == "serve" && argc >= 4) {
+         // Serving pretrained model with dynamic batching
+         machine_learning::neural_network::ModelServer server(
+             machine_learning::neural_network::NeuralNetwork().load_model(
+                 argv[2]),
+             argv[3], argc > 4 ? std::stoul(argv[4]) : 64,
+             argc > 5 ? std::stol(argv[5]) : 1000);
+         server.serve();
+         return 0;
+     }
+     if (mode == "client" && argc >= 6) {
+         // Generating load on a running server
+         std::vector<double> x;
+         for (int i = 5; i < argc; i++) {
+             x.push_back(std::stod(argv[i]));
+         }
+         machine_learning::neural_network::run_load_generator(
+             argv[2], std::stoul(argv[3]), std::stoul(argv[4]), x);
+         return 0;
+     }
+     if (!mode.empty()) {
+         std::cerr << "Usage: " << argv[0] << std::endl;
+         std::cerr << "       " << argv[0]
+                   << " serve model_file socket_path [max_batch] "
+                      "[max_delay_us]"
+                   << std::endl;
+         std::cerr << "       " << argv[0]
+                   << " client socket_path clients requests x1 ... xN"
+                   << std::endl;
+         return 1;
+     }
      // Testing
      test();
      return 0;
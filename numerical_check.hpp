@@ -0,0 +1,155 @@
+/**
+ * @file numerical_check.hpp
+ *
+ * @brief Reference kernels and floating point comparison used to check
+ * optimized kernels of [NeuralNetwork (aka Multilayer Perceptron)]
+ * (https://en.wikipedia.org/wiki/Multilayer_perceptron) for numerical
+ * equivalence.
+ *
+ * @details
+ * Kernels in namespace reference are plain textbook loops, kept apart from
+ * vector_ops.hpp so they stay unchanged while kernels there get faster.
+ * Results are compared element by element both in
+ * [ULPs](https://en.wikipedia.org/wiki/Unit_in_the_last_place) and in
+ * absolute error, as reordered sums differ from the reference by a few
+ * roundings while values close to zero differ by many ULPs.
+ */
+ #ifndef NUMERICAL_CHECK_FOR_NN
+ #define NUMERICAL_CHECK_FOR_NN
+ 
+ #include <algorithm>
+ #include <cmath>
+ #include <cstdint>
+ #include <cstring>
+ #include <limits>
+ #include <valarray>
+ #include <vector>
+ 
+ /**
+  * @namespace machine_learning
+  * @brief Machine Learning algorithms
+  */
+ namespace machine_learning {
+ /**
+  * @namespace reference
+  * @brief Naive kernels used as oracle
+  */
+ namespace reference {
+ /**
+  * Function to multiply two 2D vectors with the naive triple loop
+  * @tparam T typename of the vector
+  * @param A First 2D vector of shape (n, k)
+  * @param B Second 2D vector of shape (k, m)
+  * @return new resultant vector of shape (n, m)
+  */
+ template <typename T>
+ std::vector<std::valarray<T>> multiply(const std::vector<std::valarray<T>> &A,
+                                        const std::vector<std::valarray<T>> &B) {
+     std::vector<std::valarray<T>> C(A.size(),
+                                     std::valarray<T>(T(0), B[0].size()));
+     for (size_t i = 0; i < A.size(); i++) {
+         for (size_t j = 0; j < B[0].size(); j++) {
+             for (size_t k = 0; k < B.size(); k++) {
+                 C[i][j] += A[i][k] * B[k][j];
+             }
+         }
+     }
+     return C;
+ }
+ 
+ /**
+  * Function to get transpose of 2D vector element by element
+  * @tparam T typename of the vector
+  * @param A 2D vector of shape (n, m)
+  * @return new resultant vector of shape (m, n)
+  */
+ template <typename T>
+ std::vector<std::valarray<T>> transpose(
+     const std::vector<std::valarray<T>> &A) {
+     std::vector<std::valarray<T>> B(A[0].size(), std::valarray<T>(A.size()));
+     for (size_t i = 0; i < A.size(); i++) {
+         for (size_t j = 0; j < A[0].size(); j++) {
+             B[j][i] = A[i][j];
+         }
+     }
+     return B;
+ }
+ }  // namespace reference
+ 
+ /**
+  * Function to get distance between two doubles in units in the last place
+  * (number of representable doubles between them)
+  * @param a first value
+  * @param b second value
+  * @return returns distance in ULPs (maximum value if either is NaN)
+  */
+ inline uint64_t ulp_distance(const double &a, const double &b) {
+     if (std::isnan(a) || std::isnan(b)) {
+         return std::numeric_limits<uint64_t>::max();
+     }
+     // Mapping bit patterns to integers which are ordered like the doubles
+     auto ordered = [](const double &x) {
+         int64_t bits;
+         std::memcpy(&bits, &x, sizeof(bits));
+         return bits < 0 ? std::numeric_limits<int64_t>::min() - bits : bits;
+     };
+     const int64_t x = ordered(a), y = ordered(b);
+     return x > y ? uint64_t(x) - uint64_t(y) : uint64_t(y) - uint64_t(x);
+ }
+ 
+ /**
+  * Result of element by element comparison of two 2D vectors
+  */
+ struct Comparison {
+     bool same_shape = true;  // Whether shapes of both vectors are equal
+     uint64_t max_ulps = 0;  // Largest distance in ULPs (see compare)
+     double max_abs_error = 0;  // Largest absolute difference
+ 
+     /**
+      * Function to check whether vectors are equivalent
+      * @param ulps allowed distance in ULPs
+      * @return true if shapes are equal and every element is close enough
+      */
+     bool within(const uint64_t &ulps) const {
+         return same_shape && max_ulps <= ulps;
+     }
+ };
+ 
+ /**
+  * Function to compare two 2D vectors element by element. Distance in ULPs
+  * is counted only for elements differing by more than abs_tolerance, so
+  * tiny values near zero don't fail the check.
+  * @tparam T typename of the vector
+  * @param A result of kernel under test
+  * @param B result of reference kernel
+  * @param abs_tolerance absolute difference under which ULPs are ignored
+  * @return returns comparison result
+  */
+ template <typename T>
+ Comparison compare(const std::vector<std::valarray<T>> &A,
+                    const std::vector<std::valarray<T>> &B,
+                    const double &abs_tolerance = 1e-12) {
+     Comparison result;
+     if (A.size() != B.size()) {
+         result.same_shape = false;
+         return result;
+     }
+     for (size_t i = 0; i < A.size(); i++) {
+         if (A[i].size() != B[i].size()) {
+             result.same_shape = false;
+             return result;
+         }
+         for (size_t j = 0; j < A[i].size(); j++) {
+             const double error = std::abs(double(A[i][j]) - double(B[i][j]));
+             if (error > abs_tolerance) {
+                 result.max_ulps =
+                     std::max(result.max_ulps, ulp_distance(A[i][j], B[i][j]));
+             }
+             result.max_abs_error = std::max(result.max_abs_error, error);
+         }
+     }
+     return result;
+ }
+ }  // namespace machine_learning
+ 
+ #endif
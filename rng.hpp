@@ -0,0 +1,189 @@
+/**
+ * @file rng.hpp
+ *
+ * @brief Seedable, splittable pseudo random number generator used by
+ * [NeuralNetwork (aka Multilayer Perceptron)]
+ * (https://en.wikipedia.org/wiki/Multilayer_perceptron) for weight
+ * initialization and shuffling.
+ *
+ * @details
+ * Generator is [xoshiro256**](https://prng.di.unimi.it/) seeded through
+ * splitmix64. A generator can be split into independent streams, where each
+ * stream depends only on (seed, stream index) and not on how many numbers
+ * were drawn before. Work split over threads therefore gets the same numbers
+ * whatever the number of threads is, which keeps runs reproducible.
+ */
+ #ifndef RNG_FOR_NN
+ #define RNG_FOR_NN
+ 
+ #include <chrono>
+ #include <cstdint>
+ #include <iostream>
+ 
+ /**
+  * @namespace machine_learning
+  * @brief Machine Learning algorithms
+  */
+ namespace machine_learning {
+ /**
+  * Xoshiro256 class implements xoshiro256** generator. It satisfies
+  * UniformRandomBitGenerator so it can be used with std::shuffle.
+  */
+ class Xoshiro256 {
+  public:
+     typedef uint64_t result_type;
+ 
+     /**
+      * Constructor for Xoshiro256 class
+      * @param seed seed of the generator
+      * @param stream index of independent stream for the seed
+      */
+     explicit Xoshiro256(const uint64_t &seed = 0, const uint64_t &stream = 0)
+         : seed_value(seed), stream_index(stream) {
+         // Expanding (seed, stream) to full state with splitmix64
+         uint64_t x = seed ^ (stream * 0xD1B54A32D192ED03ull);
+         for (auto &word : s) {
+             word = splitmix64(x);
+         }
+     }
+ 
+     /**
+      * Function to get seed which is different on every call (used when
+      * user does not supply a seed)
+      * @return returns seed taken from system clock
+      */
+     static uint64_t clock_seed() {
+         return std::chrono::system_clock::now().time_since_epoch().count();
+     }
+ 
+     static constexpr result_type min() { return 0; }
+     static constexpr result_type max() { return UINT64_MAX; }
+ 
+     /**
+      * Function to get next random number
+      * @return returns 64 random bits
+      */
+     result_type operator()() {
+         const uint64_t result = rotl(s[1] * 5, 7) * 9;
+         const uint64_t t = s[1] << 17;
+         s[2] ^= s[0];
+         s[3] ^= s[1];
+         s[1] ^= s[2];
+         s[0] ^= s[3];
+         s[2] ^= t;
+         s[3] = rotl(s[3], 45);
+         return result;
+     }
+ 
+     /**
+      * Function to get uniformly distributed real number (same on every
+      * platform unlike std::uniform_real_distribution)
+      * @param low lower limit on value
+      * @param high upper limit on value
+      * @return returns random number in [low, high)
+      */
+     double uniform(const double &low, const double &high) {
+         // Top 53 bits scaled by 2^-53 give a double in [0, 1)
+         return low + (high - low) * (((*this)() >> 11) *
+                                      (1.0 / 9007199254740992.0));
+     }
+ 
+     /**
+      * Function to get random index
+      * @param n upper limit on index
+      * @return returns random number in [0, n)
+      */
+     uint64_t below(const uint64_t &n) {
+         // Rejecting top values which would make result biased
+         const uint64_t limit = UINT64_MAX - UINT64_MAX % n;
+         uint64_t x = (*this)();
+         while (x >= limit) {
+             x = (*this)();
+         }
+         return x % n;
+     }
+ 
+     /**
+      * Function to get independent generator for a stream. Result depends
+      * only on seed of this generator and stream, so splitting per thread,
+      * per layer or per block of rows is reproducible.
+      * @param stream index of stream
+      * @return returns new generator
+      */
+     Xoshiro256 split(const uint64_t &stream) const {
+         return Xoshiro256(seed_value, splitmix_of(stream_index, stream));
+     }
+ 
+     /**
+      * Function to get seed of the generator
+      * @return returns seed
+      */
+     uint64_t seed() const { return seed_value; }
+ 
+     /**
+      * Overloaded operator "<<" to save full state of the generator
+      * @param out std::ostream to output
+      * @param rng generator to be saved
+      */
+     friend std::ostream &operator<<(std::ostream &out, const Xoshiro256 &rng) {
+         out << rng.seed_value << ' ' << rng.stream_index;
+         for (const auto &word : rng.s) {
+             out << ' ' << word;
+         }
+         return out;
+     }
+ 
+     /**
+      * Overloaded operator ">>" to restore state saved by operator "<<"
+      * @param in std::istream to read from
+      * @param rng generator to be restored
+      */
+     friend std::istream &operator>>(std::istream &in, Xoshiro256 &rng) {
+         in >> rng.seed_value >> rng.stream_index;
+         for (auto &word : rng.s) {
+             in >> word;
+         }
+         return in;
+     }
+ 
+  private:
+     uint64_t s[4];          // State of xoshiro256**
+     uint64_t seed_value;    // Seed the generator was created with
+     uint64_t stream_index;  // Stream the generator was created with
+ 
+     /**
+      * Function to rotate bits left
+      * @param x value
+      * @param k number of bits
+      * @return returns rotated value
+      */
+     static uint64_t rotl(const uint64_t &x, const int &k) {
+         return (x << k) | (x >> (64 - k));
+     }
+ 
+     /**
+      * splitmix64 step (advances x and returns next output)
+      * @param x state of splitmix64
+      * @return returns next output
+      */
+     static uint64_t splitmix64(uint64_t &x) {
+         uint64_t z = (x += 0x9E3779B97F4A7C15ull);
+         z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+         z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+         return z ^ (z >> 31);
+     }
+ 
+     /**
+      * Function to derive index of child stream from parent stream
+      * @param parent index of parent stream
+      * @param child index of child within parent
+      * @return returns index of child stream
+      */
+     static uint64_t splitmix_of(const uint64_t &parent, const uint64_t &child) {
+         uint64_t x = parent * 0x9E3779B97F4A7C15ull + child;
+         return splitmix64(x);
+     }
+ };
+ }  // namespace machine_learning
+ 
+ #endif
@@ -0,0 +1,150 @@
+/**
+ * @file snapshot_writer.hpp
+ *
+ * @brief Background writer of periodic snapshots used by
+ * [NeuralNetwork (aka Multilayer Perceptron)]
+ * (https://en.wikipedia.org/wiki/Multilayer_perceptron) to checkpoint
+ * training without stalling it on text I/O.
+ *
+ * @details
+ * Writer owns two snapshot buffers. Producer copies its state into the
+ * buffer which is not being written and publishes it, a background thread
+ * serializes published buffer into a temporary file and renames it over the
+ * snapshot file, so the file always holds a complete snapshot. If producer
+ * publishes faster than snapshots are written, an unwritten snapshot is
+ * replaced by the newer one instead of making producer wait.
+ */
+ #ifndef SNAPSHOT_WRITER_FOR_NN
+ #define SNAPSHOT_WRITER_FOR_NN
+ 
+ #include <condition_variable>
+ #include <cstdio>
+ #include <fstream>
+ #include <functional>
+ #include <iostream>
+ #include <mutex>
+ #include <string>
+ #include <thread>
+ #include <utility>
+ 
+ /**
+  * @namespace machine_learning
+  * @brief Machine Learning algorithms
+  */
+ namespace machine_learning {
+ /**
+  * SnapshotWriter class writes snapshots of type T on a background thread
+  * from a double buffer (one producer thread).
+  * @tparam T type of snapshot (copy assignable, default constructible)
+  */
+ template <typename T>
+ class SnapshotWriter {
+  public:
+     /**
+      * Constructor for SnapshotWriter class (starts background thread)
+      * @param path file which holds latest written snapshot
+      * @param serializer function serializing snapshot into a stream
+      */
+     SnapshotWriter(const std::string &path,
+                    std::function<void(std::ostream &, const T &)> serializer)
+         : file_name(path), write(std::move(serializer)) {
+         worker = std::thread([this]() { this->write_loop(); });
+     }
+ 
+     SnapshotWriter(const SnapshotWriter &) = delete;
+     SnapshotWriter &operator=(const SnapshotWriter &) = delete;
+ 
+     /**
+      * Destructor for SnapshotWriter class (writes published snapshot, if
+      * any, before returning)
+      */
+     ~SnapshotWriter() {
+         {
+             std::lock_guard<std::mutex> lock(mutex);
+             stopping = true;
+         }
+         changed.notify_all();
+         worker.join();
+     }
+ 
+     /**
+      * Function to get buffer to be filled by producer (never waits, buffer
+      * is the one not being written)
+      * @return returns buffer, valid until publish
+      */
+     T &acquire() {
+         std::lock_guard<std::mutex> lock(mutex);
+         filling = writing == 0 ? 1 : 0;
+         if (pending == filling) {  // Unwritten older snapshot is replaced
+             pending = -1;
+         }
+         return buffers[filling];
+     }
+ 
+     /**
+      * Function to hand buffer returned by acquire to background thread
+      */
+     void publish() {
+         {
+             std::lock_guard<std::mutex> lock(mutex);
+             pending = filling;
+         }
+         changed.notify_all();
+     }
+ 
+     /**
+      * Function to wait until every published snapshot is written
+      */
+     void flush() {
+         std::unique_lock<std::mutex> lock(mutex);
+         changed.wait(lock, [this]() { return pending < 0 && writing < 0; });
+     }
+ 
+  private:
+     std::string file_name;  // File holding latest written snapshot
+     std::function<void(std::ostream &, const T &)> write;  // Serializer
+     T buffers[2];                     // Double buffer of snapshots
+     int filling = -1;                 // Buffer given to producer
+     int pending = -1;                 // Buffer published but not written
+     int writing = -1;                 // Buffer being written
+     bool stopping = false;            // Whether writer is being destroyed
+     std::mutex mutex;                 // Guards indices above
+     std::condition_variable changed;  // Signals change of indices
+     std::thread worker;               // Background thread
+ 
+     /**
+      * Function run by background thread: writes published snapshots until
+      * writer is destroyed
+      */
+     void write_loop() {
+         std::unique_lock<std::mutex> lock(mutex);
+         while (true) {
+             changed.wait(lock, [this]() { return pending >= 0 || stopping; });
+             if (pending < 0) {
+                 return;
+             }
+             writing = pending;
+             pending = -1;
+             lock.unlock();
+             // Complete file replaces old one in a single rename
+             const std::string temporary = file_name + ".tmp";
+             std::ofstream out_file(temporary.c_str(),
+                                    std::ofstream::out | std::ofstream::trunc);
+             write(out_file, buffers[writing]);
+             out_file.close();
+             if (!out_file ||
+                 std::rename(temporary.c_str(), file_name.c_str()) != 0) {
+                 // Training goes on, only this snapshot is lost
+                 std::cerr << "ERROR (" << __func__ << ") : ";
+                 std::cerr << "Unable to write snapshot: " << file_name
+                           << std::endl;
+             }
+             lock.lock();
+             writing = -1;
+             changed.notify_all();
+         }
+     }
+ };
+ }  // namespace machine_learning
+ 
+ #endif
@@ -0,0 +1,105 @@
+/**
+ * @file spsc_queue.hpp
+ *
+ * @brief Lock-free single producer single consumer queue used by
+ * [NeuralNetwork (aka Multilayer Perceptron)]
+ * (https://en.wikipedia.org/wiki/Multilayer_perceptron) to pass micro-batches
+ * between stages of pipelined inference.
+ *
+ * @details
+ * Queue is a fixed ring buffer. Producer only writes tail and consumer only
+ * writes head, so neither side takes a lock; head and tail live on separate
+ * cache lines so the two threads don't invalidate each other's line on every
+ * operation.
+ */
+ #ifndef SPSC_QUEUE_FOR_NN
+ #define SPSC_QUEUE_FOR_NN
+ 
+ #include <atomic>
+ #include <thread>
+ #include <vector>
+ 
+ /**
+  * @namespace machine_learning
+  * @brief Machine Learning algorithms
+  */
+ namespace machine_learning {
+ /**
+  * SPSCQueue class is a bounded ring buffer for exactly one producer thread
+  * and one consumer thread.
+  * @tparam T type of elements (moved in and out)
+  */
+ template <typename T>
+ class SPSCQueue {
+  public:
+     /**
+      * Constructor for SPSCQueue class
+      * @param capacity maximum number of queued elements
+      */
+     explicit SPSCQueue(const size_t &capacity) : slots(capacity + 1) {}
+ 
+     SPSCQueue(const SPSCQueue &) = delete;
+     SPSCQueue &operator=(const SPSCQueue &) = delete;
+ 
+     /**
+      * Function to append element (producer only)
+      * @param value element to be moved into the queue
+      * @return false if queue is full (value is left untouched)
+      */
+     bool try_push(T &value) {
+         const size_t t = tail.load(std::memory_order_relaxed);
+         const size_t next = (t + 1) % slots.size();
+         if (next == head.load(std::memory_order_acquire)) {
+             return false;
+         }
+         slots[t] = std::move(value);
+         tail.store(next, std::memory_order_release);
+         return true;
+     }
+ 
+     /**
+      * Function to remove oldest element (consumer only)
+      * @param value where element is moved to
+      * @return false if queue is empty
+      */
+     bool try_pop(T &value) {
+         const size_t h = head.load(std::memory_order_relaxed);
+         if (h == tail.load(std::memory_order_acquire)) {
+             return false;
+         }
+         value = std::move(slots[h]);
+         head.store((h + 1) % slots.size(), std::memory_order_release);
+         return true;
+     }
+ 
+     /**
+      * Function to append element, yielding while queue is full
+      * @param value element to be moved into the queue
+      */
+     void push(T value) {
+         while (!try_push(value)) {
+             std::this_thread::yield();
+         }
+     }
+ 
+     /**
+      * Function to remove oldest element, yielding while queue is empty
+      * @return returns the element
+      */
+     T pop() {
+         T value;
+         while (!try_pop(value)) {
+             std::this_thread::yield();
+         }
+         return value;
+     }
+ 
+  private:
+     std::vector<T> slots;          // Ring buffer (one slot unused)
+     std::atomic<size_t> head{0};   // Next slot to pop
+     char padding[64];              // Keeps head and tail on separate lines
+     std::atomic<size_t> tail{0};   // Next slot to push
+ };
+ }  // namespace machine_learning
+ 
+ #endif
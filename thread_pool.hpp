@@ -0,0 +1,480 @@
+/**
+ * @file thread_pool.hpp
+ *
+ * @brief Work stealing thread pool used by [NeuralNetwork (aka Multilayer
+ * Perceptron)] (https://en.wikipedia.org/wiki/Multilayer_perceptron) for
+ * batched inference and concurrent training.
+ *
+ * @details
+ * Every worker owns a deque of tasks. A worker pops tasks from the back of
+ * its own deque and, when it runs dry, steals from the front of the other
+ * workers' deques. A thread that waits for a group of tasks helps executing
+ * queued tasks instead of blocking, so groups can be nested (e.g. evaluate()
+ * called from inside a sweep task) without deadlocking.
+ *
+ * Workers can be pinned to cores, filled node by node of the
+ * [NUMA](https://en.wikipedia.org/wiki/Non-uniform_memory_access) topology,
+ * so memory a worker allocates (first touch) stays on its own node.
+ * Topology is read with libnuma when built with -DUSE_LIBNUMA (and -lnuma),
+ * otherwise from /sys/devices/system/node on Linux, and falls back to a
+ * single node elsewhere.
+ */
+ #ifndef THREAD_POOL_FOR_NN
+ #define THREAD_POOL_FOR_NN
+ 
+ #include <algorithm>
+ #include <atomic>
+ #include <condition_variable>
+ #include <deque>
+ #include <fstream>
+ #include <functional>
+ #include <iostream>
+ #include <memory>
+ #include <mutex>
+ #include <sstream>
+ #include <string>
+ #include <thread>
+ #include <vector>
+ 
+ #ifdef __linux__
+ #include <pthread.h>
+ #include <sched.h>
+ #endif
+ #ifdef USE_LIBNUMA
+ #include <numa.h>
+ #endif
+ 
+ /**
+  * @namespace machine_learning
+  * @brief Machine Learning algorithms
+  */
+ namespace machine_learning {
+ /**
+  * Topology struct describes NUMA nodes and CPUs usable by this process
+  */
+ struct Topology {
+     std::vector<std::vector<int>> nodes;  // CPUs of every node
+     std::string source;                   // Where topology was read from
+ 
+     /**
+      * Function to get topology of the machine (detected once)
+      * @return reference to topology
+      */
+     static const Topology &system() {
+         static const Topology topology = detect();
+         return topology;
+     }
+ 
+     /**
+      * Function to get all CPUs ordered node by node
+      * @return CPU ids
+      */
+     std::vector<int> cpus() const {
+         std::vector<int> all;
+         for (const auto &node : nodes) {
+             all.insert(all.end(), node.begin(), node.end());
+         }
+         return all;
+     }
+ 
+     /**
+      * Function to get node of a CPU
+      * @param cpu CPU id
+      * @return index of node (0 if CPU is unknown)
+      */
+     size_t node_of(const int &cpu) const {
+         for (size_t n = 0; n < nodes.size(); n++) {
+             if (std::find(nodes[n].begin(), nodes[n].end(), cpu) !=
+                 nodes[n].end()) {
+                 return n;
+             }
+         }
+         return 0;
+     }
+ 
+     /**
+      * Function to print topology
+      * @param out std::ostream to output
+      */
+     void report(std::ostream &out) const {
+         out << "INFO: Topology (" << source << "): " << nodes.size()
+             << " NUMA node(s)";
+         for (size_t n = 0; n < nodes.size(); n++) {
+             out << (n ? "; " : ", ") << "node " << n << ": "
+                 << nodes[n].size() << " cpu(s) [" << range_list(nodes[n])
+                 << "]";
+         }
+         out << std::endl;
+     }
+ 
+  private:
+     /**
+      * Function to detect topology (libnuma, then sysfs, then one node)
+      * @return detected topology
+      */
+     static Topology detect() {
+         Topology t;
+         const std::vector<int> allowed = allowed_cpus();
+         auto usable = [&allowed](const int &cpu) {
+             return allowed.empty() ||
+                    std::find(allowed.begin(), allowed.end(), cpu) !=
+                        allowed.end();
+         };
+ #ifdef USE_LIBNUMA
+         if (numa_available() >= 0) {
+             t.source = "libnuma";
+             bitmask *mask = numa_allocate_cpumask();
+             for (int n = 0; n <= numa_max_node(); n++) {
+                 std::vector<int> node;
+                 if (numa_node_to_cpus(n, mask) == 0) {
+                     for (unsigned cpu = 0; cpu < mask->size; cpu++) {
+                         if (numa_bitmask_isbitset(mask, cpu) && usable(cpu)) {
+                             node.push_back(cpu);
+                         }
+                     }
+                 }
+                 if (!node.empty()) {
+                     t.nodes.push_back(node);
+                 }
+             }
+             numa_free_cpumask(mask);
+         }
+ #endif
+         for (int n = 0; t.source.empty() || t.source == "sysfs"; n++) {
+             std::ifstream in("/sys/devices/system/node/node" +
+                              std::to_string(n) + "/cpulist");
+             if (!in.is_open()) {
+                 break;
+             }
+             t.source = "sysfs";
+             std::string list;
+             std::getline(in, list);
+             std::vector<int> node;
+             for (const int &cpu : parse_list(list)) {
+                 if (usable(cpu)) {
+                     node.push_back(cpu);
+                 }
+             }
+             if (!node.empty()) {
+                 t.nodes.push_back(node);
+             }
+         }
+         if (t.nodes.empty()) {  // No NUMA information, single node
+             t.source = "fallback";
+             t.nodes.push_back(allowed);
+             for (unsigned cpu = 0;
+                  allowed.empty() &&
+                  cpu < std::max(1u, std::thread::hardware_concurrency());
+                  cpu++) {
+                 t.nodes[0].push_back(cpu);
+             }
+         }
+         return t;
+     }
+ 
+     /**
+      * Function to get CPUs this process may run on
+      * @return CPU ids (empty if unknown)
+      */
+     static std::vector<int> allowed_cpus() {
+         std::vector<int> cpus;
+ #ifdef __linux__
+         cpu_set_t set;
+         CPU_ZERO(&set);
+         if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+             for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                 if (CPU_ISSET(cpu, &set)) {
+                     cpus.push_back(cpu);
+                 }
+             }
+         }
+ #endif
+         return cpus;
+     }
+ 
+     /**
+      * Function to parse CPU list such as "0-3,8-11"
+      * @param list CPU list
+      * @return CPU ids
+      */
+     static std::vector<int> parse_list(const std::string &list) {
+         std::vector<int> cpus;
+         std::stringstream ss(list);
+         std::string range;
+         while (std::getline(ss, range, ',')) {
+             if (range.empty()) {
+                 continue;
+             }
+             const size_t dash = range.find('-');
+             const int low = std::stoi(range.substr(0, dash));
+             const int high =
+                 dash == range.npos ? low : std::stoi(range.substr(dash + 1));
+             for (int cpu = low; cpu <= high; cpu++) {
+                 cpus.push_back(cpu);
+             }
+         }
+         return cpus;
+     }
+ 
+     /**
+      * Function to format CPU ids as CPU list such as "0-3,8-11"
+      * @param cpus sorted CPU ids
+      * @return CPU list
+      */
+     static std::string range_list(const std::vector<int> &cpus) {
+         std::ostringstream out;
+         for (size_t i = 0; i < cpus.size(); i++) {
+             size_t j = i;
+             while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) {
+                 j++;
+             }
+             out << (i ? "," : "") << cpus[i];
+             if (j > i) {
+                 out << "-" << cpus[j];
+             }
+             i = j;
+         }
+         return out.str();
+     }
+ };
+ 
+ /**
+  * ThreadPool class keeps a fixed set of workers alive, each with its own
+  * task deque, and balances load between them with work stealing.
+  */
+ class ThreadPool {
+  public:
+     /**
+      * Constructor for ThreadPool class
+      * @param threads number of workers (default = hardware concurrency)
+      * @param pin flag for whether to pin workers to cores, node by node
+      */
+     explicit ThreadPool(size_t threads = 0, const bool &pin = false)
+         : pinned(pin) {
+         if (threads == 0) {
+             threads = std::max(1u, std::thread::hardware_concurrency());
+         }
+         // Worker i runs on i-th CPU in node order (wrapping around)
+         const Topology &topology = Topology::system();
+         const std::vector<int> cpus = topology.cpus();
+         for (size_t i = 0; i < threads; i++) {
+             queues.emplace_back(new Queue());
+             cpu_of.push_back(cpus[i % cpus.size()]);
+             node_of.push_back(topology.node_of(cpu_of.back()));
+         }
+         for (size_t i = 0; i < threads; i++) {
+             workers.emplace_back(&ThreadPool::worker_loop, this, i);
+         }
+     }
+ 
+     /**
+      * Destructor for ThreadPool class, finishes queued tasks and joins
+      * all workers.
+      */
+     ~ThreadPool() {
+         {
+             std::lock_guard<std::mutex> guard(sleep_lock);
+             stop = true;
+         }
+         wake.notify_all();
+         for (auto &w : workers) {
+             w.join();
+         }
+     }
+ 
+     ThreadPool(const ThreadPool &) = delete;
+     ThreadPool &operator=(const ThreadPool &) = delete;
+ 
+     /**
+      * Function to get number of workers in the pool
+      * @return number of workers
+      */
+     size_t size() const { return workers.size(); }
+ 
+     /**
+      * Function to get number of NUMA nodes workers are spread over
+      * @return number of nodes (1 if workers are not pinned)
+      */
+     size_t nodes() const {
+         return pinned ? Topology::system().nodes.size() : 1;
+     }
+ 
+     /**
+      * Function to get NUMA node of calling thread. A thread which is not a
+      * worker (e.g. one waiting for a group) is looked up by CPU it
+      * currently runs on.
+      * @return node index (0 if workers are not pinned or node is unknown)
+      */
+     size_t current_node() const {
+         if (!pinned) {
+             return 0;
+         }
+         const size_t w = current_worker();
+         if (w < node_of.size()) {
+             return node_of[w];
+         }
+ #ifdef __linux__
+         const int cpu = sched_getcpu();
+         if (cpu >= 0) {
+             return Topology::system().node_of(cpu);
+         }
+ #endif
+         return 0;
+     }
+ 
+     /**
+      * Function to get pool shared by the whole program. Workers are pinned
+      * on machines with more than one NUMA node.
+      * @return reference to global pool
+      */
+     static ThreadPool &global() {
+         static ThreadPool pool(0, Topology::system().nodes.size() > 1);
+         return pool;
+     }
+ 
+     /**
+      * Function to queue a task without waiting for it. Tasks submitted from
+      * a worker go to that worker's own deque, others are spread round
+      * robin.
+      * @param task function to be executed
+      */
+     void submit(std::function<void()> task) {
+         size_t target = current_worker();
+         if (target >= queues.size()) {
+             target = next_queue++ % queues.size();
+         }
+         {  // Counted before push so queued never underflows in run_one
+             std::lock_guard<std::mutex> guard(sleep_lock);
+             queued++;
+         }
+         {
+             std::lock_guard<std::mutex> guard(queues[target]->lock);
+             queues[target]->tasks.push_back(std::move(task));
+         }
+         wake.notify_one();
+     }
+ 
+     /**
+      * Function to run func(0) ... func(count - 1) on the pool and wait for
+      * all of them. Calling thread executes queued tasks while waiting.
+      * @tparam Func callable of form func(index)
+      * @param count number of tasks
+      * @param func function to be called for every index
+      */
+     template <typename Func>
+     void run(const size_t &count, Func func) {
+         auto remaining = std::make_shared<std::atomic<size_t>>(count);
+         for (size_t i = 0; i < count; i++) {
+             submit([remaining, &func, i]() {
+                 func(i);
+                 (*remaining)--;
+             });
+         }
+         while (*remaining > 0) {  // Help instead of blocking
+             if (!run_one(current_worker())) {
+                 std::this_thread::yield();
+             }
+         }
+     }
+ 
+  private:
+     /**
+      * Task deque owned by a single worker
+      */
+     struct Queue {
+         std::mutex lock;
+         std::deque<std::function<void()>> tasks;
+     };
+ 
+     std::vector<std::unique_ptr<Queue>> queues;  // One deque per worker
+     std::vector<std::thread> workers;            // Worker threads
+     std::vector<int> cpu_of;      // CPU of every worker (if pinned)
+     std::vector<size_t> node_of;  // NUMA node of every worker (if pinned)
+     bool pinned;                  // Whether workers are pinned
+     std::mutex sleep_lock;              // Guards queued and stop
+     std::condition_variable wake;       // Wakes idle workers
+     size_t queued = 0;                  // Number of tasks in all deques
+     bool stop = false;                  // Set when pool is destroyed
+     std::atomic<size_t> next_queue{0};  // Round robin target for submit
+ 
+     /**
+      * Function to get index of calling worker in this pool
+      * @return worker index or size() if caller is not a worker
+      */
+     size_t current_worker() const {
+         return current().first == this ? current().second : queues.size();
+     }
+ 
+     /**
+      * Function to get thread local (pool, worker index) of calling thread
+      * @return reference to thread local pair
+      */
+     static std::pair<const ThreadPool *, size_t> &current() {
+         static thread_local std::pair<const ThreadPool *, size_t> id(nullptr,
+                                                                     0);
+         return id;
+     }
+ 
+     /**
+      * Function to pop one task, first from own deque (back) then by
+      * stealing from other deques (front), and execute it.
+      * @param self index of own deque (size() if caller is not a worker)
+      * @return true if a task was executed
+      */
+     bool run_one(const size_t &self) {
+         std::function<void()> task;
+         const size_t n = queues.size();
+         for (size_t k = 0; k < n && !task; k++) {
+             const size_t q = (self + k) % n;
+             std::lock_guard<std::mutex> guard(queues[q]->lock);
+             if (queues[q]->tasks.empty()) {
+                 continue;
+             }
+             if (q == self) {  // Own deque: LIFO for cache locality
+                 task = std::move(queues[q]->tasks.back());
+                 queues[q]->tasks.pop_back();
+             } else {  // Steal oldest task
+                 task = std::move(queues[q]->tasks.front());
+                 queues[q]->tasks.pop_front();
+             }
+         }
+         if (!task) {
+             return false;
+         }
+         {
+             std::lock_guard<std::mutex> guard(sleep_lock);
+             queued--;
+         }
+         task();
+         return true;
+     }
+ 
+     /**
+      * Main loop of every worker
+      * @param index index of the worker
+      */
+     void worker_loop(const size_t index) {
+         current() = std::make_pair(this, index);
+ #ifdef __linux__
+         if (pinned) {  // Failure only costs locality, so it is ignored
+             cpu_set_t set;
+             CPU_ZERO(&set);
+             CPU_SET(cpu_of[index], &set);
+             pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+         }
+ #endif
+         while (true) {
+             if (run_one(index)) {
+                 continue;
+             }
+             std::unique_lock<std::mutex> guard(sleep_lock);
+             wake.wait(guard, [this]() { return stop || queued > 0; });
+             if (stop && queued == 0) {
+                 return;
+             }
+         }
+     }
+ };
+ }  // namespace machine_learning
+ 
+ #endif
@@ -12,11 +12,14 @@
  
  #include <algorithm>
  #include <chrono>
+ #include <cmath>
  #include <iostream>
- #include <random>
  #include <valarray>
  #include <vector>
  
+ #include "rng.hpp"          // Seedable random number generator
+ #include "thread_pool.hpp"  // Work stealing thread pool
+ 
  /**
   * @namespace machine_learning
   * @brief Machine Learning algorithms
@@ -131,10 +134,12 @@
   * @tparam T typename of the vector
   * @param A First 3D vector
   * @param B Second 3D vector
+  * @param rng random number generator
   */
  template <typename T>
  void equal_shuffle(std::vector<std::vector<std::valarray<T>>> &A,
-                    std::vector<std::vector<std::valarray<T>>> &B) {
+                    std::vector<std::vector<std::valarray<T>>> &B,
+                    Xoshiro256 &rng) {
      // If two vectors have different sizes
      if (A.size() != B.size()) {
          std::cerr << "ERROR (" << __func__ << ") : ";
@@ -143,46 +148,122 @@
          std::cerr << A.size() << " and " << B.size() << std::endl;
          std::exit(EXIT_FAILURE);
      }
-     for (size_t i = 0; i < A.size(); i++) {  // For every element in A and B
-         // Genrating random index < size of A and B
-         std::srand(std::chrono::system_clock::now().time_since_epoch().count());
-         size_t random_index = std::rand() % A.size();
+     for (size_t i = A.size(); i > 1; i--) {  // Fisher-Yates shuffle
+         // Genrating random index < i
+         size_t random_index = rng.below(i);
          // Swap elements in both A and B with same random index
-         std::swap(A[i], A[random_index]);
-         std::swap(B[i], B[random_index]);
+         std::swap(A[i - 1], A[random_index]);
+         std::swap(B[i - 1], B[random_index]);
      }
      return;
  }
  
  /**
-  * Function to initialize given 2D vector using uniform random initialization
+  * Function to equally shuffle two 3D vectors (used for shuffling training data)
+  * with generator seeded from system clock
+  * @tparam T typename of the vector
+  * @param A First 3D vector
+  * @param B Second 3D vector
+  */
+ template <typename T>
+ void equal_shuffle(std::vector<std::vector<std::valarray<T>>> &A,
+                    std::vector<std::vector<std::valarray<T>>> &B) {
+     Xoshiro256 rng(Xoshiro256::clock_seed());
+     equal_shuffle(A, B, rng);
+ }
+ 
+ /**
+  * Function to initialize given 2D vector using uniform random initialization.
+  * Rows are generated in blocks, every block from its own stream of rng, so
+  * large kernels are filled in parallel and result does not depend on number
+  * of threads.
   * @tparam T typename of the vector
   * @param A 2D vector to be initialized
   * @param shape required shape
   * @param low lower limit on value
   * @param high upper limit on value
+  * @param rng random number generator (only its streams are used)
   */
  template <typename T>
  void uniform_random_initialization(std::vector<std::valarray<T>> &A,
                                     const std::pair<size_t, size_t> &shape,
-                                    const T &low, const T &high) {
-     A.clear();  // Making A empty
-     // Uniform distribution in range [low, high]
-     std::default_random_engine generator(
-         std::chrono::system_clock::now().time_since_epoch().count());
-     std::uniform_real_distribution<T> distribution(low, high);
-     for (size_t i = 0; i < shape.first; i++) {  // For every row
-         std::valarray<T>
-             row;  // Making empty row which will be inserted in vector
-         row.resize(shape.second);
-         for (auto &r : row) {             // For every element in row
-             r = distribution(generator);  // copy random number
+                                    const T &low, const T &high,
+                                    const Xoshiro256 &rng) {
+     const size_t block_rows = 64;  // Rows generated from one stream
+     const size_t blocks = (shape.first + block_rows - 1) / block_rows;
+     A.assign(shape.first, std::valarray<T>(shape.second));
+     auto fill_block = [&](size_t b) {
+         Xoshiro256 stream = rng.split(b);
+         for (size_t i = b * block_rows;
+              i < std::min(shape.first, (b + 1) * block_rows); i++) {
+             for (auto &r : A[i]) {  // For every element in row
+                 r = T(stream.uniform(low, high));  // copy random number
+             }
          }
-         A.push_back(row);  // Insert new row in vector
+     };
+     // Small kernels are not worth waking the thread pool for
+     if (shape.first * shape.second < (1u << 16)) {
+         for (size_t b = 0; b < blocks; b++) {
+             fill_block(b);
+         }
+     } else {
+         ThreadPool::global().run(blocks, fill_block);
      }
      return;
  }
  
+ /**
+  * Function to initialize given 2D vector using uniform random initialization
+  * with generator seeded from system clock
+  * @tparam T typename of the vector
+  * @param A 2D vector to be initialized
+  * @param shape required shape
+  * @param low lower limit on value
+  * @param high upper limit on value
+  */
+ template <typename T>
+ void uniform_random_initialization(std::vector<std::valarray<T>> &A,
+                                    const std::pair<size_t, size_t> &shape,
+                                    const T &low, const T &high) {
+     uniform_random_initialization(A, shape, low, high,
+                                   Xoshiro256(Xoshiro256::clock_seed()));
+ }
+ 
+ /**
+  * Function to initialize given 2D vector (kernel of shape (fan_in, fan_out))
+  * using Xavier (Glorot) uniform initialization, suited for sigmoid, tanh and
+  * softmax activations
+  * @tparam T typename of the vector
+  * @param A 2D vector to be initialized
+  * @param shape required shape
+  * @param rng random number generator (only its streams are used)
+  */
+ template <typename T>
+ void xavier_initialization(std::vector<std::valarray<T>> &A,
+                            const std::pair<size_t, size_t> &shape,
+                            const Xoshiro256 &rng) {
+     // Uniform in [-limit, limit] has variance 2 / (fan_in + fan_out)
+     const T limit = std::sqrt(T(6) / T(shape.first + shape.second));
+     uniform_random_initialization(A, shape, -limit, limit, rng);
+ }
+ 
+ /**
+  * Function to initialize given 2D vector (kernel of shape (fan_in, fan_out))
+  * using He (Kaiming) uniform initialization, suited for relu activation
+  * @tparam T typename of the vector
+  * @param A 2D vector to be initialized
+  * @param shape required shape
+  * @param rng random number generator (only its streams are used)
+  */
+ template <typename T>
+ void he_initialization(std::vector<std::valarray<T>> &A,
+                        const std::pair<size_t, size_t> &shape,
+                        const Xoshiro256 &rng) {
+     // Uniform in [-limit, limit] has variance 2 / fan_in
+     const T limit = std::sqrt(T(6) / T(shape.first));
+     uniform_random_initialization(A, shape, -limit, limit, rng);
+ }
+ 
  /**
   * Function to Intialize 2D vector as unit matrix
   * @tparam T typename of the vector
@@ -509,6 +590,431 @@
      }
      return C;  // Return new resultant 2D vector
  }
+ 
+ /**
+  * Function to unfold sliding windows of grids into rows (im2col), so a
+  * convolution becomes a single matrix product with the kernel. Every row
+  * of A is a grid of shape (channels, height, width) flattened in that
+  * order, every window becomes one row of the result with values in
+  * (channel, y, x) order.
+  * @tparam T typename of the vector
+  * @param A 2D vector, one grid per row
+  * @param channels number of channels of the grid
+  * @param height height of the grid
+  * @param width width of the grid
+  * @param size width (and height) of the window
+  * @param stride step between windows
+  * @return new resultant vector of shape (rows of A * windows,
+  * channels * size * size)
+  */
+ template <typename T>
+ std::vector<std::valarray<T>> im2col(const std::vector<std::valarray<T>> &A,
+                                      const size_t &channels,
+                                      const size_t &height, const size_t &width,
+                                      const size_t &size, const size_t &stride) {
+     const size_t out_h = (height - size) / stride + 1;
+     const size_t out_w = (width - size) / stride + 1;
+     std::vector<std::valarray<T>> B(
+         A.size() * out_h * out_w, std::valarray<T>(channels * size * size));
+     for (size_t r = 0; r < A.size(); r++) {  // For every grid
+         for (size_t y = 0; y < out_h; y++) {
+             for (size_t x = 0; x < out_w; x++) {
+                 auto &row = B[(r * out_h + y) * out_w + x];
+                 size_t k = 0;
+                 for (size_t c = 0; c < channels; c++) {
+                     for (size_t i = 0; i < size; i++) {
+                         // Copying one line of the window
+                         const size_t start = (c * height + y * stride + i) *
+                                                  width + x * stride;
+                         for (size_t j = 0; j < size; j++) {
+                             row[k++] = A[r][start + j];
+                         }
+                     }
+                 }
+             }
+         }
+     }
+     return B;  // Return new resultant 2D vector
+ }
+ 
+ /**
+  * Function to fold rows of windows back into grids (col2im), inverse of
+  * im2col where values of overlapping windows are added
+  * @tparam T typename of the vector
+  * @param B 2D vector of windows (as returned by im2col)
+  * @param rows number of grids
+  * @param channels number of channels of the grid
+  * @param height height of the grid
+  * @param width width of the grid
+  * @param size width (and height) of the window
+  * @param stride step between windows
+  * @return new resultant vector of shape (rows, channels * height * width)
+  */
+ template <typename T>
+ std::vector<std::valarray<T>> col2im(const std::vector<std::valarray<T>> &B,
+                                      const size_t &rows, const size_t &channels,
+                                      const size_t &height, const size_t &width,
+                                      const size_t &size, const size_t &stride) {
+     const size_t out_h = (height - size) / stride + 1;
+     const size_t out_w = (width - size) / stride + 1;
+     std::vector<std::valarray<T>> A(
+         rows, std::valarray<T>(T(0), channels * height * width));
+     for (size_t r = 0; r < rows; r++) {  // For every grid
+         for (size_t y = 0; y < out_h; y++) {
+             for (size_t x = 0; x < out_w; x++) {
+                 const auto &row = B[(r * out_h + y) * out_w + x];
+                 size_t k = 0;
+                 for (size_t c = 0; c < channels; c++) {
+                     for (size_t i = 0; i < size; i++) {
+                         const size_t start = (c * height + y * stride + i) *
+                                                  width + x * stride;
+                         for (size_t j = 0; j < size; j++) {
+                             A[r][start + j] += row[k++];
+                         }
+                     }
+                 }
+             }
+         }
+     }
+     return A;  // Return new resultant 2D vector
+ }
+ 
+ /**
+  * Sparse matrix in compressed sparse row (CSR) format. Used to store input
+  * data whose rows are mostly zeros, so work scales with non-zero values.
+  * @tparam T typename of the values
+  */
+ template <typename T>
+ struct CSRMatrix {
+     std::vector<T> values;        // Non-zero values (row by row)
+     std::vector<size_t> columns;  // Column index of every value
+     std::vector<size_t> offsets = std::vector<size_t>(1, 0);  // Row starts
+     size_t cols = 0;                                          // Width
+ 
+     /**
+      * Function to get number of rows
+      * @return number of rows
+      */
+     size_t rows() const { return offsets.size() - 1; }
+ 
+     /**
+      * Function to get row as dense 2D vector of shape (1, cols)
+      * @param r index of row
+      * @return new dense row
+      */
+     std::vector<std::valarray<T>> dense_row(const size_t &r) const {
+         std::valarray<T> row(T(0), cols);
+         for (size_t k = offsets[r]; k < offsets[r + 1]; k++) {
+             row[columns[k]] = values[k];
+         }
+         return {row};
+     }
+ };
+ 
+ /**
+  * Function to get fraction of non-zero elements in 3D vector
+  * @tparam T typename of the vector
+  * @param A 3D vector (used for data, every element of shape (1, X))
+  * @return returns density between 0 and 1
+  */
+ template <typename T>
+ double density(const std::vector<std::vector<std::valarray<T>>> &A) {
+     size_t non_zero = 0, total = 0;
+     for (const auto &a : A) {
+         for (const auto &row : a) {
+             for (const auto &x : row) {
+                 non_zero += (x != T(0));
+             }
+             total += row.size();
+         }
+     }
+     return total ? double(non_zero) / total : 0.0;
+ }
+ 
+ /**
+  * Function to convert 3D vector of samples to CSR matrix (one row per
+  * sample)
+  * @tparam T typename of the vector
+  * @param A 3D vector, every element of shape (1, X)
+  * @return new CSR matrix
+  */
+ template <typename T>
+ CSRMatrix<T> to_csr(const std::vector<std::vector<std::valarray<T>>> &A) {
+     CSRMatrix<T> B;
+     B.cols = A.empty() ? 0 : get_shape(A[0]).second;
+     B.offsets.reserve(A.size() + 1);
+     for (const auto &a : A) {  // For every sample
+         if (a.size() != 1 || a[0].size() != B.cols) {
+             std::cerr << "ERROR (" << __func__ << ") : ";
+             std::cerr << "Supplied vector is not eligible for CSR, shape: ";
+             std::cerr << get_shape(a) << std::endl;
+             std::exit(EXIT_FAILURE);
+         }
+         for (size_t j = 0; j < B.cols; j++) {
+             if (a[0][j] != T(0)) {  // Store only non-zero values
+                 B.values.push_back(a[0][j]);
+                 B.columns.push_back(j);
+             }
+         }
+         B.offsets.push_back(B.values.size());
+     }
+     return B;
+ }
+ 
+ /**
+  * Function to multiply range of rows of CSR matrix with 2D vector.
+  * Every non-zero A[i][k] adds A[i][k] * B[k] to row i, so cost is
+  * proportional to non-zero values instead of width of A.
+  * @tparam T typename of the vector
+  * @param A CSR matrix
+  * @param begin index of first row
+  * @param end index after last row
+  * @param B 2D vector
+  * @return new resultant vector of shape (end - begin, columns of B)
+  */
+ template <typename T>
+ std::vector<std::valarray<T>> multiply(const CSRMatrix<T> &A,
+                                        const size_t &begin, const size_t &end,
+                                        const std::vector<std::valarray<T>> &B) {
+     const auto shape_b = get_shape(B);
+     // If vectors are not eligible for multiplication
+     if (A.cols != shape_b.first) {
+         std::cerr << "ERROR (" << __func__ << ") : ";
+         std::cerr << "Vectors are not eligible for multiplication ";
+         std::cerr << std::make_pair(A.rows(), A.cols) << " and " << shape_b
+                   << std::endl;
+         std::exit(EXIT_FAILURE);
+     }
+     std::vector<std::valarray<T>> C;  // Vector to store result
+     C.reserve(end - begin);
+     for (size_t i = begin; i < end; i++) {
+         std::valarray<T> row(T(0), shape_b.second);
+         for (size_t k = A.offsets[i]; k < A.offsets[i + 1]; k++) {
+             row += A.values[k] * B[A.columns[k]];
+         }
+         C.push_back(row);
+     }
+     return C;  // Return new resultant 2D vector
+ }
+ 
+ /**
+  * Sparse matrix stored as square blocks, where only blocks with a non-zero
+  * value are kept (block sparse row format). Used to store pruned kernels,
+  * so multiplication skips whole zero blocks and still runs dense inner
+  * loops inside a block.
+  * @tparam T typename of the values
+  */
+ template <typename T>
+ struct BlockSparseMatrix {
+     size_t rows = 0, cols = 0;  // Shape of the (dense) matrix
+     size_t block = 1;           // Width (and height) of a block
+     std::vector<size_t> offsets = std::vector<size_t>(1, 0);  // Block rows
+     std::vector<size_t> columns;  // Block column of every stored block
+     std::vector<T> values;  // block * block values of every stored block
+                             // (row major, zero padded at the borders)
+ 
+     /**
+      * Function to get number of stored blocks
+      * @return number of non-zero blocks
+      */
+     size_t blocks() const { return columns.size(); }
+ 
+     /**
+      * Function to get matrix as dense 2D vector
+      * @return new dense vector of shape (rows, cols)
+      */
+     std::vector<std::valarray<T>> dense() const {
+         std::vector<std::valarray<T>> A(rows, std::valarray<T>(T(0), cols));
+         for (size_t br = 0; br + 1 < offsets.size(); br++) {
+             for (size_t k = offsets[br]; k < offsets[br + 1]; k++) {
+                 for (size_t r = 0; r < block && br * block + r < rows; r++) {
+                     for (size_t c = 0;
+                          c < block && columns[k] * block + c < cols; c++) {
+                         A[br * block + r][columns[k] * block + c] =
+                             values[(k * block + r) * block + c];
+                     }
+                 }
+             }
+         }
+         return A;
+     }
+ };
+ 
+ /**
+  * Function to convert 2D vector to block sparse matrix (blocks which are
+  * all zero are dropped)
+  * @tparam T typename of the vector
+  * @param A 2D vector
+  * @param block width (and height) of a block
+  * @return new block sparse matrix
+  */
+ template <typename T>
+ BlockSparseMatrix<T> to_block_sparse(const std::vector<std::valarray<T>> &A,
+                                      const size_t &block) {
+     const auto shape = get_shape(A);
+     BlockSparseMatrix<T> B;
+     B.rows = shape.first;
+     B.cols = shape.second;
+     B.block = block;
+     std::vector<T> values(block * block);
+     for (size_t br = 0; br * block < B.rows; br++) {  // For every block row
+         for (size_t bc = 0; bc * block < B.cols; bc++) {
+             bool non_zero = false;
+             for (size_t r = 0; r < block; r++) {
+                 for (size_t c = 0; c < block; c++) {
+                     const size_t i = br * block + r, j = bc * block + c;
+                     values[r * block + c] =
+                         i < B.rows && j < B.cols ? A[i][j] : T(0);
+                     non_zero = non_zero || values[r * block + c] != T(0);
+                 }
+             }
+             if (non_zero) {  // Store only non-zero blocks
+                 B.columns.push_back(bc);
+                 B.values.insert(B.values.end(), values.begin(), values.end());
+             }
+         }
+         B.offsets.push_back(B.columns.size());
+     }
+     return B;
+ }
+ 
+ /**
+  * Function to multiply 2D vector with block sparse matrix. Only stored
+  * blocks are visited, so work scales with number of non-zero blocks.
+  * @tparam T typename of the vector
+  * @param A 2D vector
+  * @param B block sparse matrix
+  * @return new resultant vector of shape (rows of A, cols of B)
+  */
+ template <typename T>
+ std::vector<std::valarray<T>> multiply(const std::vector<std::valarray<T>> &A,
+                                        const BlockSparseMatrix<T> &B) {
+     const auto shape_a = get_shape(A);
+     // If vectors are not eligible for multiplication
+     if (shape_a.second != B.rows) {
+         std::cerr << "ERROR (" << __func__ << ") : ";
+         std::cerr << "Vectors are not eligible for multiplication ";
+         std::cerr << shape_a << " and " << std::make_pair(B.rows, B.cols)
+                   << std::endl;
+         std::exit(EXIT_FAILURE);
+     }
+     const size_t b = B.block;
+     // Output is computed in a row padded to whole blocks
+     const size_t padded = (B.cols + b - 1) / b * b;
+     std::vector<std::valarray<T>> C;  // Vector to store result
+     C.reserve(A.size());
+     std::valarray<T> row(padded);
+     for (const auto &a : A) {
+         row = T(0);
+         for (size_t br = 0; br + 1 < B.offsets.size(); br++) {
+             const size_t height = std::min(b, B.rows - br * b);
+             for (size_t k = B.offsets[br]; k < B.offsets[br + 1]; k++) {
+                 const T *block = &B.values[k * b * b];
+                 T *out = &row[B.columns[k] * b];
+                 for (size_t r = 0; r < height; r++) {
+                     const T x = a[br * b + r];
+                     for (size_t c = 0; c < b; c++) {
+                         out[c] += x * block[r * b + c];
+                     }
+                 }
+             }
+         }
+         C.push_back(std::valarray<T>(row[std::slice(0, B.cols, 1)]));
+     }
+     return C;  // Return new resultant 2D vector
+ }
+ 
+ /**
+  * Function to multiply 2D vector with transpose of block sparse matrix
+  * (propagates error through a pruned kernel). Only stored blocks are
+  * visited.
+  * @tparam T typename of the vector
+  * @param A 2D vector of shape (n, cols of B)
+  * @param B block sparse matrix
+  * @return new resultant vector of shape (rows of A, rows of B)
+  */
+ template <typename T>
+ std::vector<std::valarray<T>> multiply_transposed(
+     const std::vector<std::valarray<T>> &A, const BlockSparseMatrix<T> &B) {
+     const auto shape_a = get_shape(A);
+     // If vectors are not eligible for multiplication
+     if (shape_a.second != B.cols) {
+         std::cerr << "ERROR (" << __func__ << ") : ";
+         std::cerr << "Vectors are not eligible for multiplication ";
+         std::cerr << shape_a << " and transpose of "
+                   << std::make_pair(B.rows, B.cols) << std::endl;
+         std::exit(EXIT_FAILURE);
+     }
+     const size_t b = B.block;
+     std::vector<std::valarray<T>> C;  // Vector to store result
+     C.reserve(A.size());
+     for (const auto &a : A) {
+         std::valarray<T> row(T(0), B.rows);
+         for (size_t br = 0; br + 1 < B.offsets.size(); br++) {
+             const size_t height = std::min(b, B.rows - br * b);
+             for (size_t k = B.offsets[br]; k < B.offsets[br + 1]; k++) {
+                 const size_t width = std::min(b, B.cols - B.columns[k] * b);
+                 const T *block = &B.values[k * b * b];
+                 const T *in = &a[B.columns[k] * b];
+                 for (size_t r = 0; r < height; r++) {
+                     T dot = 0;
+                     for (size_t c = 0; c < width; c++) {
+                         dot += block[r * b + c] * in[c];
+                     }
+                     row[br * b + r] += dot;
+                 }
+             }
+         }
+         C.push_back(std::move(row));
+     }
+     return C;  // Return new resultant 2D vector
+ }
+ 
+ /**
+  * Function to add scale * A^T * E to stored blocks of block sparse matrix
+  * (gradient step of a pruned kernel). Blocks which are not stored, and
+  * padding of stored blocks, stay zero.
+  * @tparam T typename of the vector
+  * @param B block sparse matrix to be updated
+  * @param A 2D vector of shape (n, rows of B)
+  * @param E 2D vector of shape (n, cols of B)
+  * @param scale factor of the product
+  */
+ template <typename T>
+ void add_transposed_product(BlockSparseMatrix<T> &B,
+                             const std::vector<std::valarray<T>> &A,
+                             const std::vector<std::valarray<T>> &E,
+                             const T &scale) {
+     const auto shape_a = get_shape(A), shape_e = get_shape(E);
+     if (shape_a.first != shape_e.first || shape_a.second != B.rows ||
+         shape_e.second != B.cols) {
+         std::cerr << "ERROR (" << __func__ << ") : ";
+         std::cerr << "Vectors are not eligible for update ";
+         std::cerr << shape_a << ", " << shape_e << " and "
+                   << std::make_pair(B.rows, B.cols) << std::endl;
+         std::exit(EXIT_FAILURE);
+     }
+     const size_t b = B.block;
+     for (size_t n = 0; n < A.size(); n++) {
+         for (size_t br = 0; br + 1 < B.offsets.size(); br++) {
+             const size_t height = std::min(b, B.rows - br * b);
+             for (size_t k = B.offsets[br]; k < B.offsets[br + 1]; k++) {
+                 const size_t width = std::min(b, B.cols - B.columns[k] * b);
+                 T *block = &B.values[k * b * b];
+                 const T *e = &E[n][B.columns[k] * b];
+                 for (size_t r = 0; r < height; r++) {
+                     const T x = A[n][br * b + r];
+                     if (x == T(0)) {  // Zero inputs (e.g. relu) change nothing
+                         continue;
+                     }
+                     for (size_t c = 0; c < width; c++) {
+                         block[r * b + c] += scale * (x * e[c]);
+                     }
+                 }
+             }
+         }
+     }
+ }
  }  // namespace machine_learning
  
  #endif
\ No newline at end of file